@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -25,3 +26,37 @@ void buf_appendc(struct buf *b, char c) {
 void buf_appends(struct buf *b, const char *s) {
 	buf_append(b, s, strlen(s));
 }
+
+void buf_append_json(struct buf *b, const char *s, size_t n) {
+	char esc[8];
+	size_t i;
+
+	buf_appendc(b, '"');
+	for (i = 0; i < n; i++) {
+		switch (s[i]) {
+		case '"':
+			buf_appends(b, "\\\"");
+			break;
+		case '\\':
+			buf_appends(b, "\\\\");
+			break;
+		case '\n':
+			buf_appends(b, "\\n");
+			break;
+		case '\t':
+			buf_appends(b, "\\t");
+			break;
+		case '\r':
+			buf_appends(b, "\\r");
+			break;
+		default:
+			if ((unsigned char)s[i] < 0x20) {
+				snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)s[i]);
+				buf_appends(b, esc);
+			}
+			else
+				buf_appendc(b, s[i]);
+		}
+	}
+	buf_appendc(b, '"');
+}
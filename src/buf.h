@@ -41,4 +41,14 @@ void buf_appends(
 	const char *
 );
 
+/*
+ * Append n bytes from s as a quoted JSON string.  Bytes from 0x80 up
+ * are copied as they are, so UTF-8 text stays UTF-8.
+ */
+void buf_append_json(
+	struct buf *,
+	const char *,
+	size_t
+);
+
 #endif
@@ -0,0 +1,170 @@
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "vsha256.h"
+#include "cache.h"
+
+struct cache_entry {
+	char name[VSHA256_LEN * 2 + 1];
+	off_t size;
+	time_t mtime;
+};
+
+int cache_open(struct result_cache *c, const char *dir, unsigned long max_bytes) {
+	memset(c, 0, sizeof(*c));
+	c->dir = dir;
+	c->max_bytes = max_bytes;
+	c->saved_stdout = -1;
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		perror(dir);
+		return (-1);
+	}
+	return (0);
+}
+
+void cache_key(
+    struct result_cache *c, const char * const *parts, int nparts,
+    const char *buf, long len) {
+	VSHA256_CTX ctx;
+	unsigned char digest[VSHA256_LEN];
+	char hex[VSHA256_LEN * 2 + 1];
+	int i;
+
+	VSHA256_Init(&ctx);
+	for (i = 0; i < nparts; i++)
+		VSHA256_Update(&ctx, parts[i], strlen(parts[i]) + 1);
+	VSHA256_Update(&ctx, buf, (size_t)len);
+	VSHA256_Final(digest, &ctx);
+	for (i = 0; i < VSHA256_LEN; i++)
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+	snprintf(c->path, sizeof(c->path), "%s/%s", c->dir, hex);
+}
+
+/*
+ * Copy a file to stdout.  Returns 0 on success, -1 on error.
+ */
+static int copy_to_stdout(const char *path) {
+	char buf[65536];
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (-1);
+	fflush(stdout);
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (write(STDOUT_FILENO, buf, (size_t)n) != n) {
+			close(fd);
+			return (-1);
+		}
+	}
+	close(fd);
+	return (n < 0 ? -1 : 0);
+}
+
+int cache_fetch(struct result_cache *c) {
+	if (access(c->path, R_OK) != 0)
+		return (0);
+	if (copy_to_stdout(c->path) != 0)
+		return (0);
+	utimes(c->path, NULL);
+	return (1);
+}
+
+int cache_begin(struct result_cache *c) {
+	int fd;
+
+	snprintf(c->tmp, sizeof(c->tmp), "%s/.tmp.XXXXXX", c->dir);
+	fd = mkstemp(c->tmp);
+	if (fd < 0) {
+		perror("mkstemp");
+		return (-1);
+	}
+	fflush(stdout);
+	c->saved_stdout = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+	return (0);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+	const struct cache_entry *ea = a, *eb = b;
+
+	if (ea->mtime != eb->mtime)
+		return (ea->mtime < eb->mtime ? -1 : 1);
+	return (strcmp(ea->name, eb->name));
+}
+
+/*
+ * Remove least recently used entries until the cache fits.
+ */
+static void cache_evict(struct result_cache *c) {
+	struct cache_entry *ents;
+	struct dirent *de;
+	struct stat st;
+	char path[1024];
+	unsigned long total;
+	int n, cap, i;
+	DIR *d;
+
+	d = opendir(c->dir);
+	if (d == NULL)
+		return;
+	ents = NULL;
+	n = 0;
+	cap = 0;
+	total = 0;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.' || strlen(de->d_name) != VSHA256_LEN * 2)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", c->dir, de->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (n == cap) {
+			cap = cap > 0 ? cap * 2 : 64;
+			ents = realloc(ents, cap * sizeof(*ents));
+		}
+		snprintf(ents[n].name, sizeof(ents[n].name), "%s", de->d_name);
+		ents[n].size = st.st_size;
+		ents[n].mtime = st.st_mtime;
+		total += (unsigned long)st.st_size;
+		n++;
+	}
+	closedir(d);
+
+	if (total > c->max_bytes) {
+		qsort(ents, n, sizeof(*ents), entry_cmp);
+		for (i = 0; i < n && total > c->max_bytes; i++) {
+			snprintf(path, sizeof(path), "%s/%s", c->dir, ents[i].name);
+			if (unlink(path) == 0)
+				total -= (unsigned long)ents[i].size;
+		}
+	}
+	free(ents);
+}
+
+void cache_end(struct result_cache *c, int store) {
+	if (c->saved_stdout < 0)
+		return;
+	fflush(stdout);
+	dup2(c->saved_stdout, STDOUT_FILENO);
+	close(c->saved_stdout);
+	c->saved_stdout = -1;
+
+	copy_to_stdout(c->tmp);
+	if (store && rename(c->tmp, c->path) == 0) {
+		cache_evict(c);
+		return;
+	}
+	unlink(c->tmp);
+}
@@ -0,0 +1,69 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_MAX_BYTES (64UL * 1024 * 1024)
+
+/*
+ * Content-addressed result cache (--cache-dir).  Each entry is the
+ * complete stdout of one run, stored under the hex SHA-256 of its
+ * key.  Entries are written to a temporary file and renamed into
+ * place; eviction removes the least recently used entries (by
+ * mtime) once the directory exceeds max_bytes.
+ */
+struct result_cache {
+	const char *dir;
+	unsigned long max_bytes;
+	char path[1024];
+	char tmp[1024];
+	int saved_stdout;
+};
+
+/*
+ * Set up a cache in dir (created if missing) bounded to max bytes.
+ * Returns 0 on success, -1 on error.
+ */
+int cache_open(
+	struct result_cache *,
+	const char *,
+	unsigned long
+);
+
+/*
+ * Compute the entry path from the key parts (command, input name,
+ * normalized arguments, tool version, apply-patch's patch digest)
+ * and the input bytes.
+ */
+void cache_key(
+	struct result_cache *,
+	const char * const *,
+	int,
+	const char *,
+	long
+);
+
+/*
+ * On a hit, copy the stored entry to stdout, mark it recently used
+ * and return 1.  Return 0 on a miss.
+ */
+int cache_fetch(
+	struct result_cache *
+);
+
+/*
+ * Start capturing stdout into a temporary entry.
+ * Returns 0 on success, -1 on error.
+ */
+int cache_begin(
+	struct result_cache *
+);
+
+/*
+ * Stop capturing, copy the captured output to stdout, and either
+ * store it as the entry (then evict) or discard it.
+ */
+void cache_end(
+	struct result_cache *,
+	int
+);
+
+#endif
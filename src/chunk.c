@@ -0,0 +1,352 @@
+#include "config.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "token.h"
+#include "lex.h"
+#include "edit.h"
+#include "tokfile.h"
+#include "format.h"
+#include "chunk.h"
+
+struct lex_chunk {
+	size_t off;
+	size_t len;
+	char *text;
+	struct source *src;
+};
+
+struct fmt_chunk {
+	struct token *start;
+	struct token *end;
+	const char *last_end;
+	unsigned prev_tok;
+	int first;
+	int last;
+	struct tok_sink sink;
+};
+
+struct pool {
+	void (*fn)(void *, int);
+	void *arg;
+	int n;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static void *pool_worker(void *arg) {
+	struct pool *p = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+		if (i >= p->n)
+			break;
+		p->fn(p->arg, i);
+	}
+	return (NULL);
+}
+
+/*
+ * Call fn(arg, i) for i in [0, n) on up to jobs threads.
+ */
+static void run_pool(void (*fn)(void *, int), void *arg, int n, int jobs) {
+	struct pool p;
+	pthread_t *tids;
+	int i;
+
+	p.fn = fn;
+	p.arg = arg;
+	p.n = n;
+	p.next = 0;
+	pthread_mutex_init(&p.lock, NULL);
+	if (jobs > n)
+		jobs = n;
+	tids = malloc(jobs * sizeof(*tids));
+	for (i = 0; i < jobs; i++)
+		pthread_create(&tids[i], NULL, pool_worker, &p);
+	for (i = 0; i < jobs; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	pthread_mutex_destroy(&p.lock);
+}
+
+/*
+ * Return the offset just past the first occurrence of s at or after
+ * p, or len if there is none.
+ */
+static size_t skip_past(const char *b, size_t len, size_t p, const char *s) {
+	const char *q;
+	size_t n = strlen(s);
+
+	for (q = b + p; q + n <= b + len; q++) {
+		if (memcmp(q, s, n) == 0)
+			return ((size_t)(q - b) + n);
+	}
+	return (len);
+}
+
+int chunk_next_cut(const char *b, size_t len, size_t *pos) {
+	size_t p;
+	int depth;
+
+	depth = 0;
+	for (p = *pos; p < len; ) {
+		if (b[p] == '"' && p + 2 < len && b[p + 1] == '"' && b[p + 2] == '"') {
+			p = skip_past(b, len, p + 3, "\"\"\"");
+			continue;
+		}
+		if (b[p] == '"') {
+			for (p++; p < len && b[p] != '"' && b[p] != '\n'; p++)
+				continue;
+			p++;
+			continue;
+		}
+		if (b[p] == '{' && p + 1 < len && b[p + 1] == '"') {
+			p = skip_past(b, len, p + 2, "\"}");
+			continue;
+		}
+		if (b[p] == '#' || (b[p] == '/' && p + 1 < len && b[p + 1] == '/')) {
+			for (; p < len && b[p] != '\n'; p++)
+				continue;
+			continue;
+		}
+		if (b[p] == '/' && p + 1 < len && b[p + 1] == '*') {
+			p = skip_past(b, len, p + 2, "*/");
+			continue;
+		}
+		if (b[p] == 'C' && p + 1 < len && b[p + 1] == '{' &&
+		    (p == 0 || !(isalnum((unsigned char)b[p - 1]) || b[p - 1] == '_'))) {
+			p = skip_past(b, len, p + 2, "}C");
+			continue;
+		}
+		if (b[p] == '{')
+			depth++;
+		else if (b[p] == '}')
+			depth--;
+		p++;
+		if (depth == 0 && (b[p - 1] == ';' || b[p - 1] == '}')) {
+			*pos = p;
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Find cut points roughly len / n apart.  Returns the number of cuts
+ * stored.
+ */
+static int find_cuts(const char *b, size_t len, int n, size_t *cuts) {
+	size_t p, target;
+	int k;
+
+	k = 0;
+	p = 0;
+	target = len / n;
+	while (k < n - 1 && chunk_next_cut(b, len, &p) && p < len) {
+		if (p >= target) {
+			cuts[k++] = p;
+			target = (size_t)(k + 1) * (len / n);
+		}
+	}
+	return (k);
+}
+
+static void lex_one(void *arg, int i) {
+	struct lex_chunk *c = (struct lex_chunk *)arg + i;
+
+	c->src = source_new(c->text, "file", "chunk");
+	c->src->freeit = c->text;
+	lex_source(c->src);
+}
+
+/*
+ * Check that a chunk ends in a top-level ';' or '}' token exactly at
+ * its cut, so lexing it alone gave the same tokens as lexing it in
+ * place.
+ */
+static int chunk_ok(const struct lex_chunk *c) {
+	struct token *t, *last;
+	int depth;
+
+	depth = 0;
+	last = NULL;
+	VTAILQ_FOREACH(t, &c->src->src_tokens, src_list) {
+		if (t->tok == EOI)
+			break;
+		if (t->tok == '{')
+			depth++;
+		else if (t->tok == '}')
+			depth--;
+		last = t;
+	}
+	return (last != NULL && depth == 0 &&
+	    (last->tok == ';' || last->tok == '}') &&
+	    (size_t)(last->e - c->src->b) == c->len);
+}
+
+struct source *chunk_lex(const char *buf, size_t len, const char *name, int jobs) {
+	struct lex_chunk *c;
+	struct source *src;
+	struct token *t;
+	size_t *cuts, off;
+	int i, n, ok;
+
+	if (len < CHUNK_MIN_BYTES || jobs < 2)
+		return (NULL);
+	n = jobs * CHUNK_PER_JOB;
+	cuts = malloc(n * sizeof(*cuts));
+	n = find_cuts(buf, len, n, cuts) + 1;
+	if (n < 2) {
+		free(cuts);
+		return (NULL);
+	}
+	c = calloc(n, sizeof(*c));
+	for (i = 0, off = 0; i < n; i++) {
+		c[i].off = off;
+		c[i].len = (i < n - 1 ? cuts[i] : len) - off;
+		c[i].text = malloc(c[i].len + 1);
+		memcpy(c[i].text, buf + off, c[i].len);
+		c[i].text[c[i].len] = '\0';
+		off += c[i].len;
+	}
+	free(cuts);
+	run_pool(lex_one, c, n, jobs);
+
+	ok = 1;
+	for (i = 0; i < n - 1 && ok; i++)
+		ok = chunk_ok(&c[i]);
+	if (!ok) {
+		for (i = 0; i < n; i++)
+			source_free(c[i].src);
+		free(c);
+		return (NULL);
+	}
+
+	/* Splice, moving each token onto the whole text */
+	src = source_new(buf, "file", name);
+	for (i = 0; i < n; i++) {
+		while ((t = VTAILQ_FIRST(&c[i].src->src_tokens)) != NULL) {
+			VTAILQ_REMOVE(&c[i].src->src_tokens, t, src_list);
+			if (t->tok == EOI && i < n - 1)
+				continue;
+			t->b = src->b + c[i].off + (t->b - c[i].src->b);
+			t->e = src->b + c[i].off + (t->e - c[i].src->b);
+			VTAILQ_INSERT_TAIL(&src->src_tokens, t, src_list);
+		}
+		source_adopt(src, c[i].src);
+		source_free(c[i].src);
+	}
+	free(c);
+	return (src);
+}
+
+struct source *chunk_lex_prefix(
+    const char *buf, size_t len, size_t min, const char *name, size_t *cut) {
+	struct lex_chunk c;
+
+	c.off = 0;
+	c.len = 0;
+	do {
+		if (!chunk_next_cut(buf, len, &c.len) || c.len >= len)
+			return (NULL);
+	} while (c.len < min);
+	c.text = malloc(c.len + 1);
+	memcpy(c.text, buf, c.len);
+	c.text[c.len] = '\0';
+	c.src = source_new(c.text, "file", name);
+	c.src->freeit = c.text;
+	lex_source(c.src);
+	if (!chunk_ok(&c)) {
+		source_free(c.src);
+		return (NULL);
+	}
+	*cut = c.len;
+	return (c.src);
+}
+
+static void format_one(void *arg, int i) {
+	struct fmt_chunk *c = (struct fmt_chunk *)arg + i;
+	struct fmt_state st;
+
+	/* As emit_formatted() leaves it after a top-level ; } or C{ }C */
+	memset(&st, 0, sizeof(st));
+	st.sink = &c->sink;
+	st.first = c->first;
+	st.need_newline = !c->first;
+	st.need_blank = !c->first;
+	st.prev_tok = c->prev_tok;
+	fmt_emit_range(&st, c->start, c->end, c->last_end);
+	if (c->last)
+		fmt_finish(&st);
+}
+
+int chunk_format(struct source *src, int jobs, struct tok_sink *sink) {
+	struct fmt_chunk *c;
+	struct tokfile_rec *r;
+	struct token *t;
+	size_t len, target, base;
+	int i, j, n, max, depth;
+
+	len = (size_t)(src->e - src->b);
+	if (len < CHUNK_MIN_BYTES || jobs < 2)
+		return (-1);
+	max = jobs * CHUNK_PER_JOB;
+	c = calloc(max, sizeof(*c));
+	c[0].start = VTAILQ_FIRST(&src->src_tokens);
+	c[0].last_end = src->b;
+	c[0].first = 1;
+	n = 1;
+	depth = 0;
+	target = len / max;
+	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
+		if (t->tok == EOI || n == max)
+			break;
+		if (t->tok == '{')
+			depth++;
+		else if (t->tok == '}')
+			depth--;
+		if (depth != 0 || (size_t)(t->e - src->b) < target ||
+		    (t->tok != ';' && t->tok != '}' && t->tok != CSRC) ||
+		    VTAILQ_NEXT(t, src_list)->tok == EOI)
+			continue;
+		c[n - 1].end = VTAILQ_NEXT(t, src_list);
+		c[n].start = c[n - 1].end;
+		c[n].last_end = t->e;
+		c[n].prev_tok = t->tok;
+		n++;
+		target = (size_t)n * (len / max);
+	}
+	if (n < 2) {
+		free(c);
+		return (-1);
+	}
+	c[n - 1].last = 1;
+	for (i = 0; i < n; i++)
+		tok_sink_init(&c[i].sink);
+	run_pool(format_one, c, n, jobs);
+
+	for (i = 0; i < n; i++) {
+		if (sink == NULL)
+			fwrite(c[i].sink.text.data, 1, c[i].sink.text.len, stdout);
+		else {
+			base = sink->text.len;
+			buf_append(&sink->text, c[i].sink.text.data, c[i].sink.text.len);
+			for (j = 0; j < (int)c[i].sink.nrec; j++) {
+				r = &c[i].sink.rec[j];
+				tok_sink_record(sink, base + r->off, r->len, r->kind);
+			}
+			sink->inexact |= c[i].sink.inexact;
+		}
+		tok_sink_free(&c[i].sink);
+	}
+	free(c);
+	return (0);
+}
@@ -0,0 +1,77 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stddef.h>
+
+struct source;
+struct tok_sink;
+
+/* Inputs smaller than this are lexed and formatted in one piece */
+#define CHUNK_MIN_BYTES (256 * 1024)
+
+/* Chunks per worker thread, to even out uneven declarations */
+#define CHUNK_PER_JOB 4
+
+/*
+ * Find the first top-level ';' or '}' character at or after *pos,
+ * skipping strings, long strings, comments and C{ }C.  *pos must be
+ * at brace depth 0 and outside all of those.  Returns 1 and moves
+ * *pos just past the character, or 0 if there is none before len.
+ */
+int chunk_next_cut(
+	const char *,
+	size_t,
+	size_t *
+);
+
+/*
+ * Lex a large input in parallel.  A pre-scan of brace depth, strings
+ * and comments cuts the text after top-level ';' and '}' characters;
+ * the chunks are lexed on jobs threads and their tokens spliced into
+ * one source over the whole text.  A chunk must end in a top-level
+ * token exactly at its cut, so the result is the token stream a
+ * single lex_source() pass produces.  Returns the source (without
+ * boundary tokens), or NULL if the input is too small or doesn't
+ * split cleanly; the caller then lexes it as usual.
+ */
+struct source *chunk_lex(
+	const char *,
+	size_t,
+	const char *,
+	int
+);
+
+/* Size of the first prefix an early-stopping extract lexes */
+#define CHUNK_PREFIX_BYTES (64 * 1024)
+
+/*
+ * Lex the start of an input: the text up to the first top-level ';'
+ * or '}' at or after min bytes, copied so the source owns it.  Sets
+ * *cut to its length.  Returns the source (without boundary tokens),
+ * or NULL if that would be the whole input or the prefix doesn't lex
+ * the way it does in place.
+ */
+struct source *chunk_lex_prefix(
+	const char *,
+	size_t,
+	size_t,
+	const char *,
+	size_t *
+);
+
+/*
+ * Format a source (with boundary tokens) on jobs threads, split
+ * after top-level ';', '}' and C{ }C tokens.  Each chunk starts in
+ * the state the formatter is in after such a token, so the output
+ * is byte-identical to emit_formatted() with no edits.  Output goes
+ * to the sink if one is given, otherwise to stdout.
+ * Returns 0, or -1 if the source is too small or doesn't split (the
+ * caller then formats it as usual).
+ */
+int chunk_format(
+	struct source *,
+	int,
+	struct tok_sink *
+);
+
+#endif
@@ -4,12 +4,16 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "vcc_compile.h"
-#include "libvcc.h"
+#include "token.h"
 #include "buf.h"
 #include "pattern.h"
 #include "format.h"
+#include "index.h"
 #include "edit.h"
+#include "lex.h"
+#include "splice.h"
+#include "patch.h"
+#include "tree.h"
 
 int source_has_tokens(struct source *src) {
 	struct token *t;
@@ -33,10 +37,7 @@ void add_boundary_tokens(struct source *src) {
 	}
 
 	/* Allocate and prepend SOI token */
-	soi = calloc(1, sizeof(*soi));
-	soi->tok = SOI;
-	soi->b = soi_text;
-	soi->e = soi_text + 3;
+	soi = source_token(src, SOI, soi_text, soi_text + 3);
 	VTAILQ_INSERT_HEAD(&src->src_tokens, soi, src_list);
 }
 
@@ -98,6 +99,12 @@ void add_comment_tokens(struct source *src) {
 	struct token *t, *prev, *ct;
 	const char *gap_start, *gap_end, *p, *start;
 
+	/* Already done: sources may be shared (--follow-includes) */
+	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
+		if (t->tok == COMMENT)
+			return;
+	}
+
 	prev = NULL;
 	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
 		if (t->tok == SOI) {
@@ -141,11 +148,7 @@ void add_comment_tokens(struct source *src) {
 					p++;
 				continue;
 			}
-			ct = calloc(1, sizeof(*ct));
-			ct->tok = COMMENT;
-			ct->b = start;
-			ct->e = p;
-			ct->src = src;
+			ct = source_token(src, COMMENT, start, p);
 			VTAILQ_INSERT_BEFORE(t, ct, src_list);
 		}
 
@@ -184,11 +187,7 @@ void make_comment_source(struct source *src) {
 	}
 	end = p;
 
-	ct = calloc(1, sizeof(*ct));
-	ct->tok = COMMENT;
-	ct->b = start;
-	ct->e = end;
-	ct->src = src;
+	ct = source_token(src, COMMENT, start, end);
 
 	eoi = VTAILQ_FIRST(&src->src_tokens);
 	while (eoi != NULL && eoi->tok != EOI)
@@ -197,17 +196,123 @@ void make_comment_source(struct source *src) {
 		VTAILQ_INSERT_BEFORE(eoi, ct, src_list);
 }
 
-void lex_pattern(struct vcc *vcc, const char *text, struct source **dst, char **preprocessed) {
+void lex_pattern(const char *text, struct source **dst, char **preprocessed) {
 	char *pp;
 
 	if (text == NULL)
 		return;
-	pp = preprocess_wildcards(text);
+	pp = preprocess_wildcards(text, NULL, NULL);
 	if (pp == NULL)
 		return;
 	*preprocessed = pp;
-	*dst = vcc_new_source(pp, "pattern", "pattern");
-	vcc_Lexer(vcc, *dst);
+	*dst = source_new(pp, "pattern", "pattern");
+	lex_source(*dst);
+}
+
+int compile_pattern(const char *text, int comment_ok, struct pattern **dst) {
+	struct wildcard_spec specs[MAX_PATTERN];
+	struct pattern *pat;
+	int nspecs;
+
+	*dst = NULL;
+	if (text == NULL)
+		return (0);
+	pat = calloc(1, sizeof(*pat));
+	pat->source = text;
+	pat->text = preprocess_wildcards(text, specs, &nspecs);
+	if (pat->text == NULL) {
+		free(pat);
+		return (-1);
+	}
+	pat->src = source_new(pat->text, "pattern", "pattern");
+	lex_source(pat->src);
+	if (comment_ok && !source_has_tokens(pat->src))
+		make_comment_source(pat->src);
+	pat->n = build_pattern(pat->src, specs, nspecs, pat->elem);
+	if (pat->n < 0) {
+		fprintf(stderr, "pattern error: more than %d entries: %s\n", MAX_PATTERN, text);
+		free_pattern(pat);
+		return (-1);
+	}
+	*dst = pat;
+	return (0);
+}
+
+void free_pattern(struct pattern *pat) {
+	int i;
+
+	if (pat == NULL)
+		return;
+	for (i = 0; i < pat->n; i++)
+		pat_regex_free(pat->elem[i].re);
+	free(pat->plan.cand);
+	if (pat->src != NULL)
+		source_free(pat->src);
+	free(pat->text);
+	free(pat);
+}
+
+void plan_match(struct source *src, struct match_constraint *mc, struct pattern *from) {
+	struct src_index idx;
+
+	source_index_build(src, &idx);
+	if (from != NULL)
+		plan_pattern(from, &idx, PLAN_FORWARD);
+	if (mc->look_behind_pat != NULL)
+		plan_pattern(mc->look_behind_pat, &idx, PLAN_BACKWARD);
+	if (mc->look_ahead_pat != NULL)
+		plan_pattern(mc->look_ahead_pat, &idx, PLAN_FORWARD);
+	if (mc->within_pat != NULL)
+		plan_pattern(mc->within_pat, &idx, PLAN_FORWARD);
+	source_index_free(&idx);
+
+	if (mc->show_plan) {
+		print_plan("from", from);
+		print_plan("look-behind", mc->look_behind_pat);
+		print_plan("look-ahead", mc->look_ahead_pat);
+		print_plan("within", mc->within_pat);
+	}
+}
+
+int match_scoped(const struct match_constraint *mc) {
+	return (mc->within_pat != NULL || mc->select_sel != NULL);
+}
+
+/*
+ * Find the block bodies matching may start in: those of the --select
+ * selector, or else of the --within pattern.  See find_scopes().
+ */
+static int match_scopes(struct source *src, const struct match_constraint *mc, struct scope **scopes) {
+	struct block_tree bt;
+	int n;
+
+	if (mc == NULL || mc->select_sel == NULL)
+		return (find_scopes(src, mc != NULL ? mc->within_pat : NULL, scopes));
+	block_tree_build(&bt, src);
+	n = select_scopes(&bt, mc->select_sel, scopes);
+	block_tree_free(&bt);
+	return (n);
+}
+
+/*
+ * Apply the --within or --select restriction at token t.  Returns 1
+ * if matching may start at t, setting *end to the bound the match
+ * must stay before (NULL when neither is in use).
+ */
+static int within_scope(
+    const struct match_constraint *mc, const struct scope *scopes,
+    int nscopes, int *si, struct token *t, int incl_close,
+    struct token **end) {
+	const struct scope *sc;
+
+	*end = NULL;
+	if (!match_scoped(mc))
+		return (1);
+	sc = scope_at(scopes, nscopes, si, t, incl_close);
+	if (sc == NULL)
+		return (0);
+	*end = sc->close;
+	return (1);
 }
 
 static void buf_emit_replacement(struct buf *out, const struct replace_opts *rep, struct capture *caps, int ncaps) {
@@ -243,12 +348,129 @@ static void buf_emit_replacement(struct buf *out, const struct replace_opts *rep
 	}
 }
 
-void cmd_tokens(struct source *src, int processed) {
+/*
+ * The end of the text of the matched tokens [t, last].  A literal EOI
+ * adds no text: its own is a static string outside the source.
+ */
+static const char *match_end(const struct token *t, const struct token *last) {
+	if (last->tok == EOI && last != t)
+		last = VTAILQ_PREV(last, tokenhead, src_list);
+	return (last->e);
+}
+
+/*
+ * Append the "start" through "end_column" members for [b, e), both
+ * clamped to the indexed text.
+ */
+static void json_span(struct buf *out, const struct line_index *li, const char *b, const char *e) {
+	struct text_pos s, x;
+	char num[192];
+
+	if (b < li->b || b > li->e)
+		b = li->e;
+	if (e < b || e > li->e)
+		e = li->e;
+	line_index_pos(li, b, &s);
+	line_index_pos(li, e, &x);
+	snprintf(num, sizeof(num),
+	    "\"start\":%zu,\"end\":%zu,\"line\":%ld,\"column\":%ld,"
+	    "\"end_line\":%ld,\"end_column\":%ld",
+	    s.off, x.off, s.line, s.col, x.line, x.col);
+	buf_appends(out, num);
+}
+
+void cmd_tokens(struct source *src, int processed, int json) {
+	if (json == OUT_TEXT) {
+		printf("%-12s %s\n", "TYPE", "VALUE");
+		printf("%-12s %s\n", "----", "-----");
+	}
+	print_tokens(src, processed, json, NULL, 1);
+}
+
+/*
+ * Append the JSON record of a token or gap item [b, e) of kind name:
+ * an NDJSON line, or an element of the --json array after n others.
+ */
+static void json_token(
+    struct buf *out, const struct line_index *li, int json, long *n,
+    const char *name, const char *b, const char *e) {
+	if (json == OUT_JSON)
+		buf_appends(out, (*n)++ > 0 ? ",\n" : "[");
+	buf_appends(out, "{\"kind\":");
+	buf_append_json(out, name, strlen(name));
+	buf_appends(out, ",\"text\":");
+	buf_append_json(out, b, (size_t)(e - b));
+	buf_appendc(out, ',');
+	json_span(out, li, b, e);
+	buf_appendc(out, '}');
+	if (json == OUT_NDJSON)
+		buf_appendc(out, '\n');
+}
+
+/*
+ * print_tokens() for --json and --ndjson.  SOI and EOI have no text
+ * of their own and get empty spans at the ends of the source.
+ */
+static void print_tokens_json(struct source *src, int processed, int json, const struct text_pos *base, int last) {
+	struct line_index li;
+	struct buf out;
+	struct token *t;
+	const char *name, *last_end, *p, *start, *label;
+	char num[16];
+	long n;
+
+	line_index_build(&li, src->b, src->e, base);
+	buf_init(&out);
+	n = 0;
+	last_end = src->b;
+	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
+		if (t->tok == SOI) {
+			if (processed)
+				json_token(&out, &li, json, &n, "SOI", src->b, src->b);
+			continue;
+		}
+		if (t->tok == EOI && !last)
+			break;
+		if (processed) {
+			for (p = last_end; (p = gap_next(p,
+			    t->tok == EOI ? src->e : t->b, &start, &label)) != NULL; )
+				json_token(&out, &li, json, &n, label, start, p);
+		}
+		if (t->tok == EOI) {
+			if (processed)
+				json_token(&out, &li, json, &n, "EOI", src->e, src->e);
+			break;
+		}
+		if (t->tok < 256)
+			name = vcl_tnames[t->tok];
+		else
+			name = NULL;
+		if (name == NULL) {
+			snprintf(num, sizeof(num), "?%u", t->tok);
+			name = num;
+		}
+		json_token(&out, &li, json, &n, name, t->b, t->e);
+		last_end = t->e;
+		if (out.len >= 65536) {
+			fwrite(out.data, 1, out.len, stdout);
+			out.len = 0;
+		}
+	}
+	if (json == OUT_JSON)
+		buf_appends(&out, n > 0 ? "]\n" : "[]\n");
+	fwrite(out.data, 1, out.len, stdout);
+	free(out.data);
+	line_index_free(&li);
+}
+
+void print_tokens(struct source *src, int processed, int json, const struct text_pos *base, int last) {
 	struct token *t;
 	const char *name, *last_end;
 
-	printf("%-12s %s\n", "TYPE", "VALUE");
-	printf("%-12s %s\n", "----", "-----");
+	if (json != OUT_TEXT) {
+		print_tokens_json(src, processed, json, base, last);
+		return;
+	}
 	last_end = src->b;
 	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
 		if (t->tok == SOI) {
@@ -256,6 +478,8 @@ void cmd_tokens(struct source *src, int processed) {
 				printf("%-12s %.*s\n", "SOI", PF(t));
 			continue;
 		}
+		if (t->tok == EOI && !last)
+			break;
 		if (processed && last_end != NULL)
 			emit_gap(last_end, t->tok == EOI ? src->e : t->b);
 		if (t->tok == EOI) {
@@ -277,9 +501,10 @@ void cmd_tokens(struct source *src, int processed) {
 
 char *emit_transform_replace(struct source *src, const struct replace_opts *rep) {
 	struct buf out;
-	struct token *t, *prev;
+	struct token *t, *prev, *end;
+	struct scope *scopes;
+	int nscopes, si;
 	int rep_count;
-	struct token *from_pat[128];
 	struct capture caps[MAX_CAPTURES];
 	int from_npat, matched, ncaps, i;
 
@@ -287,8 +512,14 @@ char *emit_transform_replace(struct source *src, const struct replace_opts *rep)
 	prev = NULL;
 	rep_count = 0;
 	from_npat = 0;
-	if (rep->from_src != NULL)
-		from_npat = build_pattern(rep->from_src, from_pat);
+	if (rep->from_pat != NULL)
+		from_npat = rep->from_pat->n;
+	nscopes = match_scopes(src, &rep->match, &scopes);
+	if (nscopes < 0) {
+		free(out.data);
+		return (NULL);
+	}
+	si = 0;
 
 	for (t = VTAILQ_FIRST(&src->src_tokens); t != NULL; ) {
 		if (t->tok == EOI)
@@ -299,9 +530,15 @@ char *emit_transform_replace(struct source *src, const struct replace_opts *rep)
 			continue;
 		}
 
-		if (from_npat > 0 && (rep->match.limit == 0 || rep_count < rep->match.offset + rep->match.limit)) {
-			matched = try_pattern_match(t, prev, from_pat, from_npat,
-			    rep->match.look_behind_src, rep->match.look_ahead_src, caps, &ncaps);
+		if (from_npat > 0 && (rep->match.limit == 0 || rep_count < rep->match.offset + rep->match.limit) &&
+		    within_scope(&rep->match, scopes, nscopes, &si, t, 0, &end)) {
+			matched = try_pattern_match(t, prev, rep->from_pat,
+			    rep->match.look_behind_pat, rep->match.look_ahead_pat, caps, &ncaps, end);
+			if (matched < 0) {
+				free(scopes);
+				free(out.data);
+				return (NULL);
+			}
 			if (matched > 0) {
 				rep_count++;
 				if (rep_count <= rep->match.offset) {
@@ -331,29 +568,39 @@ char *emit_transform_replace(struct source *src, const struct replace_opts *rep)
 		t = VTAILQ_NEXT(t, src_list);
 	}
 
+	free(scopes);
 	buf_appendc(&out, '\0');
 	return (out.data);
 }
 
-void emit_formatted(struct source *src, const struct insert_opts *ins, const struct replace_opts *rep) {
-	struct token *t, *prev;
+int emit_formatted(struct source *src, const struct insert_opts *ins, const struct replace_opts *rep, struct tok_sink *sink) {
+	struct token *t, *prev, *end;
 	struct fmt_state st;
+	const struct match_constraint *mc;
+	struct scope *scopes;
+	const struct scope *sc;
+	int nscopes, si;
 	int before_ok, after_ok;
 	int ins_count, rep_count;
-	struct token *from_pat[128];
 	struct capture caps[MAX_CAPTURES];
 	int from_npat, matched, ncaps, i;
 	const char *last_end;
 
 	memset(&st, 0, sizeof(st));
 	st.first = 1;
+	st.sink = sink;
 	prev = NULL;
 	ins_count = 0;
 	rep_count = 0;
 	from_npat = 0;
 	last_end = src->b;
-	if (rep != NULL && rep->from_src != NULL)
-		from_npat = build_pattern(rep->from_src, from_pat);
+	if (rep != NULL && rep->from_pat != NULL)
+		from_npat = rep->from_pat->n;
+	mc = ins != NULL ? &ins->match : rep != NULL ? &rep->match : NULL;
+	nscopes = match_scopes(src, mc, &scopes);
+	if (nscopes < 0)
+		return (-1);
+	si = 0;
 
 	for (t = VTAILQ_FIRST(&src->src_tokens); t != NULL; ) {
 		if (t->tok == EOI)
@@ -370,10 +617,28 @@ void emit_formatted(struct source *src, const struct insert_opts *ins, const str
 
 		/* Insert: inject formatted tokens at match point */
 		if (ins != NULL && ins->src != NULL &&
-		    (ins->match.look_behind_src != NULL || ins->match.look_ahead_src != NULL) &&
-		    (ins->match.limit == 0 || ins_count < ins->match.offset + ins->match.limit)) {
-			before_ok = tokens_match_before(prev, ins->match.look_behind_src);
-			after_ok = tokens_match_after(t, ins->match.look_ahead_src);
+		    (ins->match.look_behind_pat != NULL || ins->match.look_ahead_pat != NULL ||
+		    match_scoped(&ins->match)) &&
+		    (ins->match.limit == 0 || ins_count < ins->match.offset + ins->match.limit) &&
+		    within_scope(&ins->match, scopes, nscopes, &si, t, 1, &end)) {
+			if (ins->match.look_behind_pat == NULL && ins->match.look_ahead_pat == NULL) {
+				/* --within or --select alone: append to the end of the body */
+				sc = scope_at(scopes, nscopes, &si, t, 1);
+				before_ok = after_ok = (sc != NULL && t == sc->close);
+			}
+			else if (!plan_candidate(ins->match.look_behind_pat, t) ||
+			    !plan_candidate(ins->match.look_ahead_pat, t)) {
+				before_ok = after_ok = 0;
+			}
+			else {
+				before_ok = tokens_match_before(prev, ins->match.look_behind_pat);
+				after_ok = before_ok > 0 ?
+				    tokens_match_after(t, ins->match.look_ahead_pat) : 0;
+			}
+			if (before_ok < 0 || after_ok < 0) {
+				free(scopes);
+				return (-1);
+			}
 			if (before_ok && after_ok) {
 				ins_count++;
 				if (ins_count > ins->match.offset)
@@ -382,9 +647,14 @@ void emit_formatted(struct source *src, const struct insert_opts *ins, const str
 		}
 
 		/* Replace: match from pattern and emit to pattern */
-		if (rep != NULL && from_npat > 0 && (rep->match.limit == 0 || rep_count < rep->match.offset + rep->match.limit)) {
-			matched = try_pattern_match(t, prev, from_pat, from_npat,
-			    rep->match.look_behind_src, rep->match.look_ahead_src, caps, &ncaps);
+		if (rep != NULL && from_npat > 0 && (rep->match.limit == 0 || rep_count < rep->match.offset + rep->match.limit) &&
+		    within_scope(&rep->match, scopes, nscopes, &si, t, 0, &end)) {
+			matched = try_pattern_match(t, prev, rep->from_pat,
+			    rep->match.look_behind_pat, rep->match.look_ahead_pat, caps, &ncaps, end);
+			if (matched < 0) {
+				free(scopes);
+				return (-1);
+			}
 			if (matched > 0) {
 				rep_count++;
 				if (rep_count <= rep->match.offset) {
@@ -435,25 +705,361 @@ void emit_formatted(struct source *src, const struct insert_opts *ins, const str
 
 	/* Insert with no constraints -- append to end */
 	if (ins != NULL && ins->src != NULL &&
-		ins->match.look_behind_src == NULL && ins->match.look_ahead_src == NULL)
+		ins->match.look_behind_pat == NULL && ins->match.look_ahead_pat == NULL &&
+		!match_scoped(&ins->match))
 		fmt_emit_source(&st, ins->src);
 
-	printf("\n");
+	free(scopes);
+	fmt_finish(&st);
+	return (0);
 }
 
-void cmd_extract(struct source *src, const struct extract_opts *ext) {
-	struct token *t, *prev, *end;
-	struct token *from_pat[128];
+/* Length of text without trailing whitespace */
+static size_t text_trimmed_len(const char *text) {
+	size_t n = strlen(text);
+
+	while (n > 0 && (text[n-1] == '\n' || text[n-1] == ' ' || text[n-1] == '\t'))
+		n--;
+	return (n);
+}
+
+/*
+ * Return the start of the indentation in front of b, or NULL if
+ * anything but whitespace precedes b on its line.
+ */
+static const char *line_indent(const struct source *src, const char *b) {
+	while (b > src->b && (b[-1] == ' ' || b[-1] == '\t'))
+		b--;
+	return (b > src->b && b[-1] != '\n' ? NULL : b);
+}
+
+/*
+ * Add the edit inserting text before token t.  A token that starts
+ * its line gets the text on lines of its own above it, indented like
+ * the token, or before a closing brace like the statement above it;
+ * a blank line above a top-level token is kept between the two.
+ * Elsewhere the text goes in front of the token on the same line.
+ */
+static void splice_insert(
+    struct splice_list *sl, const struct source *src, const struct token *t,
+    const struct token *prev, const char *text) {
+	struct buf out;
+	const char *ls, *ib, *ie, *p, *nl, *end;
+	size_t at;
+	int deeper;
+
+	end = text + text_trimmed_len(text);
+	buf_init(&out);
+	ls = line_indent(src, t->b);
+	if (ls == NULL) {
+		buf_append(&out, text, (size_t)(end - text));
+		buf_appendc(&out, ' ');
+		at = (size_t)(t->b - src->b);
+	}
+	else {
+		ib = ls;
+		ie = t->b;
+		deeper = t->tok == '}';
+		if (deeper && prev != NULL && prev->tok != SOI && prev->tok != '{') {
+			for (ib = prev->b; ib > src->b && ib[-1] != '\n'; ib--)
+				continue;
+			for (ie = ib; *ie == ' ' || *ie == '\t'; ie++)
+				continue;
+			deeper = 0;
+		}
+		for (p = text; p < end; p = nl + 1) {
+			nl = memchr(p, '\n', (size_t)(end - p));
+			if (nl == NULL)
+				nl = end;
+			if (nl > p) {
+				buf_append(&out, ib, (size_t)(ie - ib));
+				if (deeper)
+					buf_appends(&out, "    ");
+				buf_append(&out, p, (size_t)(nl - p));
+			}
+			buf_appendc(&out, '\n');
+		}
+		if (ls == t->b && ls - src->b >= 2 && ls[-2] == '\n')
+			buf_appendc(&out, '\n');
+		at = (size_t)(ls - src->b);
+	}
+	splice_add(sl, at, at, out.data, out.len);
+	free(out.data);
+}
+
+int emit_spliced(struct source *src, const struct insert_opts *ins, const struct replace_opts *rep, struct tok_sink *sink) {
+	struct splice_list sl;
+	struct token *t, *prev, *end, *last;
+	const struct match_constraint *mc;
+	struct scope *scopes;
+	const struct scope *sc;
 	struct capture caps[MAX_CAPTURES];
-	int from_npat, matched, ncaps, i, count;
-	const char *p, *q;
+	struct buf out;
+	int nscopes, si, count, before_ok, after_ok, matched, ncaps, i, r, emit;
+	size_t len;
 	char rbuf[4096];
 
-	from_npat = 0;
-	if (ext->from_src != NULL)
-		from_npat = build_pattern(ext->from_src, from_pat);
-	if (from_npat == 0)
+	mc = ins != NULL ? &ins->match : &rep->match;
+	nscopes = match_scopes(src, mc, &scopes);
+	if (nscopes < 0)
+		return (-1);
+	splice_init(&sl);
+	si = 0;
+	count = 0;
+	prev = NULL;
+	r = 0;
+
+	for (t = VTAILQ_FIRST(&src->src_tokens); t != NULL; ) {
+		if (t->tok == EOI)
+			break;
+		if (t->tok == SOI) {
+			prev = t;
+			t = VTAILQ_NEXT(t, src_list);
+			continue;
+		}
+		if (mc->limit > 0 && count >= mc->offset + mc->limit)
+			break;
+
+		/* Insert: same positions as emit_formatted */
+		if (ins != NULL) {
+			if ((mc->look_behind_pat != NULL || mc->look_ahead_pat != NULL ||
+			    match_scoped(mc)) &&
+			    within_scope(mc, scopes, nscopes, &si, t, 1, &end)) {
+				if (mc->look_behind_pat == NULL && mc->look_ahead_pat == NULL) {
+					sc = scope_at(scopes, nscopes, &si, t, 1);
+					before_ok = after_ok = (sc != NULL && t == sc->close);
+				}
+				else if (!plan_candidate(mc->look_behind_pat, t) ||
+				    !plan_candidate(mc->look_ahead_pat, t)) {
+					before_ok = after_ok = 0;
+				}
+				else {
+					before_ok = tokens_match_before(prev, mc->look_behind_pat);
+					after_ok = before_ok > 0 ?
+					    tokens_match_after(t, mc->look_ahead_pat) : 0;
+				}
+				if (before_ok < 0 || after_ok < 0) {
+					r = -1;
+					break;
+				}
+				if (before_ok && after_ok && ++count > mc->offset)
+					splice_insert(&sl, src, t, prev, ins->text);
+			}
+			prev = t;
+			t = VTAILQ_NEXT(t, src_list);
+			continue;
+		}
+
+		/* Replace: the matched bytes, gaps included, become the to text */
+		if (rep->from_pat != NULL && rep->from_pat->n > 0 &&
+		    within_scope(mc, scopes, nscopes, &si, t, 0, &end)) {
+			matched = try_pattern_match(t, prev, rep->from_pat,
+			    mc->look_behind_pat, mc->look_ahead_pat, caps, &ncaps, end);
+			if (matched < 0) {
+				r = -1;
+				break;
+			}
+			if (matched > 0) {
+				last = t;
+				for (i = 1; i < matched; i++)
+					last = VTAILQ_NEXT(last, src_list);
+				if (++count > mc->offset) {
+					substitute_captures(rep->to_text, strlen(rep->to_text),
+					    caps, ncaps, rbuf, sizeof(rbuf));
+					splice_add(&sl, (size_t)(t->b - src->b),
+					    (size_t)(match_end(t, last) - src->b), rbuf, strlen(rbuf));
+				}
+				prev = last;
+				t = VTAILQ_NEXT(last, src_list);
+				continue;
+			}
+		}
+		prev = t;
+		t = VTAILQ_NEXT(t, src_list);
+	}
+
+	/* Insert with no constraints -- append to end, after a blank line */
+	len = (size_t)(src->e - src->b);
+	if (r == 0 && ins != NULL && mc->look_behind_pat == NULL &&
+	    mc->look_ahead_pat == NULL && !match_scoped(mc)) {
+		if (len > 0)
+			splice_add(&sl, len, len, "\n\n", src->e[-1] == '\n' ? 1 : 2);
+		splice_add(&sl, len, len, ins->text, text_trimmed_len(ins->text));
+		splice_add(&sl, len, len, "\n", 1);
+	}
+
+	free(scopes);
+	emit = ins != NULL ? ins->emit : rep->emit;
+	if (r == 0 && splice_check(&sl, len) != 0)
+		r = 1;
+	else if (r == 0 && emit != EMIT_TEXT) {
+		buf_init(&out);
+		if (emit == EMIT_PATCH)
+			patch_diff(&sl, src->b, len, src->name, &out);
+		else
+			patch_edits(&sl, src->b, len, src->name, &out);
+		fwrite(out.data, 1, out.len, stdout);
+		free(out.data);
+	}
+	else if (r == 0)
+		splice_write(&sl, src->b, len, sink);
+	splice_free(&sl);
+	return (r);
+}
+
+int apply_replace(struct source *src, const struct replace_opts *rep, struct tok_sink *sink) {
+	struct source *raw_src;
+	char *raw;
+
+	if (rep->to_raw)
+		return (emit_formatted(src, NULL, rep, sink));
+
+	/* Pass 1 rewrites tokens, pass 2 re-lexes and formats the result */
+	raw = emit_transform_replace(src, rep);
+	if (raw == NULL)
+		return (-1);
+	raw_src = source_new(raw, "transformed", "transformed");
+	lex_source(raw_src);
+	emit_formatted(raw_src, NULL, NULL, sink);
+	source_free(raw_src);
+	free(raw);
+	return (0);
+}
+
+static void out_write(struct buf *out, const char *s, size_t n) {
+	if (out != NULL)
+		buf_append(out, s, n);
+	else
+		fwrite(s, 1, n, stdout);
+}
+
+/*
+ * Append the printed form of a match's text [p, q) to r: without
+ * leading and trailing newlines and, if strip_ws is set, with the
+ * common indent of its lines removed.
+ */
+static void render_match(struct buf *r, const char *p, const char *q, int strip_ws) {
+	const char *lp, *le;
+	int min_indent, indent;
+
+	/* Strip leading/trailing newlines (always) */
+	while (p < q && *p == '\n')
+		p++;
+	while (q > p && q[-1] == '\n')
+		q--;
+	if (!strip_ws) {
+		buf_append(r, p, (size_t)(q - p));
 		return;
+	}
+	/* Dedent: find minimum leading whitespace */
+	min_indent = -1;
+	lp = p;
+	while (lp < q) {
+		indent = 0;
+		while (lp + indent < q &&
+		    (lp[indent] == ' ' || lp[indent] == '\t'))
+			indent++;
+		if (lp + indent < q && lp[indent] != '\n') {
+			if (min_indent < 0 || indent < min_indent)
+				min_indent = indent;
+		}
+		while (lp < q && *lp != '\n')
+			lp++;
+		if (lp < q)
+			lp++;
+	}
+	if (min_indent < 0)
+		min_indent = 0;
+	/* Each line with common indent removed */
+	lp = p;
+	while (lp < q) {
+		le = lp;
+		while (le < q && *le != '\n')
+			le++;
+		indent = 0;
+		while (indent < min_indent &&
+		    lp + indent < le &&
+		    (lp[indent] == ' ' || lp[indent] == '\t'))
+			indent++;
+		if (lp != p)
+			buf_appendc(r, '\n');
+		buf_append(r, lp + indent, (size_t)(le - lp - indent));
+		lp = le;
+		if (lp < q)
+			lp++;
+	}
+}
+
+/*
+ * Write the JSON record of an extract match spanning [b, e): its
+ * file, span, printed text and capture spans.  A capture that matched
+ * nothing in the source text is null.
+ */
+static void json_match(
+    struct buf *out, const struct source *src, const struct line_index *li,
+    const char *b, const char *e, const struct buf *text,
+    const struct capture *caps, int ncaps) {
+	struct buf rec;
+	int i;
+
+	buf_init(&rec);
+	buf_appends(&rec, "{\"file\":");
+	buf_append_json(&rec, src->name, strlen(src->name));
+	buf_appendc(&rec, ',');
+	json_span(&rec, li, b, e);
+	buf_appends(&rec, ",\"text\":");
+	buf_append_json(&rec, text->data, text->len);
+	buf_appends(&rec, ",\"captures\":[");
+	for (i = 0; i < ncaps; i++) {
+		if (i > 0)
+			buf_appendc(&rec, ',');
+		if (caps[i].start == NULL || caps[i].start < src->b ||
+		    caps[i].end > src->e) {
+			buf_appends(&rec, "null");
+			continue;
+		}
+		buf_appendc(&rec, '{');
+		json_span(&rec, li, caps[i].start, caps[i].end);
+		buf_appends(&rec, ",\"text\":");
+		buf_append_json(&rec, caps[i].start,
+		    (size_t)(caps[i].end - caps[i].start));
+		buf_appendc(&rec, '}');
+	}
+	buf_appends(&rec, "]}\n");
+	out_write(out, rec.data, rec.len);
+	free(rec.data);
+}
+
+int cmd_extract(struct source *src, const struct extract_opts *ext, struct buf *out) {
+	struct token *t, *prev, *end, *bound;
+	struct scope *scopes;
+	int nscopes, si;
+	struct capture caps[MAX_CAPTURES];
+	struct capture spans[MAX_CAPTURES];
+	struct line_index li;
+	struct buf r;
+	int matched, ncaps, i, count;
+	const char *p, *q;
+	char rbuf[4096];
+
+	if (ext->stop != NULL)
+		*ext->stop = NULL;
+	if (ext->from_pat == NULL || ext->from_pat->n == 0)
+		return (0);
+	if (ext->stop != NULL)
+		match_end_reset();
+	nscopes = match_scopes(src, &ext->match, &scopes);
+	if (nscopes < 0)
+		return (-1);
+	if (ext->stop != NULL && match_end_reached()) {
+		/* The scopes themselves may continue past src */
+		*ext->stop = src->b;
+		free(scopes);
+		return (0);
+	}
+	si = 0;
+	memset(&li, 0, sizeof(li));
+	buf_init(&r);
 
 	prev = NULL;
 	count = 0;
@@ -468,25 +1074,55 @@ void cmd_extract(struct source *src, const struct extract_opts *ext) {
 
 		if (ext->match.limit > 0 && count >= ext->match.offset + ext->match.limit)
 			break;
+		if (ext->until != NULL && t->b >= ext->until) {
+			if (ext->stop != NULL)
+				*ext->stop = t->b;
+			break;
+		}
+
+		if (!within_scope(&ext->match, scopes, nscopes, &si, t, 0, &bound)) {
+			prev = t;
+			t = VTAILQ_NEXT(t, src_list);
+			continue;
+		}
 
-		matched = try_pattern_match(t, prev, from_pat, from_npat,
-		    ext->match.look_behind_src, ext->match.look_ahead_src,
-		    caps, &ncaps);
+		if (ext->stop != NULL)
+			match_end_reset();
+		matched = try_pattern_match(t, prev, ext->from_pat,
+		    ext->match.look_behind_pat, ext->match.look_ahead_pat,
+		    caps, &ncaps, bound);
+		if (ext->stop != NULL && match_end_reached()) {
+			*ext->stop = t->b;
+			break;
+		}
+		if (matched < 0) {
+			free(scopes);
+			free(r.data);
+			line_index_free(&li);
+			return (-1);
+		}
 		if (matched > 0) {
 			count++;
-			if (count <= ext->match.offset) {
+			/* --count and --exists need no captures or text */
+			if (count <= ext->match.offset || ext->query != QUERY_NONE) {
 				for (i = 0; i < matched; i++) {
 					prev = t;
 					t = VTAILQ_NEXT(t, src_list);
 				}
 				continue;
 			}
+			end = t;
+			for (i = 1; i < matched; i++)
+				end = VTAILQ_NEXT(end, src_list);
+			/* Spans before fixup widens *** captures over gaps */
+			if (ext->json != OUT_TEXT)
+				memcpy(spans, caps, sizeof(caps[0]) * (size_t)ncaps);
 			if (ext->to_text != NULL) {
 				/* 2-arg mode: fixup gap captures, then substitute */
 				fixup_gap_captures(
 					t,
-					from_pat,
-					from_npat,
+					ext->from_pat->elem,
+					ext->from_pat->n,
 					caps,
 					ncaps
 				);
@@ -503,61 +1139,21 @@ void cmd_extract(struct source *src, const struct extract_opts *ext) {
 			}
 			else {
 				/* 1-arg mode: print raw matched text */
-				end = t;
-				for (i = 1; i < matched; i++)
-					end = VTAILQ_NEXT(end, src_list);
 				p = t->b;
-				q = end->e;
+				q = match_end(t, end);
 			}
-			/* Strip leading/trailing newlines (always) */
-			while (p < q && *p == '\n')
-				p++;
-			while (q > p && q[-1] == '\n')
-				q--;
-			if (ext->strip_ws) {
-				/* Dedent: find minimum leading whitespace */
-				const char *lp;
-				int min_indent, indent;
-				min_indent = -1;
-				lp = p;
-				while (lp < q) {
-					indent = 0;
-					while (lp + indent < q &&
-					    (lp[indent] == ' ' || lp[indent] == '\t'))
-						indent++;
-					if (lp + indent < q && lp[indent] != '\n') {
-						if (min_indent < 0 || indent < min_indent)
-							min_indent = indent;
-					}
-					while (lp < q && *lp != '\n')
-						lp++;
-					if (lp < q)
-						lp++;
-				}
-				if (min_indent < 0)
-					min_indent = 0;
-				/* Print each line with common indent removed */
-				lp = p;
-				while (lp < q) {
-					const char *le = lp;
-					while (le < q && *le != '\n')
-						le++;
-					indent = 0;
-					while (indent < min_indent &&
-					    lp + indent < le &&
-					    (lp[indent] == ' ' || lp[indent] == '\t'))
-						indent++;
-					if (lp != p)
-						putchar('\n');
-					printf("%.*s", (int)(le - lp - indent), lp + indent);
-					lp = le;
-					if (lp < q)
-						lp++;
-				}
-				putchar('\n');
+			r.len = 0;
+			render_match(&r, p, q, ext->strip_ws);
+			if (ext->json != OUT_TEXT) {
+				if (li.start == NULL)
+					line_index_build(&li, src->b, src->e,
+					    ext->base.line > 0 ? &ext->base : NULL);
+				json_match(out, src, &li, t->b, match_end(t, end), &r,
+				    spans, ncaps);
 			}
 			else {
-				printf("%.*s\n", (int)(q - p), p);
+				buf_appendc(&r, '\n');
+				out_write(out, r.data, r.len);
 			}
 			for (i = 0; i < matched; i++) {
 				prev = t;
@@ -569,4 +1165,92 @@ void cmd_extract(struct source *src, const struct extract_opts *ext) {
 		prev = t;
 		t = VTAILQ_NEXT(t, src_list);
 	}
+	free(scopes);
+	free(r.data);
+	line_index_free(&li);
+	return (count);
+}
+
+int grep_source(
+    struct source *src, const struct pattern *from,
+    const struct match_constraint *mc, const char *name, int files_only,
+    struct buf *out) {
+	struct token *t, *prev, *bound;
+	struct scope *scopes;
+	struct capture caps[MAX_CAPTURES];
+	const char *lp, *ls, *le, *last;
+	int nscopes, si, matched, ncaps, i, line, count;
+	char lbuf[32];
+
+	if (from == NULL || from->n == 0)
+		return (0);
+	nscopes = match_scopes(src, mc, &scopes);
+	if (nscopes < 0)
+		return (-1);
+	si = 0;
+
+	lp = src->b;
+	line = 1;
+	last = NULL;
+	prev = NULL;
+	count = 0;
+	for (t = VTAILQ_FIRST(&src->src_tokens); t != NULL; ) {
+		if (t->tok == EOI)
+			break;
+		if (mc->limit > 0 && count >= mc->limit)
+			break;
+		if (t->tok == SOI ||
+		    !within_scope(mc, scopes, nscopes, &si, t, 0, &bound)) {
+			prev = t;
+			t = VTAILQ_NEXT(t, src_list);
+			continue;
+		}
+
+		matched = try_pattern_match(t, prev, from, mc->look_behind_pat,
+		    mc->look_ahead_pat, caps, &ncaps, bound);
+		if (matched < 0) {
+			free(scopes);
+			return (-1);
+		}
+		if (matched == 0) {
+			prev = t;
+			t = VTAILQ_NEXT(t, src_list);
+			continue;
+		}
+
+		count++;
+		if (out == NULL) {
+			/* Only counting */
+		}
+		else if (files_only) {
+			buf_appends(out, name);
+			buf_appendc(out, '\n');
+			break;
+		}
+		else {
+			/* One output line per source line, as grep(1) */
+			for (; lp < t->b; lp++) {
+				if (*lp == '\n')
+					line++;
+			}
+			for (ls = t->b; ls > src->b && ls[-1] != '\n'; ls--)
+				continue;
+			if (ls != last) {
+				for (le = t->b; le < src->e && *le != '\n'; le++)
+					continue;
+				snprintf(lbuf, sizeof(lbuf), ":%d:", line);
+				buf_appends(out, name);
+				buf_appends(out, lbuf);
+				buf_append(out, ls, (size_t)(le - ls));
+				buf_appendc(out, '\n');
+				last = ls;
+			}
+		}
+		for (i = 0; i < matched; i++) {
+			prev = t;
+			t = VTAILQ_NEXT(t, src_list);
+		}
+	}
+	free(scopes);
+	return (count);
 }
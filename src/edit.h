@@ -2,43 +2,80 @@
 #define EDIT_H
 
 #include "pattern.h"
+#include "index.h"
+
+/* Exit status when a pattern runs out of match steps */
+#define EXIT_MATCH_BUDGET 3
+
+/* What insert and replace print (--emit) */
+#define EMIT_TEXT 0
+#define EMIT_PATCH 1
+#define EMIT_EDITS 2
+
+/* How extract and tokens print their results (--json, --ndjson) */
+#define OUT_TEXT 0
+#define OUT_JSON 1
+#define OUT_NDJSON 2
+
+/* What extract and grep report instead of matches (--count, --exists) */
+#define QUERY_NONE 0
+#define QUERY_COUNT 1
+#define QUERY_EXISTS 2
 
-struct vcc;
 struct source;
 struct token;
+struct tok_sink;
+struct buf;
+struct selector;
 
 struct match_constraint {
 	const char *look_behind;
 	const char *look_ahead;
-	struct source *look_behind_src;
-	struct source *look_ahead_src;
+	const char *within;
+	const char *select;
+	struct pattern *look_behind_pat;
+	struct pattern *look_ahead_pat;
+	struct pattern *within_pat;
+	struct selector *select_sel;
 	int limit;
 	int offset;
+	unsigned long max_steps;
+	int show_plan;
+	int explain;
 };
 
 struct insert_opts {
 	struct match_constraint match;
 	const char *text;
 	struct source *src;
+	int preserve;
+	int emit;
 };
 
 struct replace_opts {
 	struct match_constraint match;
 	const char *from_value;
 	const char *to_text;
-	struct source *from_src;
+	struct pattern *from_pat;
 	struct source *to_src;
 	int to_raw;
+	int preserve;
+	int emit;
 };
 
 struct extract_opts {
 	struct match_constraint match;
 	const char *from_value;
 	const char *to_text;
-	struct source *from_src;
+	struct pattern *from_pat;
 	struct source *to_src;
 	int to_raw;
 	int strip_ws;
+	int json;
+	int query;
+	struct text_pos base;
+	const char *until;
+	const char **stop;
 };
 
 /*
@@ -80,18 +117,72 @@ int text_needs_raw(
  * Caller must free *preprocessed if non-NULL.
  */
 void lex_pattern(
-	struct vcc *,
 	const char *,
 	struct source **,
 	char **
 );
 
+/*
+ * Compile a match pattern: pre-process wildcards and their :KIND
+ * suffixes, lex the result and build the pattern entries.  If
+ * comment_ok is set and the lexer stripped the whole pattern as a
+ * comment, it matches a COMMENT token instead.  Sets *dst to NULL
+ * if text is NULL.  Returns 0 on success, -1 on a pattern error.
+ */
+int compile_pattern(
+	const char *,
+	int,
+	struct pattern **
+);
+
+/*
+ * Free a pattern from compile_pattern (NULL is allowed).
+ */
+void free_pattern(
+	struct pattern *
+);
+
+/*
+ * Index src and plan the from pattern (may be NULL) and the
+ * look-behind, look-ahead and within patterns of a constraint.
+ * Prints the plans to stderr if show_plan is set.
+ */
+void plan_match(
+	struct source *,
+	struct match_constraint *,
+	struct pattern *
+);
+
+/*
+ * Return nonzero if --within or --select limits matching to the
+ * bodies of blocks.
+ */
+int match_scoped(
+	const struct match_constraint *
+);
+
 /*
  * Print the token stream for debugging.  If processed is set,
- * include SOI/EOI markers and inter-token gap content.
+ * include SOI/EOI markers and inter-token gap content.  With --json
+ * or --ndjson, each token is a record with its kind, text and span.
  */
 void cmd_tokens(
 	struct source *,
+	int,
+	int
+);
+
+/*
+ * Print the rows of cmd_tokens() without the header.  base is where
+ * the source starts in the whole input for the spans of JSON records
+ * (NULL for its start).  Unless last is set, the source is a piece of
+ * a longer input and its EOI marker is left out.
+ */
+void print_tokens(
+	struct source *,
+	int,
+	int,
+	const struct text_pos *,
 	int
 );
 
@@ -99,7 +190,8 @@ void cmd_tokens(
  * Pass 1: Walk the token stream and apply replace operations,
  * writing raw VCL text to a buffer.  The caller re-tokenizes
  * and formats the result in pass 2.
- * Returns a malloc'd null-terminated string.
+ * Returns a malloc'd null-terminated string, or NULL if the match
+ * step budget ran out.
  */
 char *emit_transform_replace(
 	struct source *,
@@ -108,29 +200,93 @@ char *emit_transform_replace(
 
 /*
  * Walk the token stream and emit formatted output, applying
- * insert and/or replace operations.  Pass NULL to skip.
+ * insert and/or replace operations.  Pass NULL to skip.  Output
+ * goes to the token sink if one is given, otherwise to stdout.
+ * Returns 0, or -1 if the match step budget ran out.
  */
-void emit_formatted(
+int emit_formatted(
 	struct source *,
 	const struct insert_opts *,
-	const struct replace_opts *
+	const struct replace_opts *,
+	struct tok_sink *
+);
+
+/*
+ * Apply a replace and emit the formatted result: in one formatted
+ * pass for raw replacements, otherwise via emit_transform_replace
+ * and a re-lex of its output.  Output goes to
+ * the token sink if one is given, otherwise to stdout.
+ * Returns 0, or -1 if the match step budget ran out.
+ */
+int apply_replace(
+	struct source *,
+	const struct replace_opts *,
+	struct tok_sink *
+);
+
+/*
+ * Apply insert or replace operations (pass NULL for the other) to
+ * the original text without reformatting it: each match becomes an
+ * edit of its byte range, and the output is the untouched bytes
+ * between edits plus the rendered insert or to text
+ * (--preserve-formatting).  Output goes to the token sink if one is
+ * given, otherwise to stdout.  With --emit, the edits themselves are
+ * printed instead, as a unified diff or a JSON edit list.
+ * Returns 0, -1 if the match step budget ran out, or 1 if the edits
+ * don't fit the text (after printing why).
+ */
+int emit_spliced(
+	struct source *,
+	const struct insert_opts *,
+	const struct replace_opts *,
+	struct tok_sink *
 );
 
 /*
  * Walk the token stream, find pattern matches, and print each
  * match.  In 1-arg mode (no template), print the raw source text
  * of the matched region.  In 2-arg mode, substitute captures into
- * the template and print the result.
+ * the template and print the result.  With --json or --ndjson, each
+ * match is instead an NDJSON record with its span, printed text and
+ * capture spans; ext->base says where src starts in the whole input
+ * (line 0 for its start).  With --count or --exists, matches are only
+ * counted.  Output is appended to the buffer if one is given,
+ * otherwise written to stdout.  For --stream, matches are only tried
+ * at tokens before ext->until if it is set, and if ext->stop is set,
+ * matching also stops at the first attempt whose outcome depends on
+ * where src ends; *ext->stop is then where matching stopped, or NULL
+ * if it reached the end.
+ * Returns the number of matches, including those skipped by
+ * --offset, or -1 if the match step budget ran out.
  */
-void cmd_extract(
+int cmd_extract(
 	struct source *,
-	const struct extract_opts *
+	const struct extract_opts *,
+	struct buf *
+);
+
+/*
+ * Find the matches of a pattern for the grep command and append a
+ * "name:line:text" line to out for each source line a match starts
+ * on, or just "name" if files_only is set.  If out is NULL, matches
+ * are only counted.  --limit bounds the matches per source.
+ * Returns the number of matches, or -1 if the match step budget ran
+ * out.
+ */
+int grep_source(
+	struct source *,
+	const struct pattern *,
+	const struct match_constraint *,
+	const char *,
+	int,
+	struct buf *
 );
 
 /*
  * Scan inter-token gaps for comments and insert synthetic COMMENT
  * tokens into the source's token list.  This makes comments visible
- * to pattern matching in the extract command.
+ * to pattern matching in the extract command.  Does nothing if the
+ * source already has them.
  */
 void add_comment_tokens(
 	struct source *
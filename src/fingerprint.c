@@ -0,0 +1,143 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vsha256.h"
+#include "token.h"
+#include "buf.h"
+#include "pattern.h"
+#include "index.h"
+#include "edit.h"
+#include "fingerprint.h"
+
+/*
+ * Hash one token as a class byte and its text, NUL-terminated so it
+ * can't run into the next token's.  Operators and punctuation are
+ * told apart by their text; the class keeps a string "x" from an
+ * identifier x.  Classes rather than libvcc's kind numbers or names
+ * keep fingerprints the same across Vinyl versions.
+ */
+static void hash_token(VSHA256_CTX *ctx, const struct token *t) {
+	char class;
+
+	switch (t->tok) {
+	case ID:
+		class = 'I';
+		break;
+	case CSTR:
+		class = 'S';
+		break;
+	case CNUM:
+		class = 'N';
+		break;
+	case FNUM:
+		class = 'F';
+		break;
+	case CSRC:
+		class = 'C';
+		break;
+	case COMMENT:
+		class = '#';
+		break;
+	default:
+		class = 'O';
+		break;
+	}
+	VSHA256_Update(ctx, &class, 1);
+	VSHA256_Update(ctx, t->b, (size_t)(t->e - t->b));
+	VSHA256_Update(ctx, "", 1);
+}
+
+/*
+ * Finish a fingerprint and append its record.  first is the keyword
+ * of a declaration that ends at e, or NULL for the whole file.  Lines
+ * are those of its first and last byte.
+ */
+static void fp_record(
+    struct buf *out, const struct line_index *li, const char *path,
+    const struct token *first, const struct token *name, const char *e,
+    VSHA256_CTX *ctx) {
+	unsigned char digest[VSHA256_LEN];
+	char hex[FP_LEN * 2 + 1], num[64];
+	struct text_pos s, x;
+	int i;
+
+	VSHA256_Final(digest, ctx);
+	for (i = 0; i < FP_LEN; i++)
+		snprintf(hex + i * 2, 3, "%02x", digest[i]);
+	buf_appends(out, "{\"file\":");
+	buf_append_json(out, path, strlen(path));
+	buf_appends(out, ",\"kind\":");
+	if (first != NULL)
+		buf_append_json(out, first->b, (size_t)(first->e - first->b));
+	else
+		buf_appends(out, "\"file\"");
+	buf_appends(out, ",\"name\":");
+	if (name != NULL)
+		buf_append_json(out, name->b, (size_t)(name->e - name->b));
+	else
+		buf_appends(out, "null");
+	line_index_pos(li, first != NULL ? first->b : li->b, &s);
+	line_index_pos(li, e > li->b ? e - 1 : e, &x);
+	snprintf(num, sizeof(num), ",\"line\":%ld,\"end_line\":%ld", s.line, x.line);
+	buf_appends(out, num);
+	buf_appends(out, ",\"fingerprint\":\"");
+	buf_appends(out, hex);
+	buf_appends(out, "\"}\n");
+}
+
+int fingerprint_source(struct source *src, const char *path, int comments, struct buf *out) {
+	VSHA256_CTX file, decl;
+	struct line_index li;
+	struct token *t, *first, *name;
+	int depth, ntok, n;
+
+	if (comments)
+		add_comment_tokens(src);
+	line_index_build(&li, src->b, src->e, NULL);
+	VSHA256_Init(&file);
+	VSHA256_Init(&decl);
+	first = name = NULL;
+	depth = ntok = n = 0;
+	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
+		if (t->tok == SOI)
+			continue;
+		if (t->tok == EOI)
+			break;
+		if (t->tok == COMMENT && !comments)
+			continue;
+		hash_token(&file, t);
+		hash_token(&decl, t);
+		if (t->tok == COMMENT)
+			continue;
+
+		/* The keyword starts a declaration, the next token names it */
+		if (++ntok == 1)
+			first = t;
+		else if (ntok == 2 && t->tok != '{' && t->tok != ';')
+			name = t;
+		if (t->tok == '{')
+			depth++;
+		else if (t->tok == '}' && depth > 0)
+			depth--;
+		if (depth > 0 || (t->tok != ';' && t->tok != '}'))
+			continue;
+		fp_record(out, &li, path, first, name, t->e, &decl);
+		VSHA256_Init(&decl);
+		first = name = NULL;
+		ntok = 0;
+		n++;
+	}
+
+	/* An unterminated last declaration still counts */
+	if (first != NULL) {
+		fp_record(out, &li, path, first, name, src->e, &decl);
+		n++;
+	}
+	fp_record(out, &li, path, NULL, NULL, src->e, &file);
+	line_index_free(&li);
+	return (n);
+}
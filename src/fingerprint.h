@@ -0,0 +1,26 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+struct source;
+struct buf;
+
+/* Bytes of a fingerprint: the first 128 bits of a SHA-256 */
+#define FP_LEN 16
+
+/*
+ * Append an NDJSON record for each top-level declaration of a lexed
+ * source (vcl, import, include, backend, sub, ...) and one for the
+ * whole file, each with a fingerprint of its tokens' kinds and text.
+ * Whitespace doesn't count, so reformatting keeps every fingerprint.
+ * Comments count unless the third argument is 0; a comment belongs
+ * to the declaration after it.  path is the file name recorded.
+ * Returns the number of declarations.
+ */
+int fingerprint_source(
+	struct source *,
+	const char *,
+	int,
+	struct buf *
+);
+
+#endif
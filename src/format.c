@@ -3,15 +3,27 @@
 #include <stdio.h>
 #include <string.h>
 
-#include "vcc_compile.h"
+#include "token.h"
 #include "pattern.h"
+#include "tokfile.h"
 #include "format.h"
 
-static void print_indent(int depth) {
+static void fmt_write(struct fmt_state *st, const char *s, size_t n) {
+	if (st->sink != NULL)
+		buf_append(&st->sink->text, s, n);
+	else
+		fwrite(s, 1, n, stdout);
+}
+
+static void fmt_puts(struct fmt_state *st, const char *s) {
+	fmt_write(st, s, strlen(s));
+}
+
+static void print_indent(struct fmt_state *st) {
 	int i;
 
-	for (i = 0; i < depth; i++)
-		printf("    ");
+	for (i = 0; i < st->indent; i++)
+		fmt_puts(st, "    ");
 }
 
 void fmt_emit(struct fmt_state *st, struct token *t, const char *text) {
@@ -22,12 +34,12 @@ void fmt_emit(struct fmt_state *st, struct token *t, const char *text) {
 		st->first = 0;
 	}
 	else if (st->need_blank) {
-		printf("\n\n");
-		print_indent(st->indent);
+		fmt_puts(st, "\n\n");
+		print_indent(st);
 	}
 	else if (st->need_newline) {
-		printf("\n");
-		print_indent(st->indent);
+		fmt_puts(st, "\n");
+		print_indent(st);
 	}
 	else if (t->tok == ';' || t->tok == ')' || t->tok == '.') {
 		/* no space before */
@@ -39,16 +51,22 @@ void fmt_emit(struct fmt_state *st, struct token *t, const char *text) {
 		/* no space between number and unit suffix */
 	}
 	else {
-		printf(" ");
+		fmt_puts(st, " ");
 	}
 
 	st->need_newline = 0;
 	st->need_blank = 0;
 
+	if (st->sink != NULL) {
+		if (text != NULL)
+			st->sink->inexact = 1;
+		tok_sink_record(st->sink, st->sink->text.len,
+		    text != NULL ? strlen(text) : (size_t)(t->e - t->b), t->tok);
+	}
 	if (text != NULL)
-		printf("%s", text);
+		fmt_puts(st, text);
 	else
-		printf("%.*s", PF(t));
+		fmt_write(st, t->b, (size_t)(t->e - t->b));
 
 	if (t->tok == '{') {
 		st->indent++;
@@ -73,27 +91,40 @@ void fmt_emit(struct fmt_state *st, struct token *t, const char *text) {
 	st->prev_tok = t->tok;
 }
 
-void fmt_emit_raw(struct fmt_state *st, const char *text) {
+/*
+ * Write text on its own line without recording tokens.
+ */
+static void emit_line(struct fmt_state *st, const char *text) {
 	if (st->first) {
 		st->first = 0;
 	}
 	else if (st->need_blank) {
-		printf("\n\n");
-		print_indent(st->indent);
+		fmt_puts(st, "\n\n");
+		print_indent(st);
 	}
 	else if (st->need_newline) {
-		printf("\n");
-		print_indent(st->indent);
+		fmt_puts(st, "\n");
+		print_indent(st);
 	}
 	else {
-		printf(" ");
+		fmt_puts(st, " ");
 	}
 	st->need_newline = 0;
 	st->need_blank = 0;
-	printf("%s", text);
+	fmt_puts(st, text);
 	st->need_newline = 1;
 }
 
+void fmt_emit_raw(struct fmt_state *st, const char *text) {
+	if (st->sink != NULL)
+		st->sink->inexact = 1;
+	emit_line(st, text);
+}
+
+void fmt_finish(struct fmt_state *st) {
+	fmt_puts(st, "\n");
+}
+
 void fmt_emit_source(struct fmt_state *st, struct source *src) {
 	struct token *t;
 
@@ -136,6 +167,20 @@ void fmt_emit_source_caps(struct fmt_state *st, struct source *src, struct captu
 	}
 }
 
+const char *fmt_emit_range(struct fmt_state *st, struct token *t, struct token *end, const char *last_end) {
+	for (; t != NULL && t != end; t = VTAILQ_NEXT(t, src_list)) {
+		if (t->tok == EOI)
+			break;
+		if (t->tok == SOI)
+			continue;
+		if (t->b > last_end)
+			fmt_emit_gap_comments(st, last_end, t->b);
+		fmt_emit(st, t, NULL);
+		last_end = t->e;
+	}
+	return (last_end);
+}
+
 void fmt_emit_gap_comments(struct fmt_state *st, const char *from, const char *to) {
 	const char *p, *start;
 	char buf[8192];
@@ -171,39 +216,44 @@ void fmt_emit_gap_comments(struct fmt_state *st, const char *from, const char *t
 			len = (int)sizeof(buf) - 1;
 		memcpy(buf, start, len);
 		buf[len] = '\0';
-		fmt_emit_raw(st, buf);
+		emit_line(st, buf);
 	}
 }
 
-void emit_gap(const char *from, const char *to) {
-	const char *p, *start, *label;
+const char *gap_next(const char *p, const char *to, const char **startp, const char **label) {
+	const char *start;
 
-	p = from;
-	while (p < to) {
-		while (p < to && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+	while (p < to && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+	if (p >= to)
+		return (NULL);
+	start = p;
+	if (*p == '/' && p + 1 < to && p[1] == '*') {
+		/* C-style multiline comment: skip to closing */
+		p += 2;
+		while (p + 1 < to && !(*p == '*' && p[1] == '/'))
 			p++;
-		if (p >= to)
-			break;
-		start = p;
-		if (*p == '/' && p + 1 < to && p[1] == '*') {
-			/* C-style multiline comment: skip to closing */
+		if (p + 1 < to)
 			p += 2;
-			while (p + 1 < to && !(*p == '*' && p[1] == '/'))
-				p++;
-			if (p + 1 < to)
-				p += 2;
-			label = "COMMENT";
-		}
-		else {
-			while (p < to && *p != '\n')
-				p++;
-			if (*start == '#' || (*start == '/' && start + 1 < to && start[1] == '/'))
-				label = "COMMENT";
-			else if (*start == '$')
-				label = "DIRECTIVE";
-			else
-				label = "UNKNOWN";
-		}
-		printf("%-12s %.*s\n", label, (int)(p - start), start);
+		*label = "COMMENT";
+	}
+	else {
+		while (p < to && *p != '\n')
+			p++;
+		if (*start == '#' || (*start == '/' && start + 1 < to && start[1] == '/'))
+			*label = "COMMENT";
+		else if (*start == '$')
+			*label = "DIRECTIVE";
+		else
+			*label = "UNKNOWN";
 	}
+	*startp = start;
+	return (p);
+}
+
+void emit_gap(const char *from, const char *to) {
+	const char *p, *start, *label;
+
+	for (p = from; (p = gap_next(p, to, &start, &label)) != NULL; )
+		printf("%-12s %.*s\n", label, (int)(p - start), start);
 }
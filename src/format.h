@@ -4,13 +4,19 @@
 struct token;
 struct source;
 struct capture;
+struct tok_sink;
 
+/*
+ * Formatter state.  Output goes to stdout, or to sink (recording
+ * each emitted token) if it is set.
+ */
 struct fmt_state {
 	int indent;
 	int need_newline;
 	int need_blank;
 	int first;
 	unsigned prev_tok;
+	struct tok_sink *sink;
 };
 
 /*
@@ -31,6 +37,13 @@ void fmt_emit_raw(
 	const char *
 );
 
+/*
+ * End formatted output with a newline.
+ */
+void fmt_finish(
+	struct fmt_state *
+);
+
 /*
  * Emit all tokens from a source through the formatter.
  */
@@ -51,6 +64,19 @@ void fmt_emit_source_caps(
 	int
 );
 
+/*
+ * Emit tokens from t up to end (exclusive; NULL runs to EOI) with
+ * the comments in the gaps before them, continuing from text
+ * position last_end.  SOI is skipped.
+ * Returns the end of the last token emitted.
+ */
+const char *fmt_emit_range(
+	struct fmt_state *,
+	struct token *,
+	struct token *,
+	const char *
+);
+
 /*
  * Emit inter-token gap comments through the formatter.
  * Preserves # comments, // comments, and C-style block comments.
@@ -61,6 +87,19 @@ void fmt_emit_gap_comments(
 	const char *
 );
 
+/*
+ * Find the next item of inter-token gap content in [p, to): a
+ * comment, a $ directive or unknown text up to the end of its line.
+ * Sets the item's start and label and returns its end, or NULL if
+ * only whitespace is left.
+ */
+const char *gap_next(
+	const char *,
+	const char *,
+	const char **,
+	const char **
+);
+
 /*
  * Print inter-token gap content (comments, $ directives) as
  * labeled lines.  Skips whitespace, emits each non-blank line.
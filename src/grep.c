@@ -0,0 +1,292 @@
+/* memmem() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "config.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "token.h"
+#include "buf.h"
+#include "grep.h"
+#include "lex.h"
+
+struct grep_file {
+	char *path;
+	struct buf out;
+	int nmatch;
+	const char *budget;
+};
+
+struct grep_lit {
+	const char *b;
+	size_t len;
+};
+
+struct grep_job {
+	const struct grep_opts *opts;
+	struct grep_file *files;
+	int nfiles;
+	int cap;
+	int next;
+	int found;
+	pthread_mutex_t lock;
+	struct grep_lit *lits;
+	int nlit;
+};
+
+static void add_file(struct grep_job *job, const char *path) {
+	struct grep_file *f;
+
+	if (job->nfiles == job->cap) {
+		job->cap = job->cap > 0 ? job->cap * 2 : 64;
+		job->files = realloc(job->files, job->cap * sizeof(*job->files));
+	}
+	f = &job->files[job->nfiles++];
+	memset(f, 0, sizeof(*f));
+	f->path = strdup(path);
+	buf_init(&f->out);
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+	size_t n = strlen(s), m = strlen(suffix);
+
+	return (n >= m && strcmp(s + n - m, suffix) == 0);
+}
+
+/*
+ * Collect the files to search under path.  Returns 0 on success, -1
+ * if path can't be read.
+ */
+static int collect(struct grep_job *job, const char *path, int top) {
+	struct dirent **names;
+	struct stat st;
+	char sub[4096];
+	int i, n;
+
+	if (stat(path, &st) != 0) {
+		perror(path);
+		return (-1);
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		if (top || (S_ISREG(st.st_mode) && has_suffix(path, GREP_SUFFIX)))
+			add_file(job, path);
+		return (0);
+	}
+	n = scandir(path, &names, NULL, alphasort);
+	if (n < 0) {
+		perror(path);
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		if (names[i]->d_name[0] != '.') {
+			snprintf(sub, sizeof(sub), "%s%s%s", path,
+			    has_suffix(path, "/") ? "" : "/", names[i]->d_name);
+			collect(job, sub, 0);
+		}
+		free(names[i]);
+	}
+	free(names);
+	return (0);
+}
+
+static int token_is(const struct token *t, const char *s) {
+	return ((size_t)(t->e - t->b) == strlen(s) && memcmp(t->b, s, strlen(s)) == 0);
+}
+
+static void add_lits(struct grep_job *job, const struct pattern *pat) {
+	const struct token *t;
+	int i;
+
+	if (pat == NULL)
+		return;
+	for (i = 0; i < pat->n; i++) {
+		if (pat->elem[i].type != PAT_LITERAL)
+			continue;
+		t = pat->elem[i].tok;
+		/* Boundary tokens have no text in the file */
+		if (token_is(t, "SOI") || token_is(t, "EOI"))
+			continue;
+		job->lits = realloc(job->lits, (job->nlit + 1) * sizeof(*job->lits));
+		job->lits[job->nlit].b = t->b;
+		job->lits[job->nlit].len = (size_t)(t->e - t->b);
+		job->nlit++;
+	}
+}
+
+static int lit_cmp(const void *a, const void *b) {
+	const struct grep_lit *la = a, *lb = b;
+
+	if (la->len != lb->len)
+		return (la->len > lb->len ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Map a file and check it for every required literal.  Returns a
+ * NUL-terminated copy of the file if it may match, NULL otherwise.
+ */
+static char *prefilter(const struct grep_job *job, const char *path) {
+	struct stat st;
+	char *map, *buf;
+	int fd, i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return (NULL);
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return (NULL);
+	}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(path);
+		return (NULL);
+	}
+	for (i = 0; i < job->nlit; i++) {
+		if (memmem(map, (size_t)st.st_size, job->lits[i].b, job->lits[i].len) == NULL) {
+			munmap(map, (size_t)st.st_size);
+			return (NULL);
+		}
+	}
+	buf = malloc((size_t)st.st_size + 1);
+	memcpy(buf, map, (size_t)st.st_size);
+	buf[st.st_size] = '\0';
+	munmap(map, (size_t)st.st_size);
+	return (buf);
+}
+
+static void grep_file(
+    const struct grep_job *job, struct grep_file *f,
+    struct match_constraint *mc, struct pattern *from) {
+	struct source *src;
+	char *buf;
+	int r;
+
+	buf = prefilter(job, f->path);
+	if (buf == NULL)
+		return;
+	src = source_new(buf, "file", f->path);
+	lex_source(src);
+	add_boundary_tokens(src);
+	add_comment_tokens(src);
+	plan_match(src, mc, from);
+	match_budget_reset(mc->max_steps);
+	r = grep_source(src, from, mc, f->path, job->opts->files_only,
+	    job->opts->query != QUERY_NONE ? NULL : &f->out);
+	if (r < 0)
+		f->budget = match_budget_exceeded();
+	else
+		f->nmatch = r;
+	source_free(src);
+	free(buf);
+}
+
+static void *worker(void *arg) {
+	struct grep_job *job = arg;
+	const struct grep_opts *opts = job->opts;
+	struct match_constraint mc;
+	struct pattern *from;
+	int i;
+
+	/* Plans and regex match data live in the pattern: compile a copy */
+	mc = opts->match;
+	mc.show_plan = 0;
+	compile_pattern(mc.look_behind, 0, &mc.look_behind_pat);
+	compile_pattern(mc.look_ahead, 0, &mc.look_ahead_pat);
+	compile_pattern(mc.within, 0, &mc.within_pat);
+	compile_pattern(opts->from_value, 1, &from);
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->found ? job->nfiles : job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->nfiles)
+			break;
+		grep_file(job, &job->files[i], &mc, from);
+		if (opts->query == QUERY_EXISTS && job->files[i].nmatch > 0) {
+			/* --exists: the answer is known */
+			pthread_mutex_lock(&job->lock);
+			job->found = 1;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	free_pattern(mc.look_behind_pat);
+	free_pattern(mc.look_ahead_pat);
+	free_pattern(mc.within_pat);
+	free_pattern(from);
+	return (NULL);
+}
+
+int grep_run(const struct grep_opts *opts) {
+	struct grep_job job;
+	struct grep_file *f;
+	pthread_t *tids;
+	long total;
+	int i, njobs, matched, budget;
+
+	memset(&job, 0, sizeof(job));
+	job.opts = opts;
+	pthread_mutex_init(&job.lock, NULL);
+	for (i = 0; i < opts->npaths; i++)
+		collect(&job, opts->paths[i], 1);
+
+	/* Longest literals first: they reject the most files */
+	add_lits(&job, opts->from_pat);
+	add_lits(&job, opts->match.look_behind_pat);
+	add_lits(&job, opts->match.look_ahead_pat);
+	add_lits(&job, opts->match.within_pat);
+	qsort(job.lits, job.nlit, sizeof(*job.lits), lit_cmp);
+
+	njobs = opts->jobs;
+	if (njobs > job.nfiles)
+		njobs = job.nfiles;
+	if (njobs <= 1)
+		worker(&job);
+	else {
+		tids = malloc(njobs * sizeof(*tids));
+		for (i = 0; i < njobs; i++)
+			pthread_create(&tids[i], NULL, worker, &job);
+		for (i = 0; i < njobs; i++)
+			pthread_join(tids[i], NULL);
+		free(tids);
+	}
+
+	matched = 0;
+	budget = 0;
+	total = 0;
+	for (i = 0; i < job.nfiles; i++) {
+		f = &job.files[i];
+		fwrite(f->out.data, 1, f->out.len, stdout);
+		if (f->budget != NULL) {
+			fprintf(stderr, "%s: match step budget exceeded (--max-steps %lu) for pattern: %s\n",
+			    f->path, opts->match.max_steps, f->budget);
+			budget = 1;
+		}
+		matched += f->nmatch > 0;
+		total += f->nmatch;
+		free(f->out.data);
+		free(f->path);
+	}
+	if (opts->query == QUERY_COUNT && !budget)
+		printf("%ld\n", total);
+	free(job.files);
+	free(job.lits);
+	pthread_mutex_destroy(&job.lock);
+	if (budget)
+		return (EXIT_MATCH_BUDGET);
+	return (matched > 0 ? 0 : 1);
+}
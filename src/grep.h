@@ -0,0 +1,39 @@
+#ifndef GREP_H
+#define GREP_H
+
+#include "edit.h"
+
+/* Files found by walking a directory must have this suffix */
+#define GREP_SUFFIX ".vcl"
+
+struct grep_opts {
+	struct match_constraint match;
+	const char *from_value;
+	struct pattern *from_pat;
+	char **paths;
+	int npaths;
+	int files_only;
+	int query;
+	int jobs;
+};
+
+/*
+ * Search files and directory trees for a pattern (grep command).
+ * Directories are walked recursively in name order, skipping dot
+ * entries; explicitly named files are searched whatever their
+ * suffix.  Each file is mapped and rejected without lexing unless
+ * it contains the text of every literal token the patterns
+ * require.  Surviving files are lexed and matched by jobs worker
+ * threads, each with its own compiled copy of the patterns; output
+ * is printed in file order.  The patterns in opts must already be
+ * compiled (they supply the prefilter literals).  --count prints
+ * the total number of matches instead; --exists prints nothing and
+ * stops handing out files once one has matched.
+ * Returns 0 if anything matched, 1 if nothing did, or
+ * EXIT_MATCH_BUDGET if a file ran out of match steps.
+ */
+int grep_run(
+	const struct grep_opts *
+);
+
+#endif
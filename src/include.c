@@ -0,0 +1,248 @@
+#include "config.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "token.h"
+#include "edit.h"
+#include "lex.h"
+#include "include.h"
+
+struct lex_job {
+	struct inc_graph *g;
+	int next;
+	int end;
+	pthread_mutex_t lock;
+};
+
+static char *slurp(const char *path, long *out_len) {
+	FILE *f;
+	long len;
+	char *buf;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return (NULL);
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(len + 1);
+	if (fread(buf, 1, len, f) != (size_t)len) {
+		perror(path);
+		free(buf);
+		fclose(f);
+		return (NULL);
+	}
+	buf[len] = '\0';
+	fclose(f);
+	*out_len = len;
+	return (buf);
+}
+
+/*
+ * Add a file to the graph unless its real path is already there.
+ * Returns 0 on success, -1 on error.
+ */
+static int add_file(struct inc_graph *g, const char *path) {
+	struct inc_file *f;
+	VSHA256_CTX ctx;
+	char real[PATH_MAX];
+	int i;
+
+	if (realpath(path, real) == NULL) {
+		perror(path);
+		return (-1);
+	}
+	for (i = 0; i < g->n; i++) {
+		if (strcmp(g->file[i].real, real) == 0)
+			return (0);
+	}
+	if (g->n == g->cap) {
+		g->cap = g->cap > 0 ? g->cap * 2 : 16;
+		g->file = realloc(g->file, g->cap * sizeof(*g->file));
+	}
+	f = &g->file[g->n];
+	memset(f, 0, sizeof(*f));
+	f->buf = slurp(path, &f->len);
+	if (f->buf == NULL)
+		return (-1);
+	f->path = strdup(path);
+	f->real = strdup(real);
+	VSHA256_Init(&ctx);
+	VSHA256_Update(&ctx, f->buf, (size_t)f->len);
+	VSHA256_Final(f->hash, &ctx);
+	f->dup = -1;
+	for (i = 0; i < g->n; i++) {
+		if (g->file[i].dup < 0 &&
+		    memcmp(g->file[i].hash, f->hash, sizeof(f->hash)) == 0) {
+			f->dup = i;
+			break;
+		}
+	}
+	g->n++;
+	return (0);
+}
+
+static void *lex_worker(void *arg) {
+	struct lex_job *job = arg;
+	struct inc_file *f;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->end)
+			break;
+		f = &job->g->file[i];
+		if (f->dup >= 0)
+			continue;
+		f->src = source_new(f->buf, "file", f->path);
+		lex_source(f->src);
+		add_boundary_tokens(f->src);
+	}
+	return (NULL);
+}
+
+/*
+ * Lex files [from, to) of the graph, in parallel when there are
+ * several.
+ */
+static void lex_level(struct inc_graph *g, int from, int to) {
+	struct lex_job job;
+	pthread_t *tids;
+	int i, n;
+
+	job.g = g;
+	job.next = from;
+	job.end = to;
+	pthread_mutex_init(&job.lock, NULL);
+	n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > to - from)
+		n = to - from;
+	if (n <= 1)
+		lex_worker(&job);
+	else {
+		tids = malloc(n * sizeof(*tids));
+		for (i = 0; i < n; i++)
+			pthread_create(&tids[i], NULL, lex_worker, &job);
+		for (i = 0; i < n; i++)
+			pthread_join(tids[i], NULL);
+		free(tids);
+	}
+	pthread_mutex_destroy(&job.lock);
+}
+
+/*
+ * Resolve an include name seen in the file at path.  Returns 0 and
+ * fills out on success, -1 if no candidate exists.
+ */
+static int resolve(
+    const char *path, const char *name, char **search, int nsearch,
+    char *out, size_t outlen) {
+	const char *slash;
+	int n, i;
+
+	if (name[0] == '/') {
+		n = snprintf(out, outlen, "%s", name);
+		return ((size_t)n < outlen && access(out, R_OK) == 0 ? 0 : -1);
+	}
+	if (strncmp(name, "./", 2) != 0 && strncmp(name, "../", 3) != 0) {
+		for (i = 0; i < nsearch; i++) {
+			n = snprintf(out, outlen, "%s/%s", search[i], name);
+			if ((size_t)n < outlen && access(out, R_OK) == 0)
+				return (0);
+		}
+	}
+	if (strncmp(name, "./", 2) == 0)
+		name += 2;
+	slash = strrchr(path, '/');
+	if (slash != NULL)
+		n = snprintf(out, outlen, "%.*s/%s", (int)(slash - path), path, name);
+	else
+		n = snprintf(out, outlen, "%s", name);
+	return ((size_t)n < outlen && access(out, R_OK) == 0 ? 0 : -1);
+}
+
+/*
+ * Add the targets of the include statements in file i.
+ * Returns 0 on success, -1 on error.
+ */
+static int scan_includes(struct inc_graph *g, int i, char **search, int nsearch) {
+	struct token *t, *name, *semi;
+	char target[PATH_MAX], inc[PATH_MAX];
+	size_t len;
+
+	VTAILQ_FOREACH(t, &g->file[i].src->src_tokens, src_list) {
+		if (t->tok != ID || (size_t)(t->e - t->b) != 7 ||
+		    strncmp(t->b, "include", 7) != 0)
+			continue;
+		name = VTAILQ_NEXT(t, src_list);
+		semi = name != NULL ? VTAILQ_NEXT(name, src_list) : NULL;
+		if (name == NULL || name->tok != CSTR || semi == NULL ||
+		    (size_t)(semi->e - semi->b) != 1 || *semi->b != ';')
+			continue;
+		len = (size_t)(name->e - name->b);
+		if (len < 2 || *name->b != '"' || len - 2 >= sizeof(inc))
+			continue;
+		memcpy(inc, name->b + 1, len - 2);
+		inc[len - 2] = '\0';
+		if (resolve(g->file[i].path, inc, search, nsearch,
+		    target, sizeof(target)) != 0) {
+			fprintf(stderr, "%s: include \"%s\" not found\n",
+			    g->file[i].path, inc);
+			return (-1);
+		}
+		/* add_file may move the array: don't hold pointers into it */
+		if (add_file(g, target) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+int include_load(
+    struct inc_graph *g, const char *root, char **search, int nsearch,
+    int check_gaps) {
+	int from, to, i;
+
+	memset(g, 0, sizeof(*g));
+	if (add_file(g, root) != 0)
+		return (-1);
+	for (from = 0; from < g->n; from = to) {
+		to = g->n;
+		lex_level(g, from, to);
+		for (i = from; i < to; i++) {
+			/* A copy elsewhere may still resolve its includes differently */
+			if (g->file[i].dup >= 0)
+				g->file[i].src = g->file[g->file[i].dup].src;
+			else if (check_gaps && check_unknown_gaps(g->file[i].src) != 0) {
+				if (i > 0)
+					fprintf(stderr, "in included file %s\n", g->file[i].path);
+				return (-1);
+			}
+			if (scan_includes(g, i, search, nsearch) != 0)
+				return (-1);
+		}
+	}
+	return (0);
+}
+
+void include_free(struct inc_graph *g) {
+	int i;
+
+	for (i = 0; i < g->n; i++) {
+		if (g->file[i].dup < 0 && g->file[i].src != NULL)
+			source_free(g->file[i].src);
+		free(g->file[i].path);
+		free(g->file[i].real);
+		free(g->file[i].buf);
+	}
+	free(g->file);
+	memset(g, 0, sizeof(*g));
+}
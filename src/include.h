@@ -0,0 +1,57 @@
+#ifndef INCLUDE_H
+#define INCLUDE_H
+
+#include <stdint.h>
+
+#include "vsha256.h"
+
+struct source;
+
+/*
+ * One file of an include graph (--follow-includes).  Files with the
+ * same content share the lexed source of the first one (dup is its
+ * index, or -1).
+ */
+struct inc_file {
+	char *path;
+	char *real;
+	char *buf;
+	long len;
+	unsigned char hash[VSHA256_LEN];
+	int dup;
+	struct source *src;
+};
+
+struct inc_graph {
+	struct inc_file *file;
+	int n;
+	int cap;
+};
+
+/*
+ * Load root and every file reachable through include "x.vcl";
+ * statements, root first, then breadth first in include order.
+ * Absolute names are used as they are, names starting with ./ or
+ * ../ are relative to the including file, and other names are
+ * looked up in the search directories and then next to the
+ * including file.  Files are deduplicated by real path and content
+ * hash; each level of the graph is lexed in parallel.  If check_gaps
+ * is set, files with content the lexer can't parse are an error.
+ * Returns 0 on success, -1 on error.
+ */
+int include_load(
+	struct inc_graph *,
+	const char *,
+	char **,
+	int,
+	int
+);
+
+/*
+ * Free an include graph.
+ */
+void include_free(
+	struct inc_graph *
+);
+
+#endif
@@ -0,0 +1,161 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "token.h"
+#include "index.h"
+
+static unsigned text_hash(const char *b, unsigned len) {
+	unsigned h = 2166136261u;
+	unsigned i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)b[i];
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+static struct index_slot *index_lookup(
+    const struct src_index *idx, const char *b, unsigned len) {
+	struct index_slot *s;
+	unsigned i;
+
+	i = text_hash(b, len) & (idx->nslot - 1);
+	for (;;) {
+		s = &idx->slot[i];
+		if (s->b == NULL)
+			return (s);
+		if (s->len == len && memcmp(s->b, b, len) == 0)
+			return (s);
+		i = (i + 1) & (idx->nslot - 1);
+	}
+}
+
+/*
+ * Double the hash, keeping the slots' text and counts.
+ */
+static void index_grow(struct src_index *idx) {
+	struct index_slot *old, *s;
+	unsigned i, n;
+
+	old = idx->slot;
+	n = idx->nslot;
+	idx->nslot *= 2;
+	idx->slot = calloc(idx->nslot, sizeof(*idx->slot));
+	for (i = 0; i < n; i++) {
+		if (old[i].b == NULL)
+			continue;
+		s = index_lookup(idx, old[i].b, old[i].len);
+		*s = old[i];
+	}
+	free(old);
+}
+
+void source_index_build(struct source *src, struct src_index *idx) {
+	struct index_slot *s;
+	struct token *t;
+	unsigned used;
+	int cap;
+
+	memset(idx, 0, sizeof(*idx));
+	cap = 0;
+	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
+		if (idx->n == cap) {
+			cap = cap > 0 ? cap * 2 : 256;
+			idx->tok = realloc(idx->tok, cap * sizeof(*idx->tok));
+		}
+		t->cnt = idx->n;
+		idx->tok[idx->n++] = t;
+	}
+
+	/* Sized by distinct texts, which are far fewer than tokens */
+	idx->nslot = 256;
+	idx->slot = calloc(idx->nslot, sizeof(*idx->slot));
+	used = 0;
+	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
+		s = index_lookup(idx, t->b, (unsigned)(t->e - t->b));
+		if (s->b == NULL) {
+			s->b = t->b;
+			s->len = (unsigned)(t->e - t->b);
+			used++;
+		}
+		s->count++;
+		if (used * 2 > idx->nslot)
+			index_grow(idx);
+	}
+}
+
+void source_index_free(struct src_index *idx) {
+	free(idx->tok);
+	free(idx->slot);
+	memset(idx, 0, sizeof(*idx));
+}
+
+unsigned source_index_count(const struct src_index *idx, const struct token *t) {
+	if (idx->slot == NULL)
+		return (0);
+	return (index_lookup(idx, t->b, (unsigned)(t->e - t->b))->count);
+}
+
+void line_index_build(struct line_index *li, const char *b, const char *e, const struct text_pos *base) {
+	const char *p;
+	long cap;
+
+	li->b = b;
+	li->e = e;
+	li->base.off = 0;
+	li->base.line = 1;
+	li->base.col = 1;
+	if (base != NULL)
+		li->base = *base;
+	cap = 64;
+	li->start = malloc(cap * sizeof(*li->start));
+	li->start[0] = 0;
+	li->n = 1;
+	for (p = b; (p = memchr(p, '\n', (size_t)(e - p))) != NULL; ) {
+		p++;
+		if (li->n == cap) {
+			cap *= 2;
+			li->start = realloc(li->start, cap * sizeof(*li->start));
+		}
+		li->start[li->n++] = (size_t)(p - b);
+	}
+}
+
+void line_index_pos(const struct line_index *li, const char *p, struct text_pos *pos) {
+	size_t off;
+	long lo, hi, mid;
+
+	off = (size_t)(p - li->b);
+	/* Last line starting at or before off */
+	lo = 0;
+	hi = li->n - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (li->start[mid] <= off)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	pos->off = li->base.off + off;
+	pos->line = li->base.line + lo;
+	pos->col = (long)(off - li->start[lo]) + (lo == 0 ? li->base.col : 1);
+}
+
+void text_pos_advance(struct text_pos *pos, const char *b, const char *e) {
+	const char *p, *nl;
+
+	pos->off += (size_t)(e - b);
+	for (p = b; (nl = memchr(p, '\n', (size_t)(e - p))) != NULL; p = nl + 1) {
+		pos->line++;
+		pos->col = 1;
+	}
+	pos->col += (long)(e - p);
+}
+
+void line_index_free(struct line_index *li) {
+	free(li->start);
+	memset(li, 0, sizeof(*li));
+}
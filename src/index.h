@@ -0,0 +1,112 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+
+struct source;
+struct token;
+
+struct index_slot {
+	const char *b;
+	unsigned len;
+	unsigned count;
+};
+
+/*
+ * Position and frequency index over a lexed source.  Every token in
+ * src_tokens (including SOI, EOI and COMMENT tokens) gets a position,
+ * stored in its cnt field, and the frequency of each token text is
+ * kept in an open-addressing hash.
+ */
+struct src_index {
+	struct token **tok;
+	int n;
+	struct index_slot *slot;
+	unsigned nslot;
+};
+
+/*
+ * Build the index for src, renumbering each token's cnt to its
+ * position.  Rebuild after adding or removing tokens.
+ */
+void source_index_build(
+	struct source *,
+	struct src_index *
+);
+
+/*
+ * Free the memory held by an index.
+ */
+void source_index_free(
+	struct src_index *
+);
+
+/*
+ * Return how many tokens in the indexed source have the same text
+ * as the given token.
+ */
+unsigned source_index_count(
+	const struct src_index *,
+	const struct token *
+);
+
+/*
+ * A place in the input: byte offset, then line and column counting
+ * from 1.  Columns count bytes.
+ */
+struct text_pos {
+	size_t off;
+	long line;
+	long col;
+};
+
+/*
+ * Offsets of the line starts of a text, for turning pointers into
+ * lines and columns by binary search.  base is where the text starts
+ * in the whole input, which differs for a --stream piece.
+ */
+struct line_index {
+	const char *b;
+	const char *e;
+	size_t *start;
+	long n;
+	struct text_pos base;
+};
+
+/*
+ * Index the lines of [b, e).  base may be NULL for the start of the
+ * input.
+ */
+void line_index_build(
+	struct line_index *,
+	const char *,
+	const char *,
+	const struct text_pos *
+);
+
+/*
+ * Find the position of a pointer into the indexed text.
+ */
+void line_index_pos(
+	const struct line_index *,
+	const char *,
+	struct text_pos *
+);
+
+/*
+ * Advance pos over the text [b, e).
+ */
+void text_pos_advance(
+	struct text_pos *,
+	const char *,
+	const char *
+);
+
+/*
+ * Free the memory held by a line index.
+ */
+void line_index_free(
+	struct line_index *
+);
+
+#endif
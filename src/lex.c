@@ -0,0 +1,315 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "token.h"
+#include "lex.h"
+
+/* Tokens in a source's first block; later blocks double up to the max */
+#define TOK_BLOCK_MIN	64
+#define TOK_BLOCK_MAX	65536
+
+struct tok_block {
+	struct tok_block *next;
+	unsigned n;
+	unsigned cap;
+	struct token tok[];
+};
+
+struct lex_source {
+	struct source src;	/* first, so the source pointer converts */
+	struct tok_block *blocks;
+	unsigned long ntok;
+	size_t nbytes;
+};
+
+#define LC_SPACE	0x01	/* SP HT LF CR */
+#define LC_IDENT1	0x02	/* first character of an ID */
+#define LC_IDENT	0x04	/* later characters of an ID */
+#define LC_DIGIT	0x08
+#define LC_FIXED	0x10	/* single character token */
+
+static const unsigned char lex_class[256] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x01, 0x10, 0x00, 0x00, 0x00, 0x10, 0x10, 0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x14, 0x14, 0x10,
+	0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x00, 0x10, 0x10, 0x10, 0x10, 0x00,
+	0x00, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06,
+	0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x00, 0x00, 0x00, 0x00, 0x04,
+	0x00, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06,
+	0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x10, 0x10, 0x10, 0x10, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+struct source *source_new(const char *b, const char *kind, const char *name) {
+	struct lex_source *ls;
+
+	ls = calloc(1, sizeof(*ls));
+	ls->src.name = strdup(name);
+	ls->src.kind = kind;
+	ls->src.b = b;
+	ls->src.e = b + strlen(b);
+	VTAILQ_INIT(&ls->src.src_tokens);
+	return (&ls->src);
+}
+
+struct token *source_token(struct source *sp, unsigned tok, const char *b, const char *e) {
+	struct lex_source *ls = (struct lex_source *)sp;
+	struct tok_block *blk;
+	struct token *t;
+	unsigned cap;
+
+	blk = ls->blocks;
+	if (blk == NULL || blk->n == blk->cap) {
+		cap = blk == NULL ? TOK_BLOCK_MIN : blk->cap * 2;
+		if (cap > TOK_BLOCK_MAX)
+			cap = TOK_BLOCK_MAX;
+		blk = malloc(sizeof(*blk) + cap * sizeof(*t));
+		blk->next = ls->blocks;
+		blk->n = 0;
+		blk->cap = cap;
+		ls->blocks = blk;
+		ls->nbytes += sizeof(*blk) + cap * sizeof(*t);
+	}
+	t = &blk->tok[blk->n++];
+	t->b = b;
+	t->e = e;
+	t->tok = tok;
+	t->cnt = 0;
+	ls->ntok++;
+	return (t);
+}
+
+void source_adopt(struct source *dst, struct source *from) {
+	struct lex_source *ld = (struct lex_source *)dst;
+	struct lex_source *lf = (struct lex_source *)from;
+	struct tok_block *blk, *next;
+
+	/* Behind the block dst is filling, which stays first */
+	for (blk = lf->blocks; blk != NULL; blk = next) {
+		next = blk->next;
+		if (ld->blocks == NULL) {
+			blk->next = NULL;
+			ld->blocks = blk;
+		}
+		else {
+			blk->next = ld->blocks->next;
+			ld->blocks->next = blk;
+		}
+	}
+	ld->ntok += lf->ntok;
+	ld->nbytes += lf->nbytes;
+	lf->blocks = NULL;
+	lf->ntok = 0;
+	lf->nbytes = 0;
+}
+
+void source_stats(const struct source *sp, unsigned long *ntok, size_t *nbytes) {
+	const struct lex_source *ls = (const struct lex_source *)sp;
+
+	*ntok = ls->ntok;
+	*nbytes = sizeof(*ls) + ls->nbytes;
+}
+
+void source_free(struct source *sp) {
+	struct lex_source *ls = (struct lex_source *)sp;
+	struct tok_block *blk;
+
+	while ((blk = ls->blocks) != NULL) {
+		ls->blocks = blk->next;
+		free(blk);
+	}
+	free(sp->freeit);
+	free(sp->name);
+	free(ls);
+}
+
+static void add_token(struct source *sp, unsigned tok, const char *b, const char *e) {
+	struct token *t;
+
+	t = source_token(sp, tok, b, e);
+	VTAILQ_INSERT_TAIL(&sp->src_tokens, t, src_list);
+}
+
+/*
+ * Two character fixed tokens, or 0.
+ */
+static unsigned lex_pair(const char *p) {
+	switch (p[0]) {
+	case '+':
+		return (p[1] == '+' ? T_INC : p[1] == '=' ? T_INCR : 0);
+	case '-':
+		return (p[1] == '-' ? T_DEC : p[1] == '=' ? T_DECR : 0);
+	case '&':
+		return (p[1] == '&' ? T_CAND : 0);
+	case '|':
+		return (p[1] == '|' ? T_COR : 0);
+	case '<':
+		return (p[1] == '=' ? T_LEQ : p[1] == '<' ? T_SHL : 0);
+	case '>':
+		return (p[1] == '=' ? T_GEQ : p[1] == '>' ? T_SHR : 0);
+	case '=':
+		return (p[1] == '=' ? T_EQ : 0);
+	case '!':
+		return (p[1] == '=' ? T_NEQ : p[1] == '~' ? T_NOMATCH : 0);
+	case '*':
+		return (p[1] == '=' ? T_MUL : 0);
+	case '/':
+		return (p[1] == '=' ? T_DIV : 0);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Find the two character sequence a b in [p, e).  Returns its start,
+ * or NULL.
+ */
+static const char *find_pair(const char *p, const char *e, char a, char b) {
+	const char *q;
+
+	while (p + 1 < e && (q = memchr(p, a, (size_t)(e - p - 1))) != NULL) {
+		if (q[1] == b)
+			return (q);
+		p = q + 1;
+	}
+	return (NULL);
+}
+
+void lex_source(struct source *sp) {
+	const char *p, *q, *e;
+	unsigned u;
+
+	e = sp->e;
+	for (p = sp->b; p < e; ) {
+		if (lex_class[(unsigned char)*p] & LC_SPACE) {
+			p++;
+			continue;
+		}
+
+		/* # and // comments run to the end of the line */
+		if (*p == '#' || (*p == '/' && p + 1 < e && p[1] == '/')) {
+			q = memchr(p, '\n', (size_t)(e - p));
+			p = q != NULL ? q : e;
+			continue;
+		}
+
+		/* C comments may not nest */
+		if (*p == '/' && p + 1 < e && p[1] == '*') {
+			for (q = p + 2; q + 1 < e; q++) {
+				if (q[0] == '/' && q[1] == '*') {
+					add_token(sp, EOI, q, q + 2);
+					add_token(sp, EOI, p, p + 2);
+					return;
+				}
+				if (q[0] == '*' && q[1] == '/')
+					break;
+			}
+			if (q + 1 >= e) {
+				add_token(sp, EOI, p, p + 2);
+				return;
+			}
+			p = q + 2;
+			continue;
+		}
+
+		if (*p == 'C' && p + 1 < e && p[1] == '{') {
+			q = find_pair(p + 2, e, '}', 'C');
+			if (q == NULL) {
+				add_token(sp, EOI, p, p + 2);
+				return;
+			}
+			add_token(sp, CSRC, p, q + 2);
+			p = q + 2;
+			continue;
+		}
+
+		if (*p == '{' && p + 1 < e && p[1] == '"') {
+			q = find_pair(p + 2, e, '"', '}');
+			if (q == NULL) {
+				add_token(sp, EOI, p, p + 2);
+				return;
+			}
+			add_token(sp, CSTR, p, q + 2);
+			p = q + 2;
+			continue;
+		}
+
+		if (*p == '"' && p + 2 < e && p[1] == '"' && p[2] == '"') {
+			for (q = p + 3; q + 2 < e; q++) {
+				if (q[0] == '"' && q[1] == '"' && q[2] == '"')
+					break;
+			}
+			if (q + 2 >= e) {
+				add_token(sp, EOI, p, p + 3);
+				return;
+			}
+			add_token(sp, CSTR, p, q + 3);
+			p = q + 3;
+			continue;
+		}
+
+		if (p + 1 < e && (u = lex_pair(p)) != 0) {
+			add_token(sp, u, p, p + 2);
+			p += 2;
+			continue;
+		}
+		if (lex_class[(unsigned char)*p] & LC_FIXED) {
+			add_token(sp, (unsigned char)*p, p, p + 1);
+			p++;
+			continue;
+		}
+
+		/* A string may not span lines; at end of input it ends there */
+		if (*p == '"') {
+			for (q = p + 1; q < e; q++) {
+				if (*q == '"') {
+					q++;
+					break;
+				}
+				if (*q == '\r' || *q == '\n') {
+					add_token(sp, EOI, p, q);
+					return;
+				}
+			}
+			add_token(sp, CSTR, p, q);
+			p = q;
+			continue;
+		}
+
+		if (lex_class[(unsigned char)*p] & LC_IDENT1) {
+			for (q = p + 1; q < e && (lex_class[(unsigned char)*q] & LC_IDENT); q++)
+				continue;
+			add_token(sp, ID, p, q);
+			p = q;
+			continue;
+		}
+
+		if (lex_class[(unsigned char)*p] & LC_DIGIT) {
+			for (q = p + 1; q < e && (lex_class[(unsigned char)*q] & LC_DIGIT); q++)
+				continue;
+			u = CNUM;
+			if (q < e && *q == '.') {
+				for (q++; q < e && (lex_class[(unsigned char)*q] & LC_DIGIT); q++)
+					continue;
+				u = FNUM;
+			}
+			add_token(sp, u, p, q);
+			p = q;
+			continue;
+		}
+
+		/* Syntax error: stop here, as vcc_Lexer() does */
+		add_token(sp, EOI, p, p + 1);
+		return;
+	}
+	add_token(sp, EOI, e, e);
+}
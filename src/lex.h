@@ -0,0 +1,73 @@
+#ifndef LEX_H
+#define LEX_H
+
+#include <stddef.h>
+
+struct source;
+struct token;
+
+/*
+ * Create a source over NUL-terminated text, as vcc_new_source()
+ * does.  The text stays with the caller unless freeit is set.  Its
+ * tokens are allocated in blocks of many tokens each, owned by the
+ * source, rather than one by one.
+ */
+struct source *source_new(
+	const char *,
+	const char *,
+	const char *
+);
+
+/*
+ * Allocate a token of the given kind and span from a source
+ * made by source_new().  The token is not put on any list.
+ */
+struct token *source_token(
+	struct source *,
+	unsigned,
+	const char *,
+	const char *
+);
+
+/*
+ * Move the token blocks of the second source onto the first, so its
+ * tokens can be spliced into the first source's list and outlive the
+ * second.
+ */
+void source_adopt(
+	struct source *,
+	struct source *
+);
+
+/*
+ * Report the number of tokens a source has allocated and the bytes
+ * held for them.
+ */
+void source_stats(
+	const struct source *,
+	unsigned long *,
+	size_t *
+);
+
+/*
+ * Free a source from source_new() and all of its tokens, including
+ * boundary and comment tokens, and freeit.  The text otherwise stays
+ * with the caller.
+ */
+void source_free(
+	struct source *
+);
+
+/*
+ * Lex a source made by source_new() into its src_tokens list without
+ * a compiler instance.  Token kinds and spans are those vcc_Lexer()
+ * produces, including long strings ({" "} and """ """), C{ }C
+ * blocks, and the EOI tokens it leaves where it stops at an error.
+ * The decoded string and number values vcc_Lexer() keeps for the
+ * compiler are not set.
+ */
+void lex_source(
+	struct source *
+);
+
+#endif
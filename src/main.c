@@ -4,11 +4,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
-#include "vcc_compile.h"
-#include "libvcc.h"
+#include "token.h"
 #include "edit.h"
+#include "format.h"
+#include "lex.h"
+#include "tokfile.h"
+#include "cache.h"
+#include "watch.h"
+#include "grep.h"
+#include "include.h"
+#include "chunk.h"
+#include "stream.h"
+#include "buf.h"
+#include "splice.h"
+#include "patch.h"
+#include "tree.h"
+#include "xref.h"
+#include "fingerprint.h"
 
 #ifndef VINYL_EDIT_VERSION
 #define VINYL_EDIT_VERSION "unknown"
@@ -32,6 +48,22 @@ static int parse_common_flag(
 		mc->look_ahead = argv[++(*i)];
 		return (1);
 	}
+	else if (strcmp(argv[*i], "--within") == 0) {
+		if (*i + 1 >= argc) {
+			fprintf(stderr, "--within requires a value\n");
+			return (-1);
+		}
+		mc->within = argv[++(*i)];
+		return (1);
+	}
+	else if (strcmp(argv[*i], "--select") == 0) {
+		if (*i + 1 >= argc) {
+			fprintf(stderr, "--select requires a value\n");
+			return (-1);
+		}
+		mc->select = argv[++(*i)];
+		return (1);
+	}
 	else if (strcmp(argv[*i], "--limit") == 0) {
 		if (*i + 1 >= argc) {
 			fprintf(stderr, "--limit requires a value\n");
@@ -48,16 +80,65 @@ static int parse_common_flag(
 		mc->offset = atoi(argv[++(*i)]);
 		return (1);
 	}
+	else if (strcmp(argv[*i], "--show-plan") == 0) {
+		mc->show_plan = 1;
+		return (1);
+	}
+	else if (strcmp(argv[*i], "--explain") == 0) {
+		mc->explain = 1;
+		return (1);
+	}
+	else if (strcmp(argv[*i], "--max-steps") == 0) {
+		if (*i + 1 >= argc) {
+			fprintf(stderr, "--max-steps requires a value\n");
+			return (-1);
+		}
+		mc->max_steps = strtoul(argv[++(*i)], NULL, 10);
+		return (1);
+	}
 	return (0);
 }
 
+/*
+ * Parse --emit for insert and replace.  Returns 1 if argv[*i] was it,
+ * 0 if not, -1 on error.
+ */
+static int parse_emit(int argc, char **argv, int *i, int *emit) {
+	if (strcmp(argv[*i], "--emit") != 0)
+		return (0);
+	if (*i + 1 >= argc) {
+		fprintf(stderr, "--emit requires a value\n");
+		return (-1);
+	}
+	if (strcmp(argv[*i + 1], "patch") == 0)
+		*emit = EMIT_PATCH;
+	else if (strcmp(argv[*i + 1], "edits") == 0)
+		*emit = EMIT_EDITS;
+	else {
+		fprintf(stderr, "Unknown --emit: %s\n", argv[*i + 1]);
+		return (-1);
+	}
+	(*i)++;
+	return (1);
+}
+
 static int parse_insert_opts(int argc, char **argv, struct insert_opts *opts) {
 	int r;
 
 	memset(opts, 0, sizeof(*opts));
+	opts->match.max_steps = MATCH_MAX_STEPS;
 
 	for (int i = 0; i < argc; i++) {
 		r = parse_common_flag(argc, argv, &i, &opts->match);
+		if (r < 0)
+			return (-1);
+		if (r > 0)
+			continue;
+		if (strcmp(argv[i], "--preserve-formatting") == 0) {
+			opts->preserve = 1;
+			continue;
+		}
+		r = parse_emit(argc, argv, &i, &opts->emit);
 		if (r < 0)
 			return (-1);
 		if (r > 0)
@@ -90,9 +171,19 @@ static int parse_replace_opts(int argc, char **argv, struct replace_opts *opts)
 	int r;
 
 	memset(opts, 0, sizeof(*opts));
+	opts->match.max_steps = MATCH_MAX_STEPS;
 
 	for (int i = 0; i < argc; i++) {
 		r = parse_common_flag(argc, argv, &i, &opts->match);
+		if (r < 0)
+			return (-1);
+		if (r > 0)
+			continue;
+		if (strcmp(argv[i], "--preserve-formatting") == 0) {
+			opts->preserve = 1;
+			continue;
+		}
+		r = parse_emit(argc, argv, &i, &opts->emit);
 		if (r < 0)
 			return (-1);
 		if (r > 0)
@@ -124,10 +215,39 @@ static int parse_replace_opts(int argc, char **argv, struct replace_opts *opts)
 	return (0);
 }
 
+/*
+ * Parse --json or --ndjson into *json.
+ * Returns 1 if arg is one of them, 0 if not.
+ */
+static int parse_json_flag(const char *arg, int *json) {
+	if (strcmp(arg, "--json") == 0)
+		*json = OUT_JSON;
+	else if (strcmp(arg, "--ndjson") == 0)
+		*json = OUT_NDJSON;
+	else
+		return (0);
+	return (1);
+}
+
+/*
+ * Parse --count or --exists into *query.
+ * Returns 1 if arg is one of them, 0 if not.
+ */
+static int parse_query_flag(const char *arg, int *query) {
+	if (strcmp(arg, "--count") == 0)
+		*query = QUERY_COUNT;
+	else if (strcmp(arg, "--exists") == 0)
+		*query = QUERY_EXISTS;
+	else
+		return (0);
+	return (1);
+}
+
 static int parse_extract_opts(int argc, char **argv, struct extract_opts *opts) {
 	int r;
 
 	memset(opts, 0, sizeof(*opts));
+	opts->match.max_steps = MATCH_MAX_STEPS;
 
 	for (int i = 0; i < argc; i++) {
 		r = parse_common_flag(argc, argv, &i, &opts->match);
@@ -139,6 +259,9 @@ static int parse_extract_opts(int argc, char **argv, struct extract_opts *opts)
 			opts->strip_ws = 1;
 			continue;
 		}
+		if (parse_json_flag(argv[i], &opts->json) ||
+		    parse_query_flag(argv[i], &opts->query))
+			continue;
 		if (argv[i][0] == '-' && argv[i][1] == '-') {
 			fprintf(stderr, "Unknown option: %s\n", argv[i]);
 			return (-1);
@@ -163,6 +286,76 @@ static int parse_extract_opts(int argc, char **argv, struct extract_opts *opts)
 		fprintf(stderr, "--offset requires --limit\n");
 		return (-1);
 	}
+	if (opts->query != QUERY_NONE && opts->json != OUT_TEXT) {
+		fprintf(stderr, "--%s cannot be combined with --json or --ndjson\n",
+		    opts->query == QUERY_COUNT ? "count" : "exists");
+		return (-1);
+	}
+	/* One match answers --exists, so matching and lexing stop there */
+	if (opts->query == QUERY_EXISTS)
+		opts->match.limit = 1;
+	return (0);
+}
+
+static int parse_grep_opts(int argc, char **argv, struct grep_opts *opts) {
+	int r;
+
+	memset(opts, 0, sizeof(*opts));
+	opts->match.max_steps = MATCH_MAX_STEPS;
+	opts->jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	opts->paths = malloc(argc * sizeof(*opts->paths));
+
+	for (int i = 0; i < argc; i++) {
+		r = parse_common_flag(argc, argv, &i, &opts->match);
+		if (r < 0)
+			return (-1);
+		if (r > 0)
+			continue;
+		if (strcmp(argv[i], "--files-with-matches") == 0) {
+			opts->files_only = 1;
+			continue;
+		}
+		if (parse_query_flag(argv[i], &opts->query))
+			continue;
+		if (strcmp(argv[i], "--jobs") == 0) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "--jobs requires a value\n");
+				return (-1);
+			}
+			opts->jobs = atoi(argv[++i]);
+			continue;
+		}
+		if (argv[i][0] == '-' && argv[i][1] == '-') {
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return (-1);
+		}
+		if (opts->from_value == NULL)
+			opts->from_value = argv[i];
+		else
+			opts->paths[opts->npaths++] = argv[i];
+	}
+
+	if (opts->from_value == NULL || opts->npaths == 0) {
+		fprintf(stderr, "grep requires a pattern and at least one path\n");
+		return (-1);
+	}
+	if (opts->match.offset > 0) {
+		fprintf(stderr, "--offset is not supported by grep\n");
+		return (-1);
+	}
+	if (opts->query != QUERY_NONE && opts->files_only) {
+		fprintf(stderr, "--%s cannot be combined with --files-with-matches\n",
+		    opts->query == QUERY_COUNT ? "count" : "exists");
+		return (-1);
+	}
+	if (opts->query == QUERY_EXISTS)
+		opts->match.limit = 1;
+	if (opts->match.show_plan) {
+		fprintf(stderr, "--show-plan is not supported by grep\n");
+		return (-1);
+	}
+	if (opts->jobs < 1)
+		opts->jobs = 1;
 	return (0);
 }
 
@@ -171,7 +364,12 @@ static int is_command(const char *arg) {
 		strcmp(arg, "tokens") == 0 ||
 		strcmp(arg, "insert") == 0 ||
 		strcmp(arg, "replace") == 0 ||
-		strcmp(arg, "extract") == 0);
+		strcmp(arg, "extract") == 0 ||
+		strcmp(arg, "grep") == 0 ||
+		strcmp(arg, "apply-patch") == 0 ||
+		strcmp(arg, "refs") == 0 ||
+		strcmp(arg, "rename") == 0 ||
+		strcmp(arg, "fingerprint") == 0);
 }
 
 static char *read_stdin(long *out_len) {
@@ -206,6 +404,17 @@ static void usage(const char *progname) {
 		"Global Flags:\n"
 		"  --dry-run                    Show a unified diff instead of writing output\n"
 		"  --no-color                   Disable colored diff output\n"
+		"  --input-format <fmt>         Read input as text (default) or tokens\n"
+		"  --output-format <fmt>        Write output as text (default) or tokens\n"
+		"  --cache-dir <dir>            Reuse stored output for identical runs\n"
+		"  --cache-size <bytes>         Cache size bound, LRU evicted (default: 64 MiB)\n"
+		"  --output <file>              Write output to file, replaced atomically\n"
+		"  --watch                      Run again whenever the input file changes\n"
+		"  --follow-includes            Also edit the files reached by include statements\n"
+		"  -I <dir>                     Search dir for included files (repeatable)\n"
+		"  --jobs <n>                   Threads for large inputs (default: online CPUs)\n"
+		"  --stream                     Process stdin one top-level declaration at a time\n"
+		"  --stats                      Print token counts and peak memory to stderr\n"
 		"\n"
 		"Commands:\n"
 		"  format  <file> [flags]                        Pretty-print VCL source\n"
@@ -213,32 +422,79 @@ static void usage(const char *progname) {
 		"  insert  <file> <text> [flags]                 Insert text at a matched position\n"
 		"  replace <file> <from> <to> [flags]            Replace matched tokens\n"
 		"  extract <file> <pattern> [template] [flags]   Extract matching regions\n"
+		"  grep    <pattern> <path>... [flags]           List matches across files and directories\n"
+		"  apply-patch <file> <patch> [flags]            Apply a patch made with --emit\n"
+		"  refs    <file> <name> [flags]                 List the definition and uses of a name\n"
+		"  rename  <file> <old> <new> [flags]            Rename a backend, sub, acl or probe\n"
+		"  fingerprint <file> [flags]                    Print a hash of each declaration as NDJSON\n"
 		"\n"
 		"Tokens Flags:\n"
 		"  --processed                  Include SOI/EOI markers and inter-token gaps\n"
+		"  --json, --ndjson             Print tokens as a JSON array or one JSON object per line\n"
+		"\n"
+		"Fingerprint Flags:\n"
+		"  --ignore-comments            Leave comments out of the fingerprints\n"
 		"\n"
 		"Insert Flags:\n"
 		"  --look-behind <pattern>      Require these tokens before the insertion point\n"
 		"  --look-ahead  <pattern>      Require these tokens after the insertion point\n"
+		"  --within <pattern>           Only insert inside the body of matching blocks\n"
+		"  --select <selector>          Only insert inside the blocks a selector picks\n"
 		"  --limit <n>                  Max insertions (default: unlimited)\n"
 		"  --offset <n>                 Skip first n matches (requires --limit)\n"
+		"  --max-steps <n>              Abort with exit 3 after n match steps (0: unlimited)\n"
+		"  --show-plan                  Print where each pattern will be tried to stderr\n"
+		"  --explain                    Print the compiled patterns and plans, then exit\n"
+		"  --preserve-formatting        Splice the text into the input instead of reformatting it\n"
+		"  --emit <patch|edits>         Print the edits as a unified diff or a JSON edit list\n"
 		"\n"
 		"Replace Flags:\n"
 		"  --look-behind <pattern>      Require these tokens before the match\n"
 		"  --look-ahead  <pattern>      Require these tokens after the match\n"
+		"  --within <pattern>           Only match inside the body of matching blocks\n"
+		"  --select <selector>          Only match inside the blocks a selector picks\n"
 		"  --limit <n>                  Max replacements (default: unlimited)\n"
 		"  --offset <n>                 Skip first n matches (requires --limit)\n"
+		"  --max-steps <n>              Abort with exit 3 after n match steps (0: unlimited)\n"
+		"  --show-plan                  Print where each pattern will be tried to stderr\n"
+		"  --explain                    Print the compiled patterns and plans, then exit\n"
+		"  --preserve-formatting        Splice the replacements into the input instead of reformatting it\n"
+		"  --emit <patch|edits>         Print the edits as a unified diff or a JSON edit list\n"
 		"\n"
 		"Extract Flags:\n"
 		"  --look-behind <pattern>      Require these tokens before the match\n"
 		"  --look-ahead  <pattern>      Require these tokens after the match\n"
+		"  --within <pattern>           Only match inside the body of matching blocks\n"
+		"  --select <selector>          Only match inside the blocks a selector picks\n"
 		"  --limit <n>                  Max extractions (default: unlimited)\n"
 		"  --offset <n>                 Skip first n matches (requires --limit)\n"
+		"  --max-steps <n>              Abort with exit 3 after n match steps (0: unlimited)\n"
+		"  --show-plan                  Print where each pattern will be tried to stderr\n"
+		"  --explain                    Print the compiled patterns and plans, then exit\n"
 		"  --strip-whitespace           Dedent and trim extracted output\n"
+		"  --json, --ndjson             Print matches with spans and captures as JSON\n"
+		"  --count                      Print only the number of matches\n"
+		"  --exists                     Print nothing; exit 0 at the first match, 1 if none\n"
+		"\n"
+		"Grep Flags:\n"
+		"  --look-behind <pattern>      Require these tokens before the match\n"
+		"  --look-ahead  <pattern>      Require these tokens after the match\n"
+		"  --within <pattern>           Only match inside the body of matching blocks\n"
+		"  --select <selector>          Only match inside the blocks a selector picks\n"
+		"  --limit <n>                  Max matches per file (default: unlimited)\n"
+		"  --max-steps <n>              Abort a file with exit 3 after n match steps (0: unlimited)\n"
+		"  --explain                    Print the compiled patterns, then exit\n"
+		"  --files-with-matches         Print only the names of matching files\n"
+		"  --count                      Print only the total number of matches\n"
+		"  --exists                     Print nothing; exit 0 at the first match, 1 if none\n"
+		"  --jobs <n>                   Worker threads (default: online CPUs)\n"
 		"\n"
 		"Wildcards:\n"
 		"  **                           Match any single token\n"
+		"  **:KIND                      Match a single token of a lexer kind (ID, CSTR, CNUM, ...)\n"
 		"  ***                          Match zero or more tokens (non-greedy)\n"
+		"  ***{min,max}                 Match between min and max tokens (either may be omitted)\n"
+		"  **~/regex/  ***~/regex/      Also require the captured text to match a PCRE2 regex\n"
 		"  **1..**9                     Back-reference a captured wildcard\n"
 		"\n"
 		"Boundary tokens:\n"
@@ -277,10 +533,20 @@ static void usage(const char *progname) {
 		"  %s extract default.vcl 'sub ** {***}'\n"
 		"\n"
 		"  # Extract the second backend block, skipping the first\n"
-		"  %s extract default.vcl 'backend ** {***}' --limit 1 --offset 1\n",
+		"  %s extract default.vcl 'backend ** {***}' --limit 1 --offset 1\n"
+		"\n"
+		"  # Append a statement to the body of vcl_recv\n"
+		"  %s insert default.vcl 'call normalize;' --within 'sub vcl_recv'\n"
+		"\n"
+		"  # Find every VCL under a directory that still points at an old origin\n"
+		"  %s grep '.host = \"old-origin\";' /etc/vinyl --files-with-matches\n"
+		"\n"
+		"  # Keep a formatted copy up to date while editing\n"
+		"  %s format default.vcl --watch --output formatted.vcl\n",
 		progname, VINYL_EDIT_VERSION, progname,
 		progname, progname, progname, progname, progname, progname,
-		progname, progname, progname, progname, progname
+		progname, progname, progname, progname, progname, progname,
+		progname, progname
 	);
 }
 
@@ -293,8 +559,8 @@ struct dry_run_state {
 static int setup_dry_run(struct dry_run_state *dr, const char *buf, long len) {
 	int orig_fd, out_fd;
 
-	strlcpy(dr->orig_tmp, "/tmp/vinyl-edit-orig.XXXXXX", sizeof(dr->orig_tmp));
-	strlcpy(dr->out_tmp, "/tmp/vinyl-edit-out.XXXXXX", sizeof(dr->out_tmp));
+	snprintf(dr->orig_tmp, sizeof(dr->orig_tmp), "/tmp/vinyl-edit-orig.XXXXXX");
+	snprintf(dr->out_tmp, sizeof(dr->out_tmp), "/tmp/vinyl-edit-out.XXXXXX");
 
 	orig_fd = mkstemp(dr->orig_tmp);
 	if (orig_fd < 0) {
@@ -347,108 +613,1254 @@ static int finish_dry_run(struct dry_run_state *dr, const char *input_name, int
 	return (diff_status >= 2 ? 1 : 0);
 }
 
-static int cmd_insert(struct vcc *vcc, struct source *src, int argc, char **argv) {
-	struct insert_opts iopts;
-	struct source *ins_src;
-	struct vcc *pat_vcc;
-	char *mb_pp = NULL, *ma_pp = NULL;
+static void cancel_dry_run(struct dry_run_state *dr) {
+	fflush(stdout);
+	dup2(dr->saved_stdout, STDOUT_FILENO);
+	close(dr->saved_stdout);
+	unlink(dr->orig_tmp);
+	unlink(dr->out_tmp);
+}
 
-	(void)vcc;
-	if (parse_insert_opts(argc, argv, &iopts) != 0)
+static int compile_match(struct match_constraint *mc) {
+	if (compile_pattern(mc->look_behind, 0, &mc->look_behind_pat) != 0)
+		return (-1);
+	if (compile_pattern(mc->look_ahead, 0, &mc->look_ahead_pat) != 0)
+		return (-1);
+	if (compile_pattern(mc->within, 0, &mc->within_pat) != 0)
+		return (-1);
+	if (mc->select != NULL && mc->within != NULL) {
+		fprintf(stderr, "--select cannot be combined with --within\n");
+		return (-1);
+	}
+	if (selector_compile(mc->select, &mc->select_sel) != 0)
 		return (-1);
-	pat_vcc = VCC_New();
-	ins_src = vcc_new_source(iopts.text, "insert", "insert");
-	vcc_Lexer(pat_vcc, ins_src);
-	iopts.src = ins_src;
-	lex_pattern(pat_vcc, iopts.match.look_behind, &iopts.match.look_behind_src, &mb_pp);
-	lex_pattern(pat_vcc, iopts.match.look_ahead, &iopts.match.look_ahead_src, &ma_pp);
-	emit_formatted(src, &iopts, NULL);
-	free(mb_pp);
-	free(ma_pp);
 	return (0);
 }
 
-static int cmd_replace(struct vcc *vcc, struct source *src, int argc, char **argv) {
-	struct replace_opts ropts;
-	struct vcc *pat_vcc;
-	char *from_pp = NULL, *to_pp = NULL;
-	char *mb_pp = NULL, *ma_pp = NULL;
+static void free_match(struct match_constraint *mc) {
+	free_pattern(mc->look_behind_pat);
+	free_pattern(mc->look_ahead_pat);
+	free_pattern(mc->within_pat);
+	selector_free(mc->select_sel);
+}
 
-	(void)vcc;
-	if (parse_replace_opts(argc, argv, &ropts) != 0)
-		return (-1);
-	pat_vcc = VCC_New();
-	lex_pattern(pat_vcc, ropts.match.look_behind, &ropts.match.look_behind_src, &mb_pp);
-	lex_pattern(pat_vcc, ropts.match.look_ahead, &ropts.match.look_ahead_src, &ma_pp);
-	lex_pattern(pat_vcc, ropts.from_value, &ropts.from_src, &from_pp);
-	if (ropts.to_text != NULL && text_needs_raw(ropts.to_text)) {
-		ropts.to_raw = 1;
+static void explain_match(const struct match_constraint *mc, const struct pattern *from) {
+	explain_pattern("from", from, 1);
+	explain_pattern("look-behind", mc->look_behind_pat, 0);
+	explain_pattern("look-ahead", mc->look_ahead_pat, 0);
+	explain_pattern("within", mc->within_pat, 0);
+	selector_explain(mc->select_sel);
+	if (mc->limit > 0)
+		printf("limit: %d, offset: %d\n", mc->limit, mc->offset);
+	if (mc->max_steps > 0)
+		printf("max steps: %lu\n", mc->max_steps);
+	else
+		printf("max steps: unlimited\n");
+}
+
+static int match_budget_error(const struct match_constraint *mc) {
+	fprintf(stderr, "match step budget exceeded (--max-steps %lu) for pattern: %s\n",
+	    mc->max_steps, match_budget_exceeded());
+	return (EXIT_MATCH_BUDGET);
+}
+
+/*
+ * The grep command takes a pattern and paths rather than one input,
+ * so it bypasses the global flags and the single-input pipeline.
+ */
+static int cmd_grep_main(int argc, char **argv) {
+	struct grep_opts gopts;
+	int r;
+
+	if (parse_grep_opts(argc, argv, &gopts) != 0) {
+		free(gopts.paths);
+		return (1);
 	}
-	else {
-		lex_pattern(pat_vcc, ropts.to_text, &ropts.to_src, &to_pp);
+	if (compile_match(&gopts.match) != 0 ||
+	    compile_pattern(gopts.from_value, 1, &gopts.from_pat) != 0)
+		r = 1;
+	else if (gopts.match.explain) {
+		explain_match(&gopts.match, gopts.from_pat);
+		r = 0;
 	}
-	if (ropts.to_raw) {
-		emit_formatted(src, NULL, &ropts);
+	else
+		r = grep_run(&gopts);
+	free_pattern(gopts.from_pat);
+	free_match(&gopts.match);
+	free(gopts.paths);
+	return (r);
+}
+
+struct command {
+	const char *name;
+	int ready;
+	int processed;
+	int json;
+	int ignore_comments;
+	struct insert_opts ins;
+	struct replace_opts rep;
+	struct extract_opts ext;
+	char *to_pp;
+	const char *patch_path;
+	char *patch;
+	long patch_len;
+	const char *sym_old;
+	const char *sym_new;
+};
+
+/*
+ * Lex replacement or template text, or mark it raw if the lexer
+ * can't tokenize it.
+ */
+static void prepare_to(struct command *c, const char *text, struct source **src, int *raw) {
+	if (text_needs_raw(text))
+		*raw = 1;
+	else
+		lex_pattern(text, src, &c->to_pp);
+}
+
+/*
+ * Parse a command's options and compile its patterns.  Done once per
+ * process, so --watch reuses them for every run.
+ * Returns 0 on success, -1 on error.
+ */
+static int command_prepare(struct command *c, const char *name, int argc, char **argv) {
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	c->name = name;
+	if (strcmp(name, "format") == 0) {
+		if (argc > 0) {
+			fprintf(stderr, "Unknown option: %s\n", argv[0]);
+			return (-1);
+		}
+	}
+	else if (strcmp(name, "tokens") == 0) {
+		for (i = 0; i < argc; i++) {
+			if (strcmp(argv[i], "--processed") == 0)
+				c->processed = 1;
+			else if (!parse_json_flag(argv[i], &c->json)) {
+				fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return (-1);
+			}
+		}
+	}
+	else if (strcmp(name, "fingerprint") == 0) {
+		for (i = 0; i < argc; i++) {
+			if (strcmp(argv[i], "--ignore-comments") == 0)
+				c->ignore_comments = 1;
+			else {
+				fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return (-1);
+			}
+		}
+	}
+	else if (strcmp(name, "insert") == 0) {
+		if (parse_insert_opts(argc, argv, &c->ins) != 0)
+			return (-1);
+		c->ins.src = source_new(c->ins.text, "insert", "insert");
+		lex_source(c->ins.src);
+		if (compile_match(&c->ins.match) != 0)
+			return (-1);
+	}
+	else if (strcmp(name, "replace") == 0) {
+		if (parse_replace_opts(argc, argv, &c->rep) != 0)
+			return (-1);
+		if (compile_match(&c->rep.match) != 0 ||
+		    compile_pattern(c->rep.from_value, 0, &c->rep.from_pat) != 0)
+			return (-1);
+		prepare_to(c, c->rep.to_text, &c->rep.to_src, &c->rep.to_raw);
+	}
+	else if (strcmp(name, "extract") == 0) {
+		if (parse_extract_opts(argc, argv, &c->ext) != 0)
+			return (-1);
+		if (compile_match(&c->ext.match) != 0 ||
+		    compile_pattern(c->ext.from_value, 1, &c->ext.from_pat) != 0)
+			return (-1);
+		if (c->ext.to_text != NULL)
+			prepare_to(c, c->ext.to_text, &c->ext.to_src, &c->ext.to_raw);
+	}
+	else if (strcmp(name, "apply-patch") == 0) {
+		for (i = 0; i < argc; i++) {
+			if (c->patch_path == NULL && (argv[i][0] != '-' || argv[i][1] == '\0'))
+				c->patch_path = argv[i];
+			else {
+				fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return (-1);
+			}
+		}
+		if (c->patch_path == NULL) {
+			fprintf(stderr, "apply-patch requires a patch file\n");
+			return (-1);
+		}
+	}
+	else if (strcmp(name, "refs") == 0 || strcmp(name, "rename") == 0) {
+		for (i = 0; i < argc; i++) {
+			if (argv[i][0] != '-' && c->sym_old == NULL)
+				c->sym_old = argv[i];
+			else if (argv[i][0] != '-' && c->sym_new == NULL &&
+			    strcmp(name, "rename") == 0)
+				c->sym_new = argv[i];
+			else {
+				fprintf(stderr, "Unknown option: %s\n", argv[i]);
+				return (-1);
+			}
+		}
+		if (c->sym_old == NULL ||
+		    (strcmp(name, "rename") == 0 && c->sym_new == NULL)) {
+			fprintf(stderr, "%s requires %s\n", name,
+			    c->sym_new == NULL && strcmp(name, "rename") == 0 ?
+			    "an old and a new name" : "a name");
+			return (-1);
+		}
 	}
 	else {
-		char *raw;
-		struct source *raw_src;
-		raw = emit_transform_replace(src, &ropts);
-		raw_src = vcc_new_source(raw, "transformed", "transformed");
-		vcc_Lexer(pat_vcc, raw_src);
-		emit_formatted(raw_src, NULL, NULL);
-		free(raw);
-	}
-	free(from_pp);
-	free(to_pp);
-	free(mb_pp);
-	free(ma_pp);
+		fprintf(stderr, "Unknown command: %s\n", name);
+		return (-1);
+	}
+	c->ready = 1;
 	return (0);
 }
 
-static int cmd_extract_main(struct vcc *vcc, struct source *src, int argc, char **argv) {
-	struct extract_opts eopts;
-	struct vcc *pat_vcc;
-	char *from_pp = NULL, *to_pp = NULL;
-	char *mb_pp = NULL, *ma_pp = NULL;
+static void command_free(struct command *c) {
+	free_match(&c->ins.match);
+	free_match(&c->rep.match);
+	free_match(&c->ext.match);
+	free_pattern(c->rep.from_pat);
+	free_pattern(c->ext.from_pat);
+	if (c->ins.src != NULL)
+		source_free(c->ins.src);
+	if (c->rep.to_src != NULL)
+		source_free(c->rep.to_src);
+	if (c->ext.to_src != NULL)
+		source_free(c->ext.to_src);
+	free(c->to_pp);
+	free(c->patch);
+	memset(c, 0, sizeof(*c));
+}
 
-	(void)vcc;
-	if (parse_extract_opts(argc, argv, &eopts) != 0)
-		return (-1);
-	pat_vcc = VCC_New();
-	lex_pattern(pat_vcc, eopts.match.look_behind, &eopts.match.look_behind_src, &mb_pp);
-	lex_pattern(pat_vcc, eopts.match.look_ahead, &eopts.match.look_ahead_src, &ma_pp);
-	lex_pattern(pat_vcc, eopts.from_value, &eopts.from_src, &from_pp);
-	if (eopts.from_src != NULL && !source_has_tokens(eopts.from_src))
-		make_comment_source(eopts.from_src);
-	if (eopts.to_text != NULL) {
-		if (text_needs_raw(eopts.to_text)) {
-			eopts.to_raw = 1;
+static int cmd_insert(struct insert_opts *iopts, struct source *src, struct tok_sink *sink) {
+	int r;
+
+	plan_match(src, &iopts->match, NULL);
+	match_budget_reset(iopts->match.max_steps);
+	if (iopts->match.explain) {
+		printf("insert: '%s'\n", iopts->text);
+		if (iopts->match.look_behind_pat != NULL || iopts->match.look_ahead_pat != NULL)
+			printf("  at: each position passing the look-behind/look-ahead\n");
+		else if (match_scoped(&iopts->match))
+			printf("  at: end of each %s body\n",
+			    iopts->match.select_sel != NULL ? "--select" : "--within");
+		else
+			printf("  at: end of input\n");
+		explain_match(&iopts->match, NULL);
+	}
+	else if (iopts->preserve || iopts->emit != EMIT_TEXT) {
+		if ((r = emit_spliced(src, iopts, NULL, sink)) != 0)
+			return (r < 0 ? match_budget_error(&iopts->match) : 1);
+	}
+	else if (emit_formatted(src, iopts, NULL, sink) != 0)
+		return (match_budget_error(&iopts->match));
+	return (0);
+}
+
+static int cmd_replace(struct command *c, struct source *src, struct tok_sink *sink) {
+	struct replace_opts *ropts = &c->rep;
+	int r;
+
+	plan_match(src, &ropts->match, ropts->from_pat);
+	match_budget_reset(ropts->match.max_steps);
+	if (ropts->match.explain) {
+		explain_match(&ropts->match, ropts->from_pat);
+		printf("to: '%s'%s\n", ropts->to_text, ropts->to_raw ? " (raw)" : "");
+	}
+	else if (ropts->preserve || ropts->emit != EMIT_TEXT) {
+		if ((r = emit_spliced(src, NULL, ropts, sink)) != 0)
+			return (r < 0 ? match_budget_error(&ropts->match) : 1);
+	}
+	else if (apply_replace(src, ropts, sink) != 0)
+		return (match_budget_error(&ropts->match));
+	return (0);
+}
+
+/*
+ * Print the NDJSON records of extract as one JSON array (--json).
+ */
+static void print_json_array(const struct buf *b) {
+	const char *p, *nl, *e;
+
+	e = b->data + b->len;
+	putchar('[');
+	for (p = b->data; p < e; p = nl + 1) {
+		nl = memchr(p, '\n', (size_t)(e - p));
+		if (p != b->data)
+			fputs(",\n", stdout);
+		fwrite(p, 1, (size_t)(nl - p), stdout);
+	}
+	fputs("]\n", stdout);
+}
+
+/*
+ * The number of matches extract shows of the matched ones it counted,
+ * which include those skipped by --offset.
+ */
+static long matches_shown(const struct extract_opts *eopts, long matched) {
+	return (matched > eopts->match.offset ? matched - eopts->match.offset : 0);
+}
+
+/*
+ * Report shown matches for --count (printed; status 0) or --exists
+ * (status 0 if any, else 1).
+ */
+static int query_result(const struct extract_opts *eopts, long shown) {
+	if (eopts->query == QUERY_COUNT)
+		printf("%ld\n", shown);
+	return (eopts->query == QUERY_EXISTS && shown == 0 ? 1 : 0);
+}
+
+/*
+ * Run extract on src.  Output is appended to the buffer if one is
+ * given, otherwise printed, as one array for --json.  With --count
+ * or --exists, the matches shown are added to *shown if it is given,
+ * otherwise reported by query_result().
+ * Returns 0 on success, or an exit status.
+ */
+static int cmd_extract_main(struct extract_opts *eopts, struct source *src, struct buf *out, long *shown) {
+	struct buf recs;
+	int r;
+
+	add_comment_tokens(src);
+	plan_match(src, &eopts->match, eopts->from_pat);
+	match_budget_reset(eopts->match.max_steps);
+	if (eopts->match.explain) {
+		explain_match(&eopts->match, eopts->from_pat);
+		if (eopts->to_text != NULL)
+			printf("template: '%s'%s\n", eopts->to_text, eopts->to_raw ? " (raw)" : "");
+	}
+	else if (eopts->query != QUERY_NONE) {
+		r = cmd_extract(src, eopts, NULL);
+		if (r < 0)
+			return (match_budget_error(&eopts->match));
+		if (shown == NULL)
+			return (query_result(eopts, matches_shown(eopts, r)));
+		*shown += matches_shown(eopts, r);
+	}
+	else if (eopts->json == OUT_JSON && out == NULL) {
+		buf_init(&recs);
+		r = cmd_extract(src, eopts, &recs);
+		if (r >= 0)
+			print_json_array(&recs);
+		free(recs.data);
+		if (r < 0)
+			return (match_budget_error(&eopts->match));
+	}
+	else if (cmd_extract(src, eopts, out) < 0)
+		return (match_budget_error(&eopts->match));
+	return (0);
+}
+
+/* --stats: what the run lexed */
+struct run_stats {
+	long lexed;
+	unsigned long ntok;
+	size_t token_bytes;
+};
+
+struct run_opts {
+	const char *progname;
+	const char *cmd;
+	const char *path;
+	const char *input_name;
+	const char *output;
+	const char *cache_dir;
+	unsigned long cache_size;
+	int opt_argc;
+	char **opt_argv;
+	char **search;
+	int nsearch;
+	int follow_includes;
+	int dry_run;
+	int no_color;
+	int tokens_in;
+	int tokens_out;
+	int jobs;
+	struct run_stats *stats;
+};
+
+/*
+ * Add a source to the --stats totals.  token_bytes is the largest
+ * token store of a single source.
+ */
+static void note_source(const struct run_opts *ro, const struct source *src) {
+	unsigned long ntok;
+	size_t nbytes;
+
+	if (ro->stats == NULL)
+		return;
+	source_stats(src, &ntok, &nbytes);
+	ro->stats->lexed += (long)(src->e - src->b);
+	ro->stats->ntok += ntok;
+	if (nbytes > ro->stats->token_bytes)
+		ro->stats->token_bytes = nbytes;
+}
+
+static void print_stats(const struct run_stats *st) {
+	struct rusage ru;
+	long peak;
+
+	getrusage(RUSAGE_SELF, &ru);
+	peak = ru.ru_maxrss;
+#ifdef __APPLE__
+	peak /= 1024;
+#endif
+	fprintf(stderr, "lexed: %ld bytes, %lu tokens\n", st->lexed, st->ntok);
+	fprintf(stderr, "token memory: %zu KiB\n", (st->token_bytes + 1023) / 1024);
+	fprintf(stderr, "peak memory: %ld KiB\n", peak);
+}
+
+/*
+ * refs and rename on files, with their sources already lexed: one
+ * input, or the files of an include graph.  All of them are indexed
+ * and a rename is checked against all of them before any is written.
+ * With sinks, file i is renamed into sinks[i], otherwise to stdout.
+ * Returns 0 on success, or an exit status.
+ */
+static int cmd_symbols(struct command *c, const struct inc_file *files, int n, struct tok_sink *sinks) {
+	struct xref *x;
+	struct buf out;
+	int i, k, ndef, nocc, nused, kind, r;
+
+	x = calloc(n, sizeof(*x));
+	ndef = nocc = nused = 0;
+	kind = SYM_NONE;
+	for (i = 0; i < n; i++) {
+		if (files[i].dup >= 0)
+			continue;
+		xref_build(&x[i], files[i].src);
+		xref_count(&x[i], c->sym_old, &ndef, &nocc, &kind);
+		if (c->sym_new != NULL)
+			xref_count(&x[i], c->sym_new, &k, &nused, &k);
+	}
+
+	r = 0;
+	if (strcmp(c->name, "refs") == 0) {
+		buf_init(&out);
+		for (i = 0; i < n; i++) {
+			xref_print(&x[files[i].dup >= 0 ? files[i].dup : i], files[i].src,
+			    files[i].path, c->sym_old, kind, &out);
 		}
-		else {
-			lex_pattern(pat_vcc, eopts.to_text, &eopts.to_src, &to_pp);
+		fwrite(out.data, 1, out.len, stdout);
+		free(out.data);
+		r = nocc > 0 ? 0 : 1;
+	}
+	else if (xref_check_rename(c->sym_old, ndef, c->sym_new, nused) != 0)
+		r = 1;
+	else {
+		for (i = 0; i < n; i++) {
+			xref_rename(&x[files[i].dup >= 0 ? files[i].dup : i], files[i].src,
+			    c->sym_old, c->sym_new, sinks != NULL ? &sinks[i] : NULL);
 		}
 	}
-	add_comment_tokens(src);
-	cmd_extract(src, &eopts);
-	free(from_pp);
-	free(to_pp);
-	free(mb_pp);
-	free(ma_pp);
+	for (i = 0; i < n; i++)
+		xref_free(&x[i]);
+	free(x);
+	return (r);
+}
+
+/*
+ * Run the prepared command on a lexed source.  Output goes to the
+ * sink if one is given, otherwise to stdout.  format of a large
+ * source runs on jobs threads.
+ * Returns 0 on success, or an exit status.
+ */
+static int dispatch(struct command *c, struct source *src, struct tok_sink *sink, int jobs) {
+	struct inc_file f;
+	struct buf out;
+
+	if (strcmp(c->name, "format") == 0) {
+		if (chunk_format(src, jobs, sink) != 0)
+			emit_formatted(src, NULL, NULL, sink);
+	}
+	else if (strcmp(c->name, "tokens") == 0)
+		cmd_tokens(src, c->processed, c->json);
+	else if (strcmp(c->name, "insert") == 0)
+		return (cmd_insert(&c->ins, src, sink));
+	else if (strcmp(c->name, "replace") == 0)
+		return (cmd_replace(c, src, sink));
+	else if (strcmp(c->name, "extract") == 0)
+		return (cmd_extract_main(&c->ext, src, NULL, NULL));
+	else if (strcmp(c->name, "fingerprint") == 0) {
+		buf_init(&out);
+		fingerprint_source(src, src->name, !c->ignore_comments, &out);
+		fwrite(out.data, 1, out.len, stdout);
+		free(out.data);
+	}
+	else if (strcmp(c->name, "refs") == 0 || strcmp(c->name, "rename") == 0) {
+		memset(&f, 0, sizeof(f));
+		f.path = src->name;
+		f.src = src;
+		f.dup = -1;
+		return (cmd_symbols(c, &f, 1, sink));
+	}
 	return (0);
 }
 
-int main(int argc, char *argv[]) {
-	struct vcc *vcc;
+/*
+ * extract with --limit: match on a growing prefix of the input, cut
+ * after a top-level declaration, so the first matches in a large
+ * file don't wait for all of it to be lexed.  A prefix's result is
+ * kept if no match attempt looked at its end and either the limit
+ * was reached or a --look-behind anchored on SOI rules out the rest.
+ * Returns the exit status, or -1 to run on the whole input.
+ */
+static int run_extract_prefix(
+    const struct run_opts *ro, struct extract_opts *eopts, const char *buf, long len) {
 	struct source *src;
+	struct buf out;
+	size_t want, cut;
+	int matched, done, r;
+
+	/* Past half the input, one more prefix costs more than it saves */
+	for (want = CHUNK_PREFIX_BYTES; want <= (size_t)len / 2; want *= 4) {
+		src = chunk_lex_prefix(buf, (size_t)len, want, ro->input_name, &cut);
+		if (src == NULL)
+			break;
+		add_boundary_tokens(src);
+		if (check_unknown_gaps(src) != 0) {
+			source_free(src);
+			return (1);
+		}
+		add_comment_tokens(src);
+		plan_match(src, &eopts->match, eopts->from_pat);
+		plan_open_end(eopts->from_pat);
+		plan_open_end(eopts->match.within_pat);
+		match_budget_reset(eopts->match.max_steps);
+		match_end_reset();
+		buf_init(&out);
+		r = 0;
+		matched = cmd_extract(src, eopts, &out);
+		note_source(ro, src);
+		done = matched >= 0 && !match_end_reached() &&
+		    (matched >= eopts->match.offset + eopts->match.limit ||
+		    plan_exhausted(eopts->match.look_behind_pat, buf + cut, (size_t)len - cut));
+		if (done && eopts->query != QUERY_NONE)
+			r = query_result(eopts, matches_shown(eopts, matched));
+		else if (done && eopts->json == OUT_JSON)
+			print_json_array(&out);
+		else if (done)
+			fwrite(out.data, 1, out.len, stdout);
+		free(out.data);
+		source_free(src);
+		if (done)
+			return (r);
+	}
+	return (-1);
+}
+
+/*
+ * Lex the input, run the prepared command and write its output.
+ * Returns the process exit status.
+ */
+static int run_command(const struct run_opts *ro, struct command *c, char *buf, long len) {
+	struct source *src;
+	struct tok_sink sink;
+	struct dry_run_state dr;
+	int r;
+
+	if ((c->ins.emit != EMIT_TEXT || c->rep.emit != EMIT_TEXT) &&
+	    (ro->dry_run || ro->tokens_out)) {
+		fprintf(stderr, "--emit cannot be combined with %s\n",
+		    ro->dry_run ? "--dry-run" : "--output-format tokens");
+		return (1);
+	}
+
+	if (ro->tokens_in) {
+		/* Pre-lexed by an earlier stage: no lexing or gap check */
+		src = tokfile_read(buf, len, ro->input_name);
+		if (src == NULL)
+			return (1);
+		add_boundary_tokens(src);
+	}
+	else {
+		if (strcmp(c->name, "extract") == 0 && c->ext.match.limit > 0 &&
+		    !c->ext.match.explain && !c->ext.match.show_plan &&
+		    !ro->dry_run && !ro->tokens_out) {
+			r = run_extract_prefix(ro, &c->ext, buf, len);
+			if (r >= 0)
+				return (r);
+		}
+
+		/* Large inputs are lexed in chunks on several threads */
+		src = NULL;
+		if (strcmp(c->name, "tokens") != 0)
+			src = chunk_lex(buf, (size_t)len, ro->input_name, ro->jobs);
+		if (src == NULL) {
+			src = source_new(buf, "file", ro->input_name);
+			lex_source(src);
+		}
+		add_boundary_tokens(src);
+
+		/* Check for unparseable content (skip for tokens -- it's diagnostic) */
+		if (strcmp(c->name, "tokens") != 0 && check_unknown_gaps(src) != 0) {
+			source_free(src);
+			return (1);
+		}
+	}
+
+	/* Phase 4: --dry-run capture setup */
+	if (ro->dry_run) {
+		if (setup_dry_run(&dr, src->b, (long)(src->e - src->b)) != 0) {
+			source_free(src);
+			return (1);
+		}
+	}
+
+	if (ro->tokens_out)
+		tok_sink_init(&sink);
+
+	/* Command dispatch */
+	r = dispatch(c, src, ro->tokens_out ? &sink : NULL, ro->jobs);
+	note_source(ro, src);
+
+	/* Render the token stream for the next stage */
+	if (ro->tokens_out) {
+		if (r == 0 && tokfile_write(stdout, &sink) != 0)
+			r = 1;
+		tok_sink_free(&sink);
+	}
+
+	/* Phase 5: --dry-run diff */
+	if (ro->dry_run) {
+		if (r == 0)
+			r = finish_dry_run(&dr, ro->input_name, ro->no_color);
+		else
+			cancel_dry_run(&dr);
+	}
+
+	source_free(src);
+	return (r);
+}
+
+static char *read_file(const char *path, long *out_len) {
 	FILE *f;
 	long len;
 	char *buf;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return (NULL);
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(len + 1);
+	if (buf == NULL) {
+		perror("malloc");
+		fclose(f);
+		return (NULL);
+	}
+	if (fread(buf, 1, len, f) != (size_t)len) {
+		perror("fread");
+		free(buf);
+		fclose(f);
+		return (NULL);
+	}
+	buf[len] = '\0';
+	fclose(f);
+	*out_len = len;
+	return (buf);
+}
+
+struct output_state {
+	const char *path;
+	char tmp[1024];
+	int saved_stdout;
+};
+
+/*
+ * Redirect stdout to a temporary file next to the output path, so
+ * readers of the output never see a partial result.  An existing
+ * file's mode is kept.
+ * Returns 0 on success, -1 on error.
+ */
+static int output_begin(struct output_state *o, const char *path) {
+	struct stat st;
+	mode_t mask;
+	int fd;
+
+	o->path = path;
+	snprintf(o->tmp, sizeof(o->tmp), "%s.tmp.XXXXXX", path);
+	fd = mkstemp(o->tmp);
+	if (fd < 0) {
+		perror(o->tmp);
+		return (-1);
+	}
+	if (stat(path, &st) == 0)
+		fchmod(fd, st.st_mode & 07777);
+	else {
+		mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+	fflush(stdout);
+	o->saved_stdout = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+	return (0);
+}
+
+/*
+ * Restore stdout and either rename the result into place or discard
+ * it.  Returns 0 on success, -1 on error.
+ */
+static int output_end(struct output_state *o, int keep) {
+	fflush(stdout);
+	dup2(o->saved_stdout, STDOUT_FILENO);
+	close(o->saved_stdout);
+	if (keep && rename(o->tmp, o->path) == 0)
+		return (0);
+	if (keep)
+		perror(o->path);
+	unlink(o->tmp);
+	return (keep ? -1 : 0);
+}
+
+static int command_explains(const struct command *c) {
+	return (c->ins.match.explain || c->rep.match.explain || c->ext.match.explain);
+}
+
+/*
+ * Write one file's edited text back in place, or show it as a diff
+ * with --dry-run.  Unchanged files are left alone.
+ * Returns 0 on success, or an exit status.
+ */
+static int write_back(const struct run_opts *ro, const struct inc_file *f, const struct buf *text) {
+	struct dry_run_state dr;
+	struct output_state out;
+
+	if (text->len == (size_t)f->len && memcmp(text->data, f->buf, text->len) == 0)
+		return (0);
+	if (ro->dry_run) {
+		if (setup_dry_run(&dr, f->buf, f->len) != 0)
+			return (1);
+		fwrite(text->data, 1, text->len, stdout);
+		return (finish_dry_run(&dr, f->path, ro->no_color));
+	}
+	if (output_begin(&out, f->path) != 0)
+		return (1);
+	fwrite(text->data, 1, text->len, stdout);
+	return (output_end(&out, 1) != 0 ? 1 : 0);
+}
+
+/*
+ * --follow-includes: run the command on every file of the include
+ * graph.  extract prints each file's matches under a "==> path <=="
+ * header, or as the records of one --json array or NDJSON stream.
+ * format, insert and replace render every file first and, only if
+ * all succeed, write the changed ones back individually.  An insert
+ * without constraints only appends to the root file.
+ * Returns the process exit status.
+ */
+static int run_includes(const struct run_opts *ro, struct command *c) {
+	struct inc_graph g;
+	struct tok_sink *sinks, plain;
+	struct buf b, all;
+	long shown;
+	int i, r, edit;
+
+	if (!c->ready && command_prepare(c, ro->cmd, ro->opt_argc, ro->opt_argv) != 0)
+		return (1);
+	if (c->ins.emit != EMIT_TEXT || c->rep.emit != EMIT_TEXT) {
+		fprintf(stderr, "--emit cannot be combined with --follow-includes\n");
+		return (1);
+	}
+	if (include_load(&g, ro->path, ro->search, ro->nsearch, 1) != 0) {
+		include_free(&g);
+		return (1);
+	}
+	if (command_explains(c)) {
+		r = dispatch(c, g.file[0].src, NULL, ro->jobs);
+		include_free(&g);
+		return (r);
+	}
+
+	r = 0;
+	if (strcmp(c->name, "extract") == 0) {
+		buf_init(&all);
+		shown = 0;
+		for (i = 0; i < g.n && r == 0; i++) {
+			if (c->ext.query == QUERY_EXISTS && shown > 0)
+				break;
+			buf_init(&b);
+			r = cmd_extract_main(&c->ext, g.file[i].src, &b, &shown);
+			if (r != 0)
+				fprintf(stderr, "in %s\n", g.file[i].path);
+			else if (c->ext.json != OUT_TEXT)
+				buf_append(&all, b.data, b.len);
+			else if (b.len > 0)
+				printf("==> %s <==\n%.*s", g.file[i].path, (int)b.len, b.data);
+			free(b.data);
+		}
+		if (r == 0 && c->ext.query != QUERY_NONE)
+			r = query_result(&c->ext, shown);
+		else if (r == 0 && c->ext.json == OUT_JSON)
+			print_json_array(&all);
+		else if (r == 0)
+			fwrite(all.data, 1, all.len, stdout);
+		free(all.data);
+		for (i = 0; i < g.n; i++) {
+			if (g.file[i].dup < 0)
+				note_source(ro, g.file[i].src);
+		}
+		include_free(&g);
+		return (r);
+	}
+
+	if (strcmp(c->name, "fingerprint") == 0) {
+		buf_init(&b);
+		for (i = 0; i < g.n; i++) {
+			fingerprint_source(g.file[i].src, g.file[i].path, !c->ignore_comments, &b);
+			if (g.file[i].dup < 0)
+				note_source(ro, g.file[i].src);
+		}
+		fwrite(b.data, 1, b.len, stdout);
+		free(b.data);
+		include_free(&g);
+		return (0);
+	}
+
+	sinks = calloc(g.n, sizeof(*sinks));
+	if (strcmp(c->name, "refs") == 0 || strcmp(c->name, "rename") == 0) {
+		/* Names defined in one file are used in others */
+		for (i = 0; i < g.n; i++)
+			tok_sink_init(&sinks[i]);
+		r = cmd_symbols(c, g.file, g.n, sinks);
+		edit = strcmp(c->name, "rename") == 0;
+		for (i = 0; i < g.n && r == 0 && edit; i++)
+			r = write_back(ro, &g.file[i], &sinks[i].text);
+		for (i = 0; i < g.n; i++) {
+			if (g.file[i].dup < 0)
+				note_source(ro, g.file[i].src);
+			tok_sink_free(&sinks[i]);
+		}
+		free(sinks);
+		include_free(&g);
+		return (r);
+	}
+	for (i = 0; i < g.n && r == 0; i++) {
+		tok_sink_init(&sinks[i]);
+		edit = i == 0 || strcmp(c->name, "insert") != 0 ||
+		    c->ins.match.look_behind_pat != NULL ||
+		    c->ins.match.look_ahead_pat != NULL ||
+		    match_scoped(&c->ins.match);
+		if (edit && (r = dispatch(c, g.file[i].src, &sinks[i], ro->jobs)) != 0) {
+			fprintf(stderr, "in %s\n", g.file[i].path);
+			break;
+		}
+
+		/* Leave files the edit didn't touch as they are, unformatted */
+		if (edit && strcmp(c->name, "format") != 0 &&
+		    !c->ins.preserve && !c->rep.preserve) {
+			tok_sink_init(&plain);
+			emit_formatted(g.file[i].src, NULL, NULL, &plain);
+			edit = plain.text.len != sinks[i].text.len ||
+			    memcmp(plain.text.data, sinks[i].text.data, plain.text.len) != 0;
+			tok_sink_free(&plain);
+		}
+		if (!edit) {
+			sinks[i].text.len = 0;
+			buf_append(&sinks[i].text, g.file[i].buf, (size_t)g.file[i].len);
+		}
+	}
+	for (i = 0; i < g.n && r == 0; i++)
+		r = write_back(ro, &g.file[i], &sinks[i].text);
+	for (i = 0; i < g.n; i++) {
+		if (g.file[i].dup < 0)
+			note_source(ro, g.file[i].src);
+		tok_sink_free(&sinks[i]);
+	}
+	free(sinks);
+	include_free(&g);
+	return (r);
+}
+
+/*
+ * Read apply-patch's patch, once: --watch reruns apply the same one.
+ * Returns 0 on success, 1 on error.
+ */
+static int load_patch(const struct run_opts *ro, struct command *c) {
+	if (c->patch != NULL)
+		return (0);
+	if (strcmp(c->patch_path, "-") != 0)
+		c->patch = read_file(c->patch_path, &c->patch_len);
+	else if (ro->path == NULL) {
+		fprintf(stderr, "apply-patch cannot read both the input and the patch from stdin\n");
+		return (1);
+	}
+	else if ((c->patch = read_stdin(&c->patch_len)) == NULL)
+		perror("read_stdin");
+	return (c->patch == NULL ? 1 : 0);
+}
+
+/*
+ * apply-patch: write the input with a patch from --emit applied.
+ * Returns the process exit status.
+ */
+static int run_apply_patch(const struct run_opts *ro, struct command *c, const char *buf, long len) {
+	struct splice_list sl;
+	struct dry_run_state dr;
+	int r;
+
+	if (load_patch(ro, c) != 0)
+		return (1);
+
+	splice_init(&sl);
+	r = 1;
+	if (patch_parse(buf, (size_t)len, c->patch, (size_t)c->patch_len, &sl) == 0 &&
+	    (!ro->dry_run || setup_dry_run(&dr, buf, len) == 0)) {
+		splice_write(&sl, buf, (size_t)len, NULL);
+		r = ro->dry_run ? finish_dry_run(&dr, ro->input_name, ro->no_color) : 0;
+	}
+	splice_free(&sl);
+	return (r);
+}
+
+/*
+ * Read the input and produce one result: from the cache, or by
+ * running the command (prepared on first use).
+ * Returns the process exit status.
+ */
+static int run_once(const struct run_opts *ro, struct command *c) {
+	struct result_cache cache;
+	struct output_state out;
+	const char **parts;
+	char patch_hash[PATCH_SHA256_LEN];
+	long len;
+	char *buf;
+	int i, r;
+
+	/* Phase 3: read input */
+	if (ro->path == NULL) {
+		buf = read_stdin(&len);
+		if (buf == NULL) {
+			perror("read_stdin");
+			return (1);
+		}
+	}
+	else {
+		buf = read_file(ro->path, &len);
+		if (buf == NULL)
+			return (1);
+	}
+
+	if (ro->output != NULL && output_begin(&out, ro->output) != 0) {
+		free(buf);
+		return (1);
+	}
+
+	/* Phase 3b: --cache-dir lookup, before any lexing */
+	r = -1;
+	patch_hash[0] = '\0';
+	if (ro->cache_dir != NULL && strcmp(ro->cmd, "apply-patch") == 0) {
+		/* The argument is only the patch's path: key on its contents */
+		if ((!c->ready && command_prepare(c, ro->cmd, ro->opt_argc, ro->opt_argv) != 0) ||
+		    load_patch(ro, c) != 0)
+			r = 1;
+		else
+			patch_sha256(c->patch, (size_t)c->patch_len, patch_hash);
+	}
+	if (r < 0 && ro->cache_dir != NULL) {
+		/* The input's name is part of the output: diff labels, "file" */
+		parts = malloc((8 + ro->opt_argc) * sizeof(*parts));
+		parts[0] = VINYL_EDIT_VERSION;
+		parts[1] = ro->cmd;
+		parts[2] = ro->input_name;
+		parts[3] = ro->dry_run ? "--dry-run" : "";
+		parts[4] = ro->no_color ? "--no-color" : "";
+		parts[5] = ro->tokens_in ? "--input-format=tokens" : "";
+		parts[6] = ro->tokens_out ? "--output-format=tokens" : "";
+		parts[7] = patch_hash;
+		for (i = 0; i < ro->opt_argc; i++)
+			parts[8 + i] = ro->opt_argv[i];
+		if (cache_open(&cache, ro->cache_dir, ro->cache_size) != 0)
+			r = 1;
+		else {
+			cache_key(&cache, parts, 8 + ro->opt_argc, buf, len);
+			if (cache_fetch(&cache))
+				r = 0;
+			else if (cache_begin(&cache) != 0)
+				r = 1;
+		}
+		free(parts);
+	}
+
+	if (r < 0) {
+		if (!c->ready && command_prepare(c, ro->cmd, ro->opt_argc, ro->opt_argv) != 0)
+			r = 1;
+		else
+			r = strcmp(c->name, "apply-patch") == 0 ?
+			    run_apply_patch(ro, c, buf, len) : run_command(ro, c, buf, len);
+		if (ro->cache_dir != NULL)
+			cache_end(&cache, r == 0);
+	}
+
+	if (ro->output != NULL && output_end(&out, r == 0) != 0)
+		r = 1;
+	free(buf);
+	return (r);
+}
+
+/*
+ * Mark a piece of a --stream input: only the first piece keeps its
+ * SOI, and only the last one an EOI with text, so patterns anchored
+ * on them match at the ends of the whole input.
+ */
+static void stream_boundaries(struct source *src, int first, int last) {
+	struct token *t;
+
+	add_boundary_tokens(src);
+	if (!first) {
+		t = VTAILQ_FIRST(&src->src_tokens);
+		VTAILQ_REMOVE(&src->src_tokens, t, src_list);
+	}
+	if (!last) {
+		t = VTAILQ_LAST(&src->src_tokens, tokenhead);
+		t->b = t->e = src->e;
+	}
+}
+
+/*
+ * extract on a --stream piece that isn't the last one.  Matches whose
+ * outcome depends on what follows the piece are left for later: the
+ * piece is searched up to the first of them, and *cut is set to where
+ * the rest starts.  Earlier matches all end before it, so that is a
+ * clean cut, except with --within or --select, whose blocks must be
+ * seen whole: then the cut is moved back to the start of the
+ * top-level declaration, or the whole piece is left.
+ * Output goes to out.
+ * Returns the number of matches, or -1 if the step budget ran out.
+ */
+static int stream_extract(struct source *src, struct extract_opts *ext, struct buf *out, const char **cut) {
+	struct token *t, *bnd;
+	const char *stop;
+	int depth, matched;
+
+	*cut = NULL;
+	plan_open_end(ext->from_pat);
+	plan_open_end(ext->match.within_pat);
+	ext->stop = &stop;
+	out->len = 0;
+	matched = cmd_extract(src, ext, out);
+	if (matched < 0 || stop == NULL)
+		return (matched);
+	if (!match_scoped(&ext->match)) {
+		*cut = stop;
+		return (matched);
+	}
+
+	/* Search again, up to the end of the last declaration before stop */
+	bnd = NULL;
+	depth = 0;
+	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
+		if (t->tok == EOI || t->b >= stop)
+			break;
+		if (t->tok == '{')
+			depth++;
+		else if (t->tok == '}' && depth > 0)
+			depth--;
+		if (depth == 0 && (t->tok == ';' || t->tok == '}'))
+			bnd = t;
+	}
+	*cut = src->b;
+	out->len = 0;
+	if (bnd == NULL)
+		return (0);
+	ext->until = bnd->e;
+	matched = cmd_extract(src, ext, out);
+	if (matched < 0)
+		return (matched);
+
+	/* A match that runs past the cut holds back the whole piece */
+	if (stop == NULL || stop != VTAILQ_NEXT(bnd, src_list)->b) {
+		out->len = 0;
+		return (0);
+	}
+	*cut = bnd->e;
+	return (matched);
+}
+
+/*
+ * --stream: read stdin in pieces of complete top-level declarations
+ * and lex, process and print each piece before reading on.  Text
+ * where a match might continue past the piece is held back and lexed
+ * again with the next one, so matches can span pieces; --limit and
+ * --offset count across them.
+ * Returns the process exit status.
+ */
+static int run_stream(const struct run_opts *ro, struct command *c) {
+	struct stream in;
+	struct source *src;
+	struct fmt_state st;
+	struct extract_opts ext;
+	struct text_pos base;
+	struct buf out;
+	const char *cut;
+	char *text, *held, *joined;
+	size_t len, held_len;
+	int first, last, count, matched, r, n;
+
+	if (!c->ready && command_prepare(c, ro->cmd, ro->opt_argc, ro->opt_argv) != 0)
+		return (1);
+	if (c->json == OUT_JSON || c->ext.json == OUT_JSON) {
+		fprintf(stderr, "--stream cannot be combined with --json; use --ndjson\n");
+		return (1);
+	}
+	if (c->ext.match.look_behind_pat != NULL) {
+		fprintf(stderr, "--stream cannot be combined with --look-behind\n");
+		return (1);
+	}
+	if (command_explains(c))
+		return (run_once(ro, c));
+
+	memset(&st, 0, sizeof(st));
+	st.first = 1;
+	base.off = 0;
+	base.line = 1;
+	base.col = 1;
+	if (strcmp(c->name, "tokens") == 0 && c->json == OUT_TEXT) {
+		printf("%-12s %s\n", "TYPE", "VALUE");
+		printf("%-12s %s\n", "----", "-----");
+	}
+	match_budget_reset(c->ext.match.max_steps);
+	stream_init(&in, STDIN_FILENO);
+	buf_init(&out);
+	held = NULL;
+	held_len = 0;
+	first = 1;
+	count = 0;
+	r = 0;
+	while (r == 0 && (n = stream_next(&in, &text, &len, &last)) > 0) {
+		if (held != NULL) {
+			joined = malloc(held_len + len + 1);
+			memcpy(joined, held, held_len);
+			memcpy(joined + held_len, text, len + 1);
+			free(held);
+			free(text);
+			text = joined;
+			len += held_len;
+			held = NULL;
+		}
+		src = source_new(text, "file", ro->input_name);
+		lex_source(src);
+		stream_boundaries(src, first, last);
+		cut = NULL;
+		if (strcmp(c->name, "tokens") == 0)
+			print_tokens(src, c->processed, c->json, &base, last);
+		else if (check_unknown_gaps(src) != 0)
+			r = 1;
+		else if (strcmp(c->name, "format") == 0) {
+			fmt_emit_range(&st, VTAILQ_FIRST(&src->src_tokens), NULL, src->b);
+			if (last)
+				fmt_finish(&st);
+		}
+		else {
+			/* Carry --offset and --limit over from earlier pieces */
+			ext = c->ext;
+			if (ext.match.limit > 0) {
+				ext.match.offset = count < c->ext.match.offset ?
+				    c->ext.match.offset - count : 0;
+				ext.match.limit = c->ext.match.offset + c->ext.match.limit -
+				    count - ext.match.offset;
+			}
+			ext.base = base;
+			add_comment_tokens(src);
+			plan_match(src, &ext.match, ext.from_pat);
+			out.len = 0;
+			if (last)
+				matched = cmd_extract(src, &ext, &out);
+			else
+				matched = stream_extract(src, &ext, &out, &cut);
+			if (matched < 0)
+				r = match_budget_error(&c->ext.match);
+			else {
+				fwrite(out.data, 1, out.len, stdout);
+				count += matched;
+			}
+		}
+		fflush(stdout);
+		note_source(ro, src);
+		if (cut != NULL) {
+			/* Lexed again in front of the next piece */
+			held_len = (size_t)(text + len - cut);
+			held = malloc(held_len + 1);
+			memcpy(held, cut, held_len);
+			held[held_len] = '\0';
+			len = (size_t)(cut - text);
+		}
+		text_pos_advance(&base, text, text + len);
+		source_free(src);
+		free(text);
+		if (len > 0)
+			first = 0;
+		if (c->ext.match.limit > 0 &&
+		    count >= c->ext.match.offset + c->ext.match.limit)
+			break;
+	}
+	stream_free(&in);
+	free(held);
+	free(out.data);
+	if (n < 0)
+		r = 1;
+	if (r == 0 && strcmp(c->name, "extract") == 0 && c->ext.query != QUERY_NONE)
+		r = query_result(&c->ext, matches_shown(&c->ext, count));
+	return (r);
+}
+
+/*
+ * Run, then run again each time the input changes, until killed.
+ * Failed runs leave the previous output in place.
+ */
+static int watch_loop(const struct run_opts *ro, struct command *c) {
+	struct file_watch w;
+
+	if (command_prepare(c, ro->cmd, ro->opt_argc, ro->opt_argv) != 0)
+		return (1);
+	if (watch_open(&w, ro->path) != 0)
+		return (1);
+	for (;;) {
+		run_once(ro, c);
+		fflush(stdout);
+		if (watch_wait(&w) != 0)
+			break;
+	}
+	watch_close(&w);
+	return (1);
+}
+
+/*
+ * Check that --output doesn't name the input: rewriting it would
+ * trigger the watch again.
+ */
+static int same_file(const char *a, const char *b) {
+	struct stat sa, sb;
+
+	if (stat(a, &sa) != 0 || stat(b, &sb) != 0)
+		return (0);
+	return (sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino);
+}
+
+int main(int argc, char *argv[]) {
+	struct run_opts ro;
+	struct command c;
 	const char *cmd;
-	const char *input_name;
-	int dry_run, no_color, use_stdin;
-	int opt_argc, i, j;
-	char **opt_argv;
+	struct run_stats stats;
+	int dry_run, no_color, tokens_in, tokens_out, watch, follow_includes, stream, jobs;
+	int show_stats;
+	int opt_argc, nsearch, i, j, r;
+	char **opt_argv, **search;
+	const char *cache_dir, *output;
+	unsigned long cache_size;
 
 	if (argc < 3) {
 		usage(argv[0]);
@@ -463,20 +1875,26 @@ int main(int argc, char *argv[]) {
 		return (1);
 	}
 
-	if (strcmp(argv[2], "-") == 0) {
-		use_stdin = 1;
-		input_name = "stdin";
-	}
-	else {
-		use_stdin = 0;
-		input_name = argv[2];
-	}
+	if (strcmp(cmd, "grep") == 0)
+		return (cmd_grep_main(argc - 2, argv + 2));
 
 	/* Phase 2: strip global flags from remaining args */
 	opt_argv = argv + 3;
 	opt_argc = argc - 3;
 	dry_run = 0;
 	no_color = 0;
+	tokens_in = 0;
+	tokens_out = 0;
+	watch = 0;
+	follow_includes = 0;
+	stream = 0;
+	show_stats = 0;
+	jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	search = malloc((opt_argc + 1) * sizeof(*search));
+	nsearch = 0;
+	cache_dir = NULL;
+	cache_size = CACHE_MAX_BYTES;
+	output = NULL;
 	j = 0;
 	for (i = 0; i < opt_argc; i++) {
 		if (strcmp(opt_argv[i], "--dry-run") == 0) {
@@ -485,119 +1903,182 @@ int main(int argc, char *argv[]) {
 		else if (strcmp(opt_argv[i], "--no-color") == 0) {
 			no_color = 1;
 		}
+		else if (strcmp(opt_argv[i], "--watch") == 0) {
+			watch = 1;
+		}
+		else if (strcmp(opt_argv[i], "--follow-includes") == 0) {
+			follow_includes = 1;
+		}
+		else if (strcmp(opt_argv[i], "--stream") == 0) {
+			stream = 1;
+		}
+		else if (strcmp(opt_argv[i], "--stats") == 0) {
+			show_stats = 1;
+		}
+		else if (strcmp(opt_argv[i], "--jobs") == 0) {
+			if (i + 1 >= opt_argc) {
+				fprintf(stderr, "%s requires a value\n", opt_argv[i]);
+				return (1);
+			}
+			jobs = atoi(opt_argv[++i]);
+		}
+		else if (strncmp(opt_argv[i], "-I", 2) == 0) {
+			if (opt_argv[i][2] != '\0')
+				search[nsearch++] = opt_argv[i] + 2;
+			else if (i + 1 < opt_argc)
+				search[nsearch++] = opt_argv[++i];
+			else {
+				fprintf(stderr, "-I requires a value\n");
+				return (1);
+			}
+		}
+		else if (strcmp(opt_argv[i], "--output") == 0) {
+			if (i + 1 >= opt_argc) {
+				fprintf(stderr, "%s requires a value\n", opt_argv[i]);
+				return (1);
+			}
+			output = opt_argv[++i];
+		}
+		else if (strcmp(opt_argv[i], "--cache-dir") == 0 ||
+		    strcmp(opt_argv[i], "--cache-size") == 0) {
+			if (i + 1 >= opt_argc) {
+				fprintf(stderr, "%s requires a value\n", opt_argv[i]);
+				return (1);
+			}
+			if (strcmp(opt_argv[i], "--cache-dir") == 0)
+				cache_dir = opt_argv[++i];
+			else
+				cache_size = strtoul(opt_argv[++i], NULL, 10);
+		}
+		else if (strcmp(opt_argv[i], "--input-format") == 0 ||
+		    strcmp(opt_argv[i], "--output-format") == 0) {
+			if (i + 1 >= opt_argc) {
+				fprintf(stderr, "%s requires a value\n", opt_argv[i]);
+				return (1);
+			}
+			if (strcmp(opt_argv[i + 1], "text") == 0)
+				r = 0;
+			else if (strcmp(opt_argv[i + 1], "tokens") == 0)
+				r = 1;
+			else {
+				fprintf(stderr, "Unknown %s: %s\n", opt_argv[i] + 2, opt_argv[i + 1]);
+				return (1);
+			}
+			if (opt_argv[i][2] == 'i')
+				tokens_in = r;
+			else
+				tokens_out = r;
+			i++;
+		}
 		else {
 			opt_argv[j++] = opt_argv[i];
 		}
 	}
 	opt_argc = j;
-
-	/* Phase 3: read input */
-	if (use_stdin) {
-		buf = read_stdin(&len);
-		if (buf == NULL) {
-			perror("read_stdin");
-			return (1);
-		}
+	if (tokens_out && dry_run) {
+		fprintf(stderr, "--output-format tokens cannot be combined with --dry-run\n");
+		return (1);
 	}
-	else {
-		f = fopen(argv[2], "r");
-		if (f == NULL) {
-			perror(argv[2]);
-			return (1);
-		}
-		fseek(f, 0, SEEK_END);
-		len = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		buf = malloc(len + 1);
-		if (buf == NULL) {
-			perror("malloc");
-			fclose(f);
-			return (1);
-		}
-		if (fread(buf, 1, len, f) != (size_t)len) {
-			perror("fread");
-			free(buf);
-			fclose(f);
-			return (1);
-		}
-		buf[len] = '\0';
-		fclose(f);
+	if (tokens_out && (strcmp(cmd, "tokens") == 0 || strcmp(cmd, "extract") == 0 ||
+	    strcmp(cmd, "apply-patch") == 0 || strcmp(cmd, "refs") == 0 ||
+	    strcmp(cmd, "rename") == 0 || strcmp(cmd, "fingerprint") == 0)) {
+		fprintf(stderr, "--output-format tokens is not supported by %s\n", cmd);
+		return (1);
 	}
-
-	vcc = VCC_New();
-	src = vcc_new_source(buf, "file", input_name);
-	vcc_Lexer(vcc, src);
-	add_boundary_tokens(src);
-
-	/* Check for unparseable content (skip for tokens -- it's diagnostic) */
-	if (strcmp(cmd, "tokens") != 0 && check_unknown_gaps(src) != 0) {
-		free(buf);
+	if (tokens_in && strcmp(cmd, "apply-patch") == 0) {
+		fprintf(stderr, "--input-format tokens is not supported by %s\n", cmd);
 		return (1);
 	}
 
-	/* Phase 4: --dry-run capture setup */
-	struct dry_run_state dr;
-
-	if (dry_run) {
-		if (setup_dry_run(&dr, buf, len) != 0) {
-			free(buf);
-			return (1);
-		}
+	if (nsearch > 0 && !follow_includes) {
+		fprintf(stderr, "-I requires --follow-includes\n");
+		return (1);
 	}
-
-	/* Command dispatch */
-	if (strcmp(cmd, "format") == 0) {
-		if (opt_argc > 0) {
-			fprintf(stderr, "Unknown option: %s\n", opt_argv[0]);
-			free(buf);
+	if (follow_includes) {
+		if (strcmp(argv[2], "-") == 0) {
+			fprintf(stderr, "--follow-includes requires an input file, not stdin\n");
 			return (1);
 		}
-		emit_formatted(src, NULL, NULL);
-	}
-	else if (strcmp(cmd, "tokens") == 0) {
-		int processed = 0;
-		for (i = 0; i < opt_argc; i++) {
-			if (strcmp(opt_argv[i], "--processed") == 0)
-				processed = 1;
-			else {
-				fprintf(stderr, "Unknown option: %s\n", opt_argv[i]);
-				free(buf);
-				return (1);
-			}
+		if (strcmp(cmd, "tokens") == 0 || strcmp(cmd, "apply-patch") == 0 ||
+		    tokens_in || tokens_out || watch || output != NULL || cache_dir != NULL) {
+			fprintf(stderr, "--follow-includes cannot be combined with %s\n",
+			    strcmp(cmd, "tokens") == 0 ? "the tokens command" :
+			    strcmp(cmd, "apply-patch") == 0 ? "the apply-patch command" :
+			    tokens_in ? "--input-format tokens" :
+			    tokens_out ? "--output-format tokens" :
+			    watch ? "--watch" : output != NULL ? "--output" : "--cache-dir");
+			return (1);
 		}
-		cmd_tokens(src, processed);
 	}
-	else if (strcmp(cmd, "insert") == 0) {
-		if (cmd_insert(vcc, src, opt_argc, opt_argv) != 0) {
-			free(buf);
+
+	if (stream) {
+		if (strcmp(argv[2], "-") != 0) {
+			fprintf(stderr, "--stream reads stdin: use - as the input\n");
 			return (1);
 		}
-	}
-	else if (strcmp(cmd, "replace") == 0) {
-		if (cmd_replace(vcc, src, opt_argc, opt_argv) != 0) {
-			free(buf);
+		if (strcmp(cmd, "format") != 0 && strcmp(cmd, "tokens") != 0 &&
+		    strcmp(cmd, "extract") != 0) {
+			fprintf(stderr, "--stream is not supported by %s\n", cmd);
 			return (1);
 		}
-	}
-	else if (strcmp(cmd, "extract") == 0) {
-		if (cmd_extract_main(vcc, src, opt_argc, opt_argv) != 0) {
-			free(buf);
+		if (dry_run || tokens_in || tokens_out || output != NULL || cache_dir != NULL) {
+			fprintf(stderr, "--stream cannot be combined with %s\n",
+			    dry_run ? "--dry-run" :
+			    tokens_in ? "--input-format tokens" :
+			    tokens_out ? "--output-format tokens" :
+			    output != NULL ? "--output" : "--cache-dir");
 			return (1);
 		}
 	}
+
+	memset(&ro, 0, sizeof(ro));
+	ro.progname = argv[0];
+	ro.cmd = cmd;
+	if (strcmp(argv[2], "-") == 0) {
+		ro.path = NULL;
+		ro.input_name = "stdin";
+	}
 	else {
-		fprintf(stderr, "Unknown command: %s\n", cmd);
-		usage(argv[0]);
-		free(buf);
-		return (1);
+		ro.path = argv[2];
+		ro.input_name = argv[2];
 	}
+	ro.output = output;
+	ro.cache_dir = cache_dir;
+	ro.cache_size = cache_size;
+	ro.opt_argc = opt_argc;
+	ro.opt_argv = opt_argv;
+	ro.search = search;
+	ro.nsearch = nsearch;
+	ro.follow_includes = follow_includes;
+	ro.dry_run = dry_run;
+	ro.no_color = no_color;
+	ro.tokens_in = tokens_in;
+	ro.tokens_out = tokens_out;
+	ro.jobs = jobs;
+	memset(&stats, 0, sizeof(stats));
+	ro.stats = show_stats ? &stats : NULL;
 
-	/* Phase 5: --dry-run diff */
-	if (dry_run) {
-		free(buf);
-		return (finish_dry_run(&dr, input_name, no_color));
+	memset(&c, 0, sizeof(c));
+	if (watch) {
+		if (ro.path == NULL) {
+			fprintf(stderr, "--watch requires an input file, not stdin\n");
+			return (1);
+		}
+		if (output != NULL && same_file(output, ro.path)) {
+			fprintf(stderr, "--watch cannot write its --output to the input file\n");
+			return (1);
+		}
+		r = watch_loop(&ro, &c);
 	}
-
-	free(buf);
-	return (0);
+	else if (follow_includes)
+		r = run_includes(&ro, &c);
+	else if (stream)
+		r = run_stream(&ro, &c);
+	else
+		r = run_once(&ro, &c);
+	if (show_stats)
+		print_stats(&stats);
+	command_free(&c);
+	free(search);
+	return (r);
 }
@@ -0,0 +1,632 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vsha256.h"
+#include "buf.h"
+#include "splice.h"
+#include "patch.h"
+
+/* The whole old lines [b, e) that edits first..last change */
+struct patch_block {
+	size_t b;
+	size_t e;
+	int first;
+	int last;
+};
+
+struct json_in {
+	const char *p;
+	const char *e;
+};
+
+static size_t line_start(const char *t, size_t p) {
+	while (p > 0 && t[p-1] != '\n')
+		p--;
+	return (p);
+}
+
+static size_t line_end(const char *t, size_t len, size_t p) {
+	const char *nl;
+
+	nl = memchr(t + p, '\n', len - p);
+	return (nl != NULL ? (size_t)(nl - t) + 1 : len);
+}
+
+/* Lines in t[b, e), counting an unterminated last line */
+static long count_lines(const char *t, size_t b, size_t e) {
+	long n = 0;
+	size_t i;
+
+	for (i = b; i < e; i++)
+		n += t[i] == '\n';
+	if (e > b && t[e-1] != '\n')
+		n++;
+	return (n);
+}
+
+/* Append the lines of block k with its edits applied */
+static void block_text(
+    const struct splice_list *sl, const char *t, const struct patch_block *k,
+    struct buf *out) {
+	size_t pos;
+	int i;
+
+	pos = k->b;
+	for (i = k->first; i <= k->last; i++) {
+		buf_append(out, t + pos, sl->s[i].b - pos);
+		buf_append(out, sl->text.data + sl->s[i].off, sl->s[i].len);
+		pos = sl->s[i].e;
+	}
+	buf_append(out, t + pos, k->e - pos);
+}
+
+/*
+ * Widen each edit to whole lines, joining edits on the same or
+ * adjacent lines.
+ * Edits that change nothing are left out.  Returns the number of
+ * blocks.
+ */
+static int find_blocks(
+    const struct splice_list *sl, const char *t, size_t len,
+    struct patch_block **out) {
+	const struct splice *s;
+	struct patch_block *blk, *k;
+	struct buf tmp;
+	size_t b, e;
+	int i, n;
+
+	blk = malloc((sl->n + 1) * sizeof(*blk));
+	buf_init(&tmp);
+	n = 0;
+	for (i = 0; i < sl->n; i++) {
+		s = &sl->s[i];
+		if (s->len == s->e - s->b &&
+		    memcmp(t + s->b, sl->text.data + s->off, s->len) == 0)
+			continue;
+		b = line_start(t, s->b);
+		e = s->e == b || t[s->e - 1] == '\n' ? s->e : line_end(t, len, s->e);
+		if (n > 0 && b <= blk[n-1].e) {
+			k = &blk[n-1];
+			if (e > k->e)
+				k->e = e;
+			k->last = i;
+		}
+		else {
+			k = &blk[n++];
+			k->b = b;
+			k->e = e;
+			k->first = k->last = i;
+		}
+		/* New lines must end where the old ones do */
+		for (;;) {
+			tmp.len = 0;
+			block_text(sl, t, k, &tmp);
+			if (tmp.len == 0 || tmp.data[tmp.len - 1] == '\n' || k->e >= len)
+				break;
+			k->e = line_end(t, len, k->e);
+		}
+	}
+	free(tmp.data);
+	*out = blk;
+	return (n);
+}
+
+/* Append the lines of [b, e) with a mark each; returns how many */
+static long diff_lines(struct buf *out, char mark, const char *b, const char *e) {
+	const char *nl;
+	long n;
+
+	for (n = 0; b < e; n++) {
+		buf_appendc(out, mark);
+		nl = memchr(b, '\n', (size_t)(e - b));
+		if (nl == NULL) {
+			buf_append(out, b, (size_t)(e - b));
+			buf_appends(out, "\n\\ No newline at end of file\n");
+			return (n + 1);
+		}
+		buf_append(out, b, (size_t)(nl + 1 - b));
+		b = nl + 1;
+	}
+	return (n);
+}
+
+static void diff_range(struct buf *out, long start, long count) {
+	char num[64];
+
+	if (count == 1)
+		snprintf(num, sizeof(num), "%ld", start);
+	else
+		snprintf(num, sizeof(num), "%ld,%ld", count == 0 ? start - 1 : start, count);
+	buf_appends(out, num);
+}
+
+void patch_diff(
+    const struct splice_list *sl, const char *t, size_t len, const char *name,
+    struct buf *out) {
+	struct patch_block *blk;
+	struct buf body, tmp;
+	size_t pos, hb, he, p;
+	long line, delta, nold, nnew, n;
+	int nb, i, j, k, c;
+
+	nb = find_blocks(sl, t, len, &blk);
+	if (nb == 0) {
+		free(blk);
+		return;
+	}
+	buf_appends(out, "--- a/");
+	buf_appends(out, name);
+	buf_appends(out, "\n+++ b/");
+	buf_appends(out, name);
+	buf_appendc(out, '\n');
+
+	buf_init(&body);
+	buf_init(&tmp);
+	pos = 0;
+	line = 1;
+	delta = 0;
+	for (k = 0; k < nb; k = j) {
+		/* Blocks close enough for their context to meet share a hunk */
+		for (j = k + 1; j < nb &&
+		    count_lines(t, blk[j-1].e, blk[j].b) <= 2 * PATCH_CONTEXT; j++)
+			continue;
+		hb = blk[k].b;
+		for (c = 0; c < PATCH_CONTEXT && hb > 0; c++)
+			hb = line_start(t, hb - 1);
+		he = blk[j-1].e;
+		for (c = 0; c < PATCH_CONTEXT && he < len; c++)
+			he = line_end(t, len, he);
+		line += count_lines(t, pos, hb);
+		pos = hb;
+
+		body.len = 0;
+		nold = nnew = 0;
+		p = hb;
+		for (i = k; i < j; i++) {
+			n = diff_lines(&body, ' ', t + p, t + blk[i].b);
+			nold += n;
+			nnew += n;
+			nold += diff_lines(&body, '-', t + blk[i].b, t + blk[i].e);
+			tmp.len = 0;
+			block_text(sl, t, &blk[i], &tmp);
+			nnew += diff_lines(&body, '+', tmp.data, tmp.data + tmp.len);
+			p = blk[i].e;
+		}
+		n = diff_lines(&body, ' ', t + p, t + he);
+		nold += n;
+		nnew += n;
+
+		buf_appends(out, "@@ -");
+		diff_range(out, line, nold);
+		buf_appends(out, " +");
+		diff_range(out, line + delta, nnew);
+		buf_appends(out, " @@\n");
+		buf_append(out, body.data, body.len);
+		delta += nnew - nold;
+	}
+	free(body.data);
+	free(tmp.data);
+	free(blk);
+}
+
+void patch_sha256(const char *t, size_t len, char *hex) {
+	VSHA256_CTX ctx;
+	unsigned char digest[VSHA256_LEN];
+	int i;
+
+	VSHA256_Init(&ctx);
+	VSHA256_Update(&ctx, t, len);
+	VSHA256_Final(digest, &ctx);
+	for (i = 0; i < VSHA256_LEN; i++)
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+}
+
+void patch_edits(
+    const struct splice_list *sl, const char *t, size_t len, const char *name,
+    struct buf *out) {
+	const struct splice *s;
+	char hex[VSHA256_LEN * 2 + 1], num[96];
+	int i;
+
+	patch_sha256(t, len, hex);
+	buf_appends(out, "{\"file\":");
+	buf_append_json(out, name, strlen(name));
+	buf_appends(out, ",\"sha256\":\"");
+	buf_appends(out, hex);
+	buf_appends(out, "\",\"edits\":[");
+	for (i = 0; i < sl->n; i++) {
+		s = &sl->s[i];
+		snprintf(num, sizeof(num), "%s{\"offset\":%zu,\"length\":%zu,\"text\":",
+		    i > 0 ? "," : "", s->b, s->e - s->b);
+		buf_appends(out, num);
+		buf_append_json(out, sl->text.data + s->off, s->len);
+		buf_appendc(out, '}');
+	}
+	buf_appends(out, "]}\n");
+}
+
+static void json_ws(struct json_in *j) {
+	while (j->p < j->e && (*j->p == ' ' || *j->p == '\t' || *j->p == '\n' || *j->p == '\r'))
+		j->p++;
+}
+
+static int json_char(struct json_in *j, char c) {
+	json_ws(j);
+	if (j->p < j->e && *j->p == c) {
+		j->p++;
+		return (1);
+	}
+	return (0);
+}
+
+static int json_hex4(struct json_in *j, unsigned *v) {
+	int i;
+
+	*v = 0;
+	if (j->e - j->p < 4)
+		return (-1);
+	for (i = 0; i < 4; i++, j->p++) {
+		*v <<= 4;
+		if (*j->p >= '0' && *j->p <= '9')
+			*v |= (unsigned)(*j->p - '0');
+		else if (*j->p >= 'a' && *j->p <= 'f')
+			*v |= (unsigned)(*j->p - 'a' + 10);
+		else if (*j->p >= 'A' && *j->p <= 'F')
+			*v |= (unsigned)(*j->p - 'A' + 10);
+		else
+			return (-1);
+	}
+	return (0);
+}
+
+static void utf8_append(struct buf *out, unsigned cp) {
+	if (cp < 0x80)
+		buf_appendc(out, (char)cp);
+	else if (cp < 0x800) {
+		buf_appendc(out, (char)(0xc0 | cp >> 6));
+		buf_appendc(out, (char)(0x80 | (cp & 0x3f)));
+	}
+	else if (cp < 0x10000) {
+		buf_appendc(out, (char)(0xe0 | cp >> 12));
+		buf_appendc(out, (char)(0x80 | (cp >> 6 & 0x3f)));
+		buf_appendc(out, (char)(0x80 | (cp & 0x3f)));
+	}
+	else {
+		buf_appendc(out, (char)(0xf0 | cp >> 18));
+		buf_appendc(out, (char)(0x80 | (cp >> 12 & 0x3f)));
+		buf_appendc(out, (char)(0x80 | (cp >> 6 & 0x3f)));
+		buf_appendc(out, (char)(0x80 | (cp & 0x3f)));
+	}
+}
+
+/* Read a JSON string into out.  Returns 0, or -1 if malformed. */
+static int json_string(struct json_in *j, struct buf *out) {
+	unsigned cp, lo;
+	char c;
+
+	out->len = 0;
+	if (!json_char(j, '"'))
+		return (-1);
+	while (j->p < j->e) {
+		c = *j->p++;
+		if (c == '"')
+			return (0);
+		if (c != '\\') {
+			buf_appendc(out, c);
+			continue;
+		}
+		if (j->p >= j->e)
+			return (-1);
+		c = *j->p++;
+		switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			buf_appendc(out, c);
+			break;
+		case 'b':
+			buf_appendc(out, '\b');
+			break;
+		case 'f':
+			buf_appendc(out, '\f');
+			break;
+		case 'n':
+			buf_appendc(out, '\n');
+			break;
+		case 'r':
+			buf_appendc(out, '\r');
+			break;
+		case 't':
+			buf_appendc(out, '\t');
+			break;
+		case 'u':
+			if (json_hex4(j, &cp) != 0)
+				return (-1);
+			/* A surrogate pair is one code point */
+			if (cp >= 0xd800 && cp < 0xdc00) {
+				if (j->e - j->p < 2 || j->p[0] != '\\' || j->p[1] != 'u')
+					return (-1);
+				j->p += 2;
+				if (json_hex4(j, &lo) != 0 || lo < 0xdc00 || lo >= 0xe000)
+					return (-1);
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+			}
+			utf8_append(out, cp);
+			break;
+		default:
+			return (-1);
+		}
+	}
+	return (-1);
+}
+
+static int json_size(struct json_in *j, size_t *v) {
+	json_ws(j);
+	if (j->p >= j->e || *j->p < '0' || *j->p > '9')
+		return (-1);
+	for (*v = 0; j->p < j->e && *j->p >= '0' && *j->p <= '9'; j->p++) {
+		if (*v > (SIZE_MAX - (size_t)(*j->p - '0')) / 10)
+			return (-1);
+		*v = *v * 10 + (size_t)(*j->p - '0');
+	}
+	return (0);
+}
+
+static int key_is(const struct buf *key, const char *s) {
+	return (key->len == strlen(s) && memcmp(key->data, s, key->len) == 0);
+}
+
+/*
+ * Read one {"offset","length","text"} object and add its edit.
+ * Returns 0, or -1 if malformed.
+ */
+static int parse_edit(struct json_in *j, struct buf *key, struct buf *val, struct splice_list *sl) {
+	size_t off, n;
+	int seen;
+
+	if (!json_char(j, '{'))
+		return (-1);
+	seen = 0;
+	do {
+		if (json_string(j, key) != 0 || !json_char(j, ':'))
+			return (-1);
+		if (key_is(key, "offset") && json_size(j, &off) == 0)
+			seen |= 1;
+		else if (key_is(key, "length") && json_size(j, &n) == 0)
+			seen |= 2;
+		else if (key_is(key, "text") && json_string(j, val) == 0)
+			seen |= 4;
+		else
+			return (-1);
+	} while (json_char(j, ','));
+	if (!json_char(j, '}') || seen != 7)
+		return (-1);
+	/* An end past SIZE_MAX is past the end of any input */
+	splice_add(sl, off, n > SIZE_MAX - off ? SIZE_MAX : off + n, val->data, val->len);
+	return (0);
+}
+
+static int parse_edits(const char *t, size_t len, const char *patch, size_t plen, struct splice_list *sl) {
+	struct json_in j;
+	struct buf key, val;
+	char hex[VSHA256_LEN * 2 + 1];
+	size_t end;
+	int i, r;
+
+	j.p = patch;
+	j.e = patch + plen;
+	buf_init(&key);
+	buf_init(&val);
+	r = -1;
+	if (!json_char(&j, '{'))
+		goto bad;
+	do {
+		if (json_string(&j, &key) != 0 || !json_char(&j, ':'))
+			goto bad;
+		if (key_is(&key, "file")) {
+			if (json_string(&j, &val) != 0)
+				goto bad;
+		}
+		else if (key_is(&key, "sha256")) {
+			if (json_string(&j, &val) != 0)
+				goto bad;
+			patch_sha256(t, len, hex);
+			if (val.len != strlen(hex) || memcmp(val.data, hex, val.len) != 0) {
+				fprintf(stderr, "patch: the edits were made for different input (sha256 mismatch)\n");
+				goto out;
+			}
+		}
+		else if (key_is(&key, "edits")) {
+			if (!json_char(&j, '['))
+				goto bad;
+			if (!json_char(&j, ']')) {
+				do {
+					if (parse_edit(&j, &key, &val, sl) != 0)
+						goto bad;
+				} while (json_char(&j, ','));
+				if (!json_char(&j, ']'))
+					goto bad;
+			}
+		}
+		else
+			goto bad;
+	} while (json_char(&j, ','));
+	if (!json_char(&j, '}'))
+		goto bad;
+	json_ws(&j);
+	if (j.p != j.e)
+		goto bad;
+
+	for (i = 0, end = 0; i < sl->n; i++) {
+		if (sl->s[i].b < end || sl->s[i].e < sl->s[i].b || sl->s[i].e > len) {
+			fprintf(stderr, "patch: edit %d overlaps the one before or is past the end of the input\n", i + 1);
+			goto out;
+		}
+		end = sl->s[i].e;
+	}
+	r = 0;
+	goto out;
+bad:
+	fprintf(stderr, "patch: malformed edit list at byte %ld\n", (long)(j.p - patch));
+out:
+	free(key.data);
+	free(val.data);
+	return (r);
+}
+
+/*
+ * Read the "@@ -a[,b] +c[,d] @@" hunk header at p.  Returns 0, or -1
+ * if malformed.
+ */
+static int hunk_header(const char *p, long *ob, long *oc, long *nb, long *nc) {
+	char *q;
+
+	*ob = strtol(p + 4, &q, 10);
+	*oc = 1;
+	if (*q == ',')
+		*oc = strtol(q + 1, &q, 10);
+	if (strncmp(q, " +", 2) != 0)
+		return (-1);
+	*nb = strtol(q + 2, &q, 10);
+	*nc = 1;
+	if (*q == ',')
+		*nc = strtol(q + 1, &q, 10);
+	if (strncmp(q, " @@", 3) != 0 || *ob < 0 || *oc < 0 || *nb < 0 || *nc < 0)
+		return (-1);
+	return (0);
+}
+
+static int parse_diff(const char *t, size_t len, const char *patch, size_t plen, struct splice_list *sl) {
+	const char *p, *pe, *le, *nl, *text;
+	struct buf add, hdr;
+	size_t pos, tlen, chg;
+	long line, ob, oc, nb, nc, target;
+	int files, open, r;
+	char mark;
+
+	p = patch;
+	pe = patch + plen;
+	pos = 0;
+	line = 1;
+	files = 0;
+	r = -1;
+	buf_init(&add);
+	buf_init(&hdr);
+	while (p < pe) {
+		nl = memchr(p, '\n', (size_t)(pe - p));
+		le = nl != NULL ? nl + 1 : pe;
+		if (le - p >= 4 && strncmp(p, "--- ", 4) == 0) {
+			if (++files > 1) {
+				fprintf(stderr, "patch: changes more than one file\n");
+				goto out;
+			}
+			p = le;
+			continue;
+		}
+		if (le - p < 4 || strncmp(p, "@@ -", 4) != 0) {
+			p = le;
+			continue;
+		}
+
+		/* hunk_header reads a NUL-terminated copy of the line */
+		hdr.len = 0;
+		buf_append(&hdr, p, (size_t)(le - p));
+		hdr.data[hdr.len] = '\0';
+		if (hunk_header(hdr.data, &ob, &oc, &nb, &nc) != 0) {
+			fprintf(stderr, "patch: malformed hunk header: %.*s", (int)(le - p), p);
+			goto out;
+		}
+		target = oc == 0 ? ob + 1 : ob;
+		if (target < line) {
+			fprintf(stderr, "patch: hunk at line %ld overlaps the one before\n", ob);
+			goto out;
+		}
+		for (; line < target; line++) {
+			if (pos >= len) {
+				fprintf(stderr, "patch: hunk at line %ld is past the end of the input\n", ob);
+				goto out;
+			}
+			pos = line_end(t, len, pos);
+		}
+		p = le;
+
+		open = 0;
+		chg = 0;
+		add.len = 0;
+		while (oc > 0 || nc > 0) {
+			if (p >= pe) {
+				fprintf(stderr, "patch: hunk at line %ld is cut short\n", ob);
+				goto out;
+			}
+			nl = memchr(p, '\n', (size_t)(pe - p));
+			le = nl != NULL ? nl + 1 : pe;
+			/* An empty line is context whose space was trimmed */
+			mark = *p == '\n' ? ' ' : *p;
+			text = *p == '\n' ? p : p + 1;
+			tlen = (size_t)(le - text);
+			if (le < pe && *le == '\\') {
+				if (tlen > 0 && text[tlen - 1] == '\n')
+					tlen--;
+				nl = memchr(le, '\n', (size_t)(pe - le));
+				le = nl != NULL ? nl + 1 : pe;
+			}
+			if (mark == ' ' || mark == '-') {
+				if (oc == 0 || (mark == ' ' && nc == 0) || tlen > len - pos ||
+				    memcmp(t + pos, text, tlen) != 0) {
+					fprintf(stderr, "patch: hunk at line %ld does not match the input at line %ld\n",
+					    ob, line);
+					goto out;
+				}
+				if (mark == ' ' && open) {
+					splice_add(sl, chg, pos, add.data, add.len);
+					add.len = 0;
+					open = 0;
+				}
+				else if (mark == '-' && !open) {
+					chg = pos;
+					open = 1;
+				}
+				pos += tlen;
+				line++;
+				oc--;
+				if (mark == ' ')
+					nc--;
+			}
+			else if (mark == '+' && nc > 0) {
+				if (!open) {
+					chg = pos;
+					open = 1;
+				}
+				buf_append(&add, text, tlen);
+				nc--;
+			}
+			else {
+				fprintf(stderr, "patch: malformed line in hunk at line %ld: %.*s", ob,
+				    (int)(le - p), p);
+				goto out;
+			}
+			p = le;
+		}
+		if (open)
+			splice_add(sl, chg, pos, add.data, add.len);
+	}
+	r = 0;
+out:
+	free(add.data);
+	free(hdr.data);
+	return (r);
+}
+
+int patch_parse(const char *t, size_t len, const char *patch, size_t plen, struct splice_list *sl) {
+	const char *p;
+
+	for (p = patch; p < patch + plen && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'); p++)
+		continue;
+	if (p < patch + plen && *p == '{')
+		return (parse_edits(t, len, patch, plen, sl));
+	return (parse_diff(t, len, patch, plen, sl));
+}
@@ -0,0 +1,65 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <stddef.h>
+
+struct buf;
+struct splice_list;
+
+/* Lines of context around each hunk of a unified diff */
+#define PATCH_CONTEXT 3
+
+/* Size of a patch_sha256() digest: 64 hex digits and a NUL */
+#define PATCH_SHA256_LEN 65
+
+/*
+ * Append the edits to text as a unified diff of name, the way
+ * diff -u labels a/name and b/name.  Nothing is appended if there
+ * are no edits.
+ */
+void patch_diff(
+	const struct splice_list *,
+	const char *,
+	size_t,
+	const char *,
+	struct buf *
+);
+
+/*
+ * Append the edits to text as one line of JSON: the name, the
+ * SHA-256 of the text they apply to and, for each edit, its byte
+ * offset, the length it replaces and the replacement.
+ */
+void patch_edits(
+	const struct splice_list *,
+	const char *,
+	size_t,
+	const char *,
+	struct buf *
+);
+
+/*
+ * Parse a patch from patch_diff() or patch_edits() into the edits it
+ * makes to text, checking that it applies: context and removed lines
+ * must match, and an edit list's SHA-256 must be the text's.
+ * Returns 0 on success, -1 (after printing why) on error.
+ */
+int patch_parse(
+	const char *,
+	size_t,
+	const char *,
+	size_t,
+	struct splice_list *
+);
+
+/*
+ * Write the hex SHA-256 of text, as recorded in an edit list, to a
+ * buffer of PATCH_SHA256_LEN bytes.
+ */
+void patch_sha256(
+	const char *,
+	size_t,
+	char *
+);
+
+#endif
@@ -1,11 +1,28 @@
+/* memmem() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include "config.h"
 
+#include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "vcc_compile.h"
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+#include "token.h"
+#include "index.h"
 #include "pattern.h"
 
+struct pat_regex {
+	char *text;
+	pcre2_code *code;
+	pcre2_match_data *md;
+};
+
 static int tokens_equal(const struct token *a, const struct token *b) {
 	size_t alen = a->e - a->b;
 	size_t blen = b->e - b->b;
@@ -55,9 +72,192 @@ int match_bare_capture(struct token *t, int *idx, struct token **skip) {
 	return (1);
 }
 
-char *preprocess_wildcards(const char *text) {
+static unsigned token_kind(const char *name, size_t len) {
+	unsigned u;
+
+	if (len == 7 && memcmp(name, "COMMENT", 7) == 0)
+		return (COMMENT);
+	for (u = 0; u < 256; u++) {
+		if (vcl_tnames[u] != NULL && strlen(vcl_tnames[u]) == len &&
+		    memcmp(vcl_tnames[u], name, len) == 0)
+			return (u);
+	}
+	return (0);
+}
+
+static int parse_count(const char *text, size_t *n) {
+	int v;
+
+	if (text[*n] < '0' || text[*n] > '9')
+		return (-1);
+	v = 0;
+	while (text[*n] >= '0' && text[*n] <= '9') {
+		if (v < 1000000)
+			v = v * 10 + (text[*n] - '0');
+		(*n)++;
+	}
+	return (v);
+}
+
+/*
+ * Parse a {min,max} span bound after a ***.  Accepts {n}, {n,},
+ * {,m} and {n,m}.  Anything that isn't a well-formed bound is left
+ * alone as literal text.  Returns the number of characters consumed.
+ */
+static int parse_span_bound(const char *text, struct wildcard_spec *spec) {
+	size_t n;
+	int min, max;
+
+	if (text[0] != '{')
+		return (0);
+	n = 1;
+	min = 0;
+	max = -1;
+	if (text[n] != ',') {
+		min = parse_count(text, &n);
+		if (min < 0)
+			return (0);
+		max = min;
+	}
+	if (text[n] == ',') {
+		n++;
+		max = -1;
+		if (text[n] != '}') {
+			max = parse_count(text, &n);
+			if (max < 0)
+				return (0);
+		}
+	}
+	else if (n == 1) {
+		return (0);
+	}
+	if (text[n] != '}')
+		return (0);
+	if (max >= 0 && max < min) {
+		fprintf(stderr, "pattern error: empty span bound: ***%.*s\n", (int)(n + 1), text);
+		return (-1);
+	}
+	spec->min = min;
+	spec->max = max;
+	return ((int)(n + 1));
+}
+
+static int parse_kind(const char *text, struct wildcard_spec *spec) {
+	size_t n;
+
+	if (text[0] != ':')
+		return (0);
+	n = 1;
+	while (isalpha((unsigned char)text[n]) || text[n] == '_')
+		n++;
+	spec->kind = token_kind(text + 1, n - 1);
+	if (spec->kind == 0) {
+		fprintf(stderr, "pattern error: unknown token kind: %.*s\n", (int)(n - 1), text + 1);
+		return (-1);
+	}
+	return ((int)n);
+}
+
+static struct pat_regex *regex_compile(const char *text) {
+	struct pat_regex *re;
+	PCRE2_UCHAR msg[256];
+	PCRE2_SIZE erroff;
+	int err;
+
+	re = calloc(1, sizeof(*re));
+	re->text = strdup(text);
+	re->code = pcre2_compile((PCRE2_SPTR)text, PCRE2_ZERO_TERMINATED,
+	    0, &err, &erroff, NULL);
+	if (re->code == NULL) {
+		pcre2_get_error_message(err, msg, sizeof(msg));
+		fprintf(stderr, "pattern error: bad regex /%s/ at offset %d: %s\n",
+		    text, (int)erroff, (const char *)msg);
+		free(re->text);
+		free(re);
+		return (NULL);
+	}
+	/* JIT is an optimization; the interpreter is used if it fails */
+	(void)pcre2_jit_compile(re->code, PCRE2_JIT_COMPLETE);
+	re->md = pcre2_match_data_create_from_pattern(re->code, NULL);
+	return (re);
+}
+
+static int regex_match(const struct pat_regex *re, const char *b, const char *e) {
+	if (b == NULL)
+		b = e = "";
+	return (pcre2_match(re->code, (PCRE2_SPTR)b, (PCRE2_SIZE)(e - b),
+	    0, 0, re->md, NULL) >= 0);
+}
+
+void pat_regex_free(struct pat_regex *re) {
+	if (re == NULL)
+		return;
+	pcre2_match_data_free(re->md);
+	pcre2_code_free(re->code);
+	free(re->text);
+	free(re);
+}
+
+const char *pat_regex_text(const struct pat_regex *re) {
+	return (re->text);
+}
+
+/*
+ * Parse a ~/regex/ predicate.  \/ stands for a literal /; other
+ * escapes are passed to pcre2 unchanged.
+ * Returns the number of characters consumed, -1 on error.
+ */
+static int parse_regex(const char *text, struct wildcard_spec *spec) {
+	size_t n, len;
+	char *rx;
+
+	if (text[0] != '~' || text[1] != '/')
+		return (0);
+	rx = malloc(strlen(text));
+	len = 0;
+	for (n = 2; text[n] != '\0' && text[n] != '/'; n++) {
+		if (text[n] == '\\' && text[n + 1] == '/')
+			n++;
+		else if (text[n] == '\\' && text[n + 1] != '\0')
+			rx[len++] = text[n++];
+		rx[len++] = text[n];
+	}
+	rx[len] = '\0';
+	if (text[n] != '/') {
+		fprintf(stderr, "pattern error: unterminated regex: %s\n", text);
+		free(rx);
+		return (-1);
+	}
+	spec->re = regex_compile(rx);
+	free(rx);
+	if (spec->re == NULL)
+		return (-1);
+	return ((int)(n + 1));
+}
+
+/*
+ * Parse the suffix of the wildcard ending just before text: :KIND
+ * for **, {min,max} for ***, then an optional ~/regex/ for either.
+ * Returns the number of characters consumed, -1 on error.
+ */
+static int parse_wildcard_suffix(const char *text, int is_triple, struct wildcard_spec *spec) {
+	int n, r;
+
+	if (is_triple)
+		n = parse_span_bound(text, spec);
+	else
+		n = parse_kind(text, spec);
+	if (n < 0)
+		return (-1);
+	r = parse_regex(text + n, spec);
+	if (r < 0)
+		return (-1);
+	return (n + r);
+}
+
+char *preprocess_wildcards(const char *text, struct wildcard_spec *specs, int *nspecs) {
 	size_t len, i, oi, count, g;
-	int in_str, pairs, has_triple;
+	int in_str, pairs, has_triple, nw, w, r;
 	char *out;
 
 	len = strlen(text);
@@ -66,6 +266,7 @@ char *preprocess_wildcards(const char *text) {
 		return (NULL);
 	oi = 0;
 	in_str = 0;
+	nw = 0;
 	for (i = 0; i < len; i++) {
 		if (text[i] == '"')
 			in_str = !in_str;
@@ -105,6 +306,35 @@ char *preprocess_wildcards(const char *text) {
 				out[oi++] = ' ';
 				out[oi++] = '*';
 			}
+			if (specs != NULL) {
+				/* Record specs; a suffix applies to the last wildcard */
+				for (w = 0; w < pairs + has_triple; w++, nw++) {
+					if (nw < MAX_PATTERN) {
+						specs[nw].kind = 0;
+						specs[nw].min = 0;
+						specs[nw].max = -1;
+						specs[nw].re = NULL;
+					}
+				}
+				r = 0;
+				if (nw <= MAX_PATTERN)
+					r = parse_wildcard_suffix(text + i + count, has_triple, &specs[nw - 1]);
+				if (r == 0 && has_triple && text[i + count] == ':') {
+					for (g = 1; isalpha((unsigned char)text[i + count + g]) ||
+					    text[i + count + g] == '_'; g++)
+						;
+					fprintf(stderr, "pattern error: *** cannot be typed: ***%.*s\n",
+					    (int)g, text + i + count);
+					r = -1;
+				}
+				if (r < 0) {
+					for (w = 0; w < nw && w < MAX_PATTERN; w++)
+						pat_regex_free(specs[w].re);
+					free(out);
+					return (NULL);
+				}
+				count += r;
+			}
 			if (i + count < len && text[i + count] != ' ' && text[i + count] != '\t')
 				out[oi++] = ' ';
 			i += count - 1;
@@ -119,14 +349,39 @@ char *preprocess_wildcards(const char *text) {
 		out[oi++] = text[i];
 	}
 	out[oi] = '\0';
+	if (nspecs != NULL)
+		*nspecs = nw;
 	return (out);
 }
 
-int build_pattern(struct source *src, struct token **pat) {
+static int add_elem(struct pat_elem *pat, int n, int type, struct token *t,
+    const struct wildcard_spec *specs, int nspecs, int *nw) {
+	if (n < 0 || n >= MAX_PATTERN)
+		return (-1);
+	pat[n].type = type;
+	pat[n].tok = t;
+	pat[n].kind = 0;
+	pat[n].min = 0;
+	pat[n].max = -1;
+	pat[n].re = NULL;
+	if (type != PAT_LITERAL) {
+		if (specs != NULL && *nw < nspecs) {
+			pat[n].kind = specs[*nw].kind;
+			pat[n].min = specs[*nw].min;
+			pat[n].max = specs[*nw].max;
+			pat[n].re = specs[*nw].re;
+		}
+		(*nw)++;
+	}
+	return (n + 1);
+}
+
+int build_pattern(struct source *src, const struct wildcard_spec *specs, int nspecs, struct pat_elem *pat) {
 	struct token *t, *scan;
-	int n, star_count, pairs, has_triple, g;
+	int n, nw, star_count, pairs, has_triple, g;
 
 	n = 0;
+	nw = 0;
 	for (t = VTAILQ_FIRST(&src->src_tokens); t != NULL; t = VTAILQ_NEXT(t, src_list)) {
 		if (t->tok == EOI)
 			break;
@@ -146,22 +401,82 @@ int build_pattern(struct source *src, struct token **pat) {
 				pairs = star_count / 2;
 			}
 			for (g = 0; g < pairs; g++)
-				pat[n++] = NULL;
+				n = add_elem(pat, n, PAT_ANY, NULL, specs, nspecs, &nw);
 			if (has_triple)
-				pat[n++] = MULTI_WILDCARD;
+				n = add_elem(pat, n, PAT_MULTI, NULL, specs, nspecs, &nw);
 			if (star_count == 1)
-				pat[n++] = t;
+				n = add_elem(pat, n, PAT_LITERAL, t, specs, nspecs, &nw);
 			/* Advance t to last star token */
 			for (g = 1; g < star_count; g++)
 				t = VTAILQ_NEXT(t, src_list);
 			continue;
 		}
-		pat[n++] = t;
+		n = add_elem(pat, n, PAT_LITERAL, t, specs, nspecs, &nw);
 	}
 	return (n);
 }
 
-int pattern_match(struct token *t, struct token **pat, int npat, struct capture *caps, int *ncaps) {
+static int wildcard_accepts(const struct pat_elem *p, const struct token *t) {
+	if (p->kind != 0 && t->tok != p->kind)
+		return (0);
+	if (p->re != NULL && !regex_match(p->re, t->b, t->e))
+		return (0);
+	return (1);
+}
+
+/* Per thread, so grep workers each run their own budget */
+static _Thread_local unsigned long match_steps;
+static _Thread_local unsigned long match_max_steps = MATCH_MAX_STEPS;
+static _Thread_local const char *match_budget_pattern;
+static _Thread_local int match_end_seen;
+
+/*
+ * Count one matcher step.  Returns nonzero once the budget is spent.
+ */
+static int match_step(void) {
+	return (++match_steps > match_max_steps);
+}
+
+static void budget_blame(const struct pattern *pat) {
+	if (match_budget_pattern == NULL)
+		match_budget_pattern = pat->source != NULL ? pat->source : "";
+}
+
+void match_budget_reset(unsigned long max_steps) {
+	match_steps = 0;
+	match_max_steps = max_steps > 0 ? max_steps : (unsigned long)-1;
+	match_budget_pattern = NULL;
+}
+
+const char *match_budget_exceeded(void) {
+	return (match_budget_pattern);
+}
+
+void match_end_reset(void) {
+	match_end_seen = 0;
+}
+
+int match_end_reached(void) {
+	return (match_end_seen);
+}
+
+/*
+ * Note that a match looked at t, so its outcome depends on whether
+ * the input ends there.
+ */
+static int saw_end(const struct token *t) {
+	if (t != NULL && t->tok == EOI)
+		match_end_seen = 1;
+	return (t == NULL || t->tok == EOI);
+}
+
+static int at_end(const struct token *t, const struct token *end) {
+	return (t == end || saw_end(t));
+}
+
+int pattern_match(
+    struct token *t, const struct pat_elem *pat, int npat,
+    struct capture *caps, int *ncaps, struct token *end) {
 	struct token *cur, *try_cur;
 	struct capture rest_caps[MAX_CAPTURES];
 	const char *cap_start, *cap_end;
@@ -172,20 +487,27 @@ int pattern_match(struct token *t, struct token **pat, int npat, struct capture
 	consumed = 0;
 	*ncaps = 0;
 	for (i = 0; i < npat; i++) {
-		if (pat[i] == MULTI_WILDCARD) {
+		if (match_step())
+			return (-1);
+		if (pat[i].type == PAT_MULTI) {
 			saved_ncaps = *ncaps;
 			if (i + 1 >= npat) {
-				/* Last in pattern: match to EOI */
+				/* Last in pattern: match to EOI or the bound */
 				cap_start = NULL;
 				cap_end = NULL;
 				extra = 0;
-				if (cur != NULL && cur->tok != EOI)
+				if (!at_end(cur, end) && pat[i].max != 0)
 					cap_start = cur->b;
-				while (cur != NULL && cur->tok != EOI) {
+				while (!at_end(cur, end) &&
+				    (pat[i].max < 0 || extra < pat[i].max)) {
 					cap_end = cur->e;
 					cur = VTAILQ_NEXT(cur, src_list);
 					extra++;
 				}
+				if (extra < pat[i].min)
+					return (0);
+				if (pat[i].re != NULL && !regex_match(pat[i].re, cap_start, cap_end))
+					return (0);
 				caps[*ncaps].start = cap_start;
 				caps[*ncaps].end = cap_end;
 				(*ncaps)++;
@@ -199,11 +521,14 @@ int pattern_match(struct token *t, struct token **pat, int npat, struct capture
 			try_cur = cur;
 			extra = 0;
 			for (;;) {
-				if (depth == 0) {
+				if (depth == 0 && extra >= pat[i].min) {
 					rest_ncaps = 0;
 					rest_matched = pattern_match(try_cur, pat + i + 1,
-					    npat - i - 1, rest_caps, &rest_ncaps);
-					if (rest_matched > 0) {
+					    npat - i - 1, rest_caps, &rest_ncaps, end);
+					if (rest_matched < 0)
+						return (-1);
+					if (rest_matched > 0 && (pat[i].re == NULL ||
+					    regex_match(pat[i].re, cap_start, cap_end))) {
 						caps[saved_ncaps].start = cap_start;
 						caps[saved_ncaps].end = cap_end;
 						*ncaps = saved_ncaps + 1;
@@ -213,8 +538,12 @@ int pattern_match(struct token *t, struct token **pat, int npat, struct capture
 						return (consumed);
 					}
 				}
-				if (try_cur == NULL || try_cur->tok == EOI || try_cur->tok == SOI)
+				if (at_end(try_cur, end) || try_cur->tok == SOI)
+					return (0);
+				if (pat[i].max >= 0 && extra >= pat[i].max)
 					return (0);
+				if (match_step())
+					return (-1);
 				if (cap_start == NULL)
 					cap_start = try_cur->b;
 				cap_end = try_cur->e;
@@ -229,9 +558,11 @@ int pattern_match(struct token *t, struct token **pat, int npat, struct capture
 				extra++;
 			}
 		}
-		else if (pat[i] == NULL) {
+		else if (pat[i].type == PAT_ANY) {
 			/* Single wildcard: match exactly one token */
-			if (cur == NULL || cur->tok == EOI || cur->tok == SOI)
+			if (at_end(cur, end) || cur->tok == SOI)
+				return (0);
+			if (!wildcard_accepts(&pat[i], cur))
 				return (0);
 			caps[*ncaps].start = cur->b;
 			caps[*ncaps].end = cur->e;
@@ -240,9 +571,10 @@ int pattern_match(struct token *t, struct token **pat, int npat, struct capture
 			consumed++;
 		}
 		else {
-			if (cur == NULL)
+			if (cur == NULL || cur == end)
 				return (0);
-			if (!tokens_equal(cur, pat[i]))
+			saw_end(cur);
+			if (!tokens_equal(cur, pat[i].tok))
 				return (0);
 			cur = VTAILQ_NEXT(cur, src_list);
 			consumed++;
@@ -285,7 +617,7 @@ void substitute_captures(
 }
 
 void fixup_gap_captures(
-    struct token *start, struct token **pat, int npat,
+    struct token *start, const struct pat_elem *pat, int npat,
     struct capture *caps, int ncaps) {
 	struct token *cur;
 	const char *prev_e;
@@ -296,7 +628,7 @@ void fixup_gap_captures(
 	prev_e = NULL;
 
 	for (pi = 0; pi < npat && ci < ncaps; pi++) {
-		if (pat[pi] == MULTI_WILDCARD) {
+		if (pat[pi].type == PAT_MULTI) {
 			if (caps[ci].start == NULL) {
 				/* Zero tokens matched -- capture the gap */
 				if (prev_e != NULL) {
@@ -324,7 +656,7 @@ void fixup_gap_captures(
 			}
 			ci++;
 		}
-		else if (pat[pi] == NULL) {
+		else if (pat[pi].type == PAT_ANY) {
 			if (cur != NULL && cur->tok != EOI) {
 				prev_e = cur->e;
 				cur = VTAILQ_NEXT(cur, src_list);
@@ -340,23 +672,21 @@ void fixup_gap_captures(
 	}
 }
 
-int tokens_match_before(struct token *t, struct source *pat) {
-	struct token *arr[128];
+int tokens_match_before(struct token *t, const struct pattern *pat) {
+	const struct pat_elem *arr;
 	struct capture caps[MAX_CAPTURES];
 	struct token *cur, *last;
 	int n, i, ncaps, matched, has_multi;
 
-	if (pat == NULL)
-		return (1);
-
-	n = build_pattern(pat, arr);
-	if (n == 0)
+	if (pat == NULL || pat->n == 0)
 		return (1);
+	arr = pat->elem;
+	n = pat->n;
 
-	/* Check if pattern has MULTI_WILDCARD */
+	/* Check if pattern has a *** wildcard */
 	has_multi = 0;
 	for (i = 0; i < n; i++) {
-		if (arr[i] == MULTI_WILDCARD) {
+		if (arr[i].type == PAT_MULTI) {
 			has_multi = 1;
 			break;
 		}
@@ -366,14 +696,20 @@ int tokens_match_before(struct token *t, struct source *pat) {
 		/* Simple backward check */
 		cur = t;
 		for (i = n - 1; i >= 0; i--) {
+			if (match_step()) {
+				budget_blame(pat);
+				return (-1);
+			}
 			if (cur == NULL)
 				return (0);
-			if (arr[i] == NULL) {
+			if (arr[i].type == PAT_ANY) {
 				/* ** wildcard: skip boundary tokens */
 				if (cur->tok == SOI)
 					return (0);
+				if (!wildcard_accepts(&arr[i], cur))
+					return (0);
 			}
-			else if (!tokens_equal(cur, arr[i]))
+			else if (!tokens_equal(cur, arr[i].tok))
 				return (0);
 			cur = VTAILQ_PREV(cur, tokenhead, src_list);
 		}
@@ -388,7 +724,11 @@ int tokens_match_before(struct token *t, struct source *pat) {
 	cur = t;
 	for (i = 0; i < 256 && cur != NULL; i++) {
 		ncaps = 0;
-		matched = pattern_match(cur, arr, n, caps, &ncaps);
+		matched = pattern_match(cur, arr, n, caps, &ncaps, NULL);
+		if (matched < 0) {
+			budget_blame(pat);
+			return (-1);
+		}
 		if (matched > 0) {
 			last = cur;
 			for (int j = 1; j < matched; j++)
@@ -396,7 +736,7 @@ int tokens_match_before(struct token *t, struct source *pat) {
 			if (last == t)
 				return (1);
 			/* Pattern ends with *** and consumed past t */
-			if (arr[n - 1] == MULTI_WILDCARD && last != NULL &&
+			if (arr[n - 1].type == PAT_MULTI && last != NULL &&
 			    last->b >= t->b)
 				return (1);
 		}
@@ -405,48 +745,371 @@ int tokens_match_before(struct token *t, struct source *pat) {
 	return (0);
 }
 
-int tokens_match_after(struct token *t, struct source *pat) {
-	struct token *arr[128];
+int tokens_match_after(struct token *t, const struct pattern *pat) {
 	struct capture caps[MAX_CAPTURES];
-	int n, ncaps;
-
-	if (pat == NULL)
-		return (1);
+	int ncaps, matched;
 
-	n = build_pattern(pat, arr);
-	if (n == 0)
+	if (pat == NULL || pat->n == 0)
 		return (1);
 
 	ncaps = 0;
-	return (pattern_match(t, arr, n, caps, &ncaps) > 0);
+	matched = pattern_match(t, pat->elem, pat->n, caps, &ncaps, NULL);
+	if (matched < 0) {
+		budget_blame(pat);
+		return (-1);
+	}
+	return (matched > 0);
 }
 
 int try_pattern_match(
-    struct token *t, struct token *prev,
-    struct token **from_pat, int from_npat,
-    struct source *look_behind_src, struct source *look_ahead_src,
-    struct capture *caps, int *ncaps) {
+    struct token *t, struct token *prev, const struct pattern *from,
+    const struct pattern *look_behind, const struct pattern *look_ahead,
+    struct capture *caps, int *ncaps, struct token *end) {
+	const struct pat_elem *first;
 	struct token *after;
-	int matched, i;
+	int matched, ok, i;
+
+	first = &from->elem[0];
+
+	if (!plan_candidate(from, t) || !plan_candidate(look_behind, t))
+		return (0);
+
+	/* Typed leading wildcard: reject on token kind alone */
+	if (first->type == PAT_ANY && first->kind != 0 && t->tok != first->kind)
+		return (0);
 
 	/* Dot-boundary guard */
-	if (from_pat[0] != NULL && from_pat[0] != MULTI_WILDCARD &&
-		from_pat[0]->tok == '.' && prev != NULL &&
+	if (first->type == PAT_LITERAL &&
+		first->tok->tok == '.' && prev != NULL &&
 		prev->tok != '{' && prev->tok != ';')
 		return (0);
 
-	matched = pattern_match(t, from_pat, from_npat, caps, ncaps);
+	matched = pattern_match(t, from->elem, from->n, caps, ncaps, end);
+	if (matched < 0)
+		budget_blame(from);
 	if (matched <= 0)
-		return (0);
+		return (matched);
 
-	if (!tokens_match_before(prev, look_behind_src))
-		return (0);
+	ok = tokens_match_before(prev, look_behind);
+	if (ok <= 0)
+		return (ok);
 
 	after = t;
 	for (i = 0; i < matched; i++)
 		after = VTAILQ_NEXT(after, src_list);
-	if (!tokens_match_after(after, look_ahead_src))
-		return (0);
+	ok = tokens_match_after(after, look_ahead);
+	if (ok <= 0)
+		return (ok);
 
 	return (matched);
 }
+
+/*
+ * Token distance covered by the entries in [from, to): the sum of
+ * their minimum and maximum widths (*hi -1 when unbounded).
+ */
+static void elem_span(const struct pattern *pat, int from, int to, int *lo, int *hi) {
+	const struct pat_elem *e;
+	int i;
+
+	*lo = 0;
+	*hi = 0;
+	for (i = from; i < to; i++) {
+		e = &pat->elem[i];
+		if (e->type != PAT_MULTI) {
+			*lo += 1;
+			if (*hi >= 0)
+				*hi += 1;
+			continue;
+		}
+		*lo += e->min;
+		if (e->max < 0)
+			*hi = -1;
+		else if (*hi >= 0)
+			*hi += e->max;
+	}
+}
+
+static int span_width(int lo, int hi) {
+	return (hi < 0 ? 0x7fffffff : hi - lo);
+}
+
+void plan_pattern(struct pattern *pat, const struct src_index *idx, int dir) {
+	struct pat_plan *pl;
+	unsigned count;
+	int i, p, lo, hi, from, to, sum, *diff;
+
+	pl = &pat->plan;
+	free(pl->cand);
+	memset(pl, 0, sizeof(*pl));
+	pl->anchor = -1;
+	pl->npos = idx->n;
+	if (pat->n == 0 || idx->n == 0)
+		return;
+	if (dir == PLAN_BACKWARD && pat->elem[pat->n - 1].type == PAT_MULTI)
+		return;
+
+	for (i = 0; i < pat->n; i++) {
+		if (pat->elem[i].type != PAT_LITERAL)
+			continue;
+		count = source_index_count(idx, pat->elem[i].tok);
+		if (dir == PLAN_FORWARD)
+			elem_span(pat, 0, i, &lo, &hi);
+		else
+			elem_span(pat, i + 1, pat->n, &lo, &hi);
+		if (pl->anchor >= 0 && (count > pl->count || (count == pl->count &&
+		    span_width(lo, hi) >= span_width(pl->min_off, pl->max_off))))
+			continue;
+		pl->anchor = i;
+		pl->count = count;
+		pl->min_off = lo;
+		pl->max_off = hi;
+	}
+	if (pl->anchor < 0)
+		return;
+
+	/* Mark the reachable range around each anchor occurrence */
+	diff = calloc(idx->n + 1, sizeof(*diff));
+	for (p = 0; p < idx->n && pl->count > 0; p++) {
+		if (!tokens_equal(idx->tok[p], pat->elem[pl->anchor].tok))
+			continue;
+		if (dir == PLAN_FORWARD) {
+			from = pl->max_off < 0 ? 0 : p - pl->max_off;
+			to = p - pl->min_off;
+		}
+		else {
+			from = p + pl->min_off + 1;
+			to = pl->max_off < 0 ? idx->n - 1 : p + pl->max_off + 1;
+		}
+		if (from < 0)
+			from = 0;
+		if (to > idx->n - 1)
+			to = idx->n - 1;
+		if (from > to)
+			continue;
+		diff[from]++;
+		diff[to + 1]--;
+	}
+	pl->cand = malloc(idx->n);
+	sum = 0;
+	for (p = 0; p < idx->n; p++) {
+		sum += diff[p];
+		pl->cand[p] = sum > 0;
+		pl->ncand += sum > 0;
+	}
+	free(diff);
+}
+
+void plan_open_end(struct pattern *pat) {
+	struct pat_plan *pl;
+	int p;
+
+	if (pat == NULL || pat->plan.cand == NULL)
+		return;
+	pl = &pat->plan;
+	if (pl->max_off < 0) {
+		free(pl->cand);
+		pl->cand = NULL;
+		pl->ncand = pl->npos;
+		return;
+	}
+	/* An anchor at the EOI position or later reaches this far back */
+	for (p = pl->npos - 1 - pl->max_off; p < pl->npos; p++) {
+		if (p >= 0 && !pl->cand[p]) {
+			pl->cand[p] = 1;
+			pl->ncand++;
+		}
+	}
+}
+
+int plan_exhausted(const struct pattern *pat, const char *rest, size_t len) {
+	const struct pat_plan *pl;
+	const struct token *a;
+
+	if (pat == NULL || pat->plan.cand == NULL)
+		return (0);
+	pl = &pat->plan;
+	a = pat->elem[pl->anchor].tok;
+	if (a->e - a->b != 3 || memcmp(a->b, "SOI", 3) != 0)
+		return (0);
+	/* The SOI token at position 0 is the only occurrence */
+	return (pl->count == 1 && pl->max_off >= 0 &&
+	    pl->npos - 1 > pl->max_off + 1 && memmem(rest, len, "SOI", 3) == NULL);
+}
+
+int plan_candidate(const struct pattern *pat, const struct token *t) {
+	if (pat == NULL || pat->plan.cand == NULL)
+		return (1);
+	if (t->cnt >= (unsigned)pat->plan.npos)
+		return (1);
+	return (pat->plan.cand[t->cnt]);
+}
+
+static void print_plan_summary(FILE *f, const struct pattern *pat) {
+	const struct pat_plan *pl;
+	const struct token *a;
+
+	pl = &pat->plan;
+	if (pl->cand == NULL) {
+		fprintf(f, "scan, %d of %d positions\n", pl->npos, pl->npos);
+		return;
+	}
+	a = pat->elem[pl->anchor].tok;
+	fprintf(f, "anchor '%.*s' (entry %d, count %u, offset %d",
+	    (int)(a->e - a->b), a->b, pl->anchor + 1, pl->count, pl->min_off);
+	if (pl->max_off < 0)
+		fprintf(f, "..");
+	else if (pl->max_off != pl->min_off)
+		fprintf(f, "..%d", pl->max_off);
+	fprintf(f, "), %d of %d positions\n", pl->ncand, pl->npos);
+}
+
+void print_plan(const char *label, const struct pattern *pat) {
+	if (pat == NULL)
+		return;
+	fprintf(stderr, "plan: %s '%s': ", label, pat->source);
+	print_plan_summary(stderr, pat);
+}
+
+static const char *kind_name(unsigned kind) {
+	if (kind == COMMENT)
+		return ("COMMENT");
+	if (kind < 256 && vcl_tnames[kind] != NULL)
+		return (vcl_tnames[kind]);
+	return ("?");
+}
+
+void explain_pattern(const char *label, const struct pattern *pat, int captures) {
+	const struct pat_elem *e;
+	const struct token *t;
+	int i, ncap;
+
+	if (pat == NULL)
+		return;
+	printf("%s: '%s'\n", label, pat->source);
+	printf("  preprocessed: %s\n", pat->text);
+	printf("  entries:\n");
+	ncap = 0;
+	for (i = 0; i < pat->n; i++) {
+		e = &pat->elem[i];
+		printf("    %2d  ", i + 1);
+		if (e->type == PAT_LITERAL) {
+			t = e->tok;
+			printf("literal '%.*s'\n", (int)(t->e - t->b), t->b);
+			continue;
+		}
+		printf("%s", e->type == PAT_MULTI ? "***" : "**");
+		if (e->kind != 0)
+			printf(":%s", kind_name(e->kind));
+		if (e->type == PAT_MULTI && (e->min > 0 || e->max >= 0)) {
+			printf("{%d,", e->min);
+			if (e->max >= 0)
+				printf("%d", e->max);
+			printf("}");
+		}
+		if (e->re != NULL)
+			printf("~/%s/", pat_regex_text(e->re));
+		ncap++;
+		if (captures)
+			printf("  capture **%d", ncap);
+		printf("\n");
+	}
+
+	if (pat->n > 0 && pat->elem[0].type == PAT_ANY && pat->elem[0].kind != 0)
+		printf("  guard: leading **:%s is checked on token kind first\n",
+		    kind_name(pat->elem[0].kind));
+	if (pat->n > 0 && pat->elem[0].type == PAT_LITERAL &&
+	    pat->elem[0].tok->tok == '.')
+		printf("  guard: leading '.' only matches after '{' or ';'\n");
+	if (pat->n > 0 && pat->elem[pat->n - 1].type == PAT_MULTI)
+		printf("  trailing ***: runs to the end of input or scope\n");
+	printf("  plan: ");
+	print_plan_summary(stdout, pat);
+}
+
+int find_scopes(struct source *src, const struct pattern *within, struct scope **scopes) {
+	struct capture caps[MAX_CAPTURES];
+	struct token *t, *open, *close, *after;
+	int ncaps, matched, n, cap, depth, i;
+
+	*scopes = NULL;
+	if (within == NULL || within->n == 0)
+		return (0);
+
+	n = 0;
+	cap = 0;
+	for (t = VTAILQ_FIRST(&src->src_tokens); t != NULL; ) {
+		if (t->tok == EOI)
+			break;
+		if (t->tok == SOI || !plan_candidate(within, t)) {
+			t = VTAILQ_NEXT(t, src_list);
+			continue;
+		}
+		ncaps = 0;
+		matched = pattern_match(t, within->elem, within->n, caps, &ncaps, NULL);
+		if (matched < 0) {
+			budget_blame(within);
+			free(*scopes);
+			*scopes = NULL;
+			return (-1);
+		}
+		if (matched <= 0) {
+			t = VTAILQ_NEXT(t, src_list);
+			continue;
+		}
+
+		/* Opening brace: inside the match or right after it */
+		open = NULL;
+		after = t;
+		for (i = 0; i < matched && after != NULL; i++) {
+			if (open == NULL && after->tok == '{')
+				open = after;
+			after = VTAILQ_NEXT(after, src_list);
+		}
+		if (open == NULL && !saw_end(after) && after->tok == '{')
+			open = after;
+		if (open == NULL) {
+			t = VTAILQ_NEXT(t, src_list);
+			continue;
+		}
+
+		/* Closing brace: balance from the opening one */
+		depth = 0;
+		for (close = open; !saw_end(close);
+		    close = VTAILQ_NEXT(close, src_list)) {
+			if (close->tok == '{')
+				depth++;
+			else if (close->tok == '}' && --depth == 0)
+				break;
+		}
+		if (close == NULL || close->tok != '}')
+			break;
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 16;
+			*scopes = realloc(*scopes, cap * sizeof(**scopes));
+		}
+		(*scopes)[n].open = open;
+		(*scopes)[n].close = close;
+		n++;
+		t = VTAILQ_NEXT(close, src_list);
+	}
+	return (n);
+}
+
+const struct scope *scope_at(
+    const struct scope *scopes, int nscopes, int *idx,
+    const struct token *t, int incl_close) {
+	const struct scope *sc;
+
+	while (*idx < nscopes && scopes[*idx].close->b < t->b)
+		(*idx)++;
+	if (*idx >= nscopes)
+		return (NULL);
+	sc = &scopes[*idx];
+	if (t->b <= sc->open->b)
+		return (NULL);
+	if (t == sc->close && !incl_close)
+		return (NULL);
+	return (sc);
+}
@@ -2,57 +2,189 @@
 #define PATTERN_H
 
 #include <stddef.h>
+#include <stdio.h>
 
 #define SOI 200
 #define COMMENT 201
 #define MAX_CAPTURES 9
-#define MULTI_WILDCARD ((struct token *)1)
+#define MAX_PATTERN 128
+#define MATCH_MAX_STEPS 50000000UL
+
+#define PAT_LITERAL 0
+#define PAT_ANY 1
+#define PAT_MULTI 2
+
+#define PLAN_FORWARD 0
+#define PLAN_BACKWARD 1
 
 struct token;
 struct source;
+struct pat_regex;
+struct src_index;
+
+/*
+ * Constraints written after a wildcard in the pattern text, e.g.
+ * **:CSTR, ***{0,20} or **~/^"10\./.  One entry per wildcard, in
+ * pattern order.
+ */
+struct wildcard_spec {
+	unsigned kind;
+	int min;
+	int max;
+	struct pat_regex *re;
+};
+
+/*
+ * One compiled pattern entry: a literal token, a ** (PAT_ANY)
+ * or a *** (PAT_MULTI).  kind is the token kind a typed ** must
+ * have, 0 for any.  min/max bound the tokens a *** may consume
+ * (max -1 for unbounded).  re, if set, must match the text the
+ * wildcard captures.
+ */
+struct pat_elem {
+	int type;
+	struct token *tok;
+	unsigned kind;
+	int min;
+	int max;
+	struct pat_regex *re;
+};
+
+/*
+ * Match plan: where a pattern can possibly match, derived from its
+ * rarest literal (the anchor).  For a forward plan the anchor lies
+ * min_off..max_off tokens after the candidate position; for a
+ * backward plan (look-behind) it lies that many tokens before the
+ * last entry, which ends right before the candidate position.
+ * max_off is -1 when unbounded.  cand holds one byte per source
+ * position; it is NULL when there is no plan and every position is
+ * tried.
+ */
+struct pat_plan {
+	int anchor;
+	unsigned count;
+	int min_off;
+	int max_off;
+	int ncand;
+	int npos;
+	unsigned char *cand;
+};
+
+struct pattern {
+	const char *source;
+	char *text;
+	struct source *src;
+	struct pat_elem elem[MAX_PATTERN];
+	int n;
+	struct pat_plan plan;
+};
 
 struct capture {
 	const char *start;
 	const char *end;
 };
 
+struct scope {
+	struct token *open;
+	struct token *close;
+};
+
 /*
  * Pre-process a pattern string for safe VCL lexing:
  * - Space-separate bare * runs into individual * tokens.
  *   Star runs are parsed as: ** pairs left-to-right, remainder
  *   of 3 becomes ***, remainder of 1 is a literal *.
  * - Insert space between { and " to prevent VCL long string syntax.
+ * If specs is non-NULL, a :KIND suffix on a ** (e.g. **:ID) or a
+ * {min,max} suffix on a *** (e.g. ***{0,20}), optionally followed
+ * by a ~/regex/ predicate, is stripped and recorded in specs, one
+ * entry per wildcard; *nspecs receives the wildcard count.
+ * Regexes are compiled (with JIT) here and owned by the caller.
+ * Returns NULL on a malformed suffix.
  * Caller must free the returned string.
  */
 char *preprocess_wildcards(
-	const char *
+	const char *,
+	struct wildcard_spec *,
+	int *
+);
+
+/*
+ * Free a compiled regex predicate (NULL is allowed).
+ */
+void pat_regex_free(
+	struct pat_regex *
 );
 
 /*
- * Build a pattern array from a tokenized source.
- * pat[i] is the token pointer, NULL for a ** wildcard, or
- * MULTI_WILDCARD for a *** (zero-or-more) wildcard.
- * Returns the number of pattern entries.
+ * Return the source text of a compiled regex predicate.
+ */
+const char *pat_regex_text(
+	const struct pat_regex *
+);
+
+/*
+ * Build a pattern array from a tokenized source, applying the
+ * wildcard specs recorded by preprocess_wildcards (may be NULL).
+ * Returns the number of pattern entries, -1 if the pattern has
+ * more than MAX_PATTERN entries.
  */
 int build_pattern(
 	struct source *,
-	struct token **
+	const struct wildcard_spec *,
+	int,
+	struct pat_elem *
 );
 
 /*
  * Try to match a pattern against source tokens starting at t.
- * NULL entries in pat are ** wildcards matching exactly one token.
- * MULTI_WILDCARD entries are *** wildcards matching zero or more
- * tokens (non-greedy, depth-aware for balanced {}/()).
- * Each wildcard records a capture.
- * Returns number of source tokens consumed on match, 0 on no match.
+ * PAT_ANY entries are ** wildcards matching exactly one token,
+ * of the given kind if typed.  PAT_MULTI entries are *** wildcards
+ * matching min..max tokens (non-greedy, depth-aware for balanced
+ * {}/()); a trailing *** takes as many as it may, up to the end.
+ * Each wildcard records a capture.  Matching never consumes the
+ * end token or anything after it; pass NULL to match up to EOI.
+ * Every entry tried and every token a *** steps over counts
+ * against the match step budget.
+ * Returns number of source tokens consumed on match, 0 on no match,
+ * -1 if the step budget ran out.
  */
 int pattern_match(
 	struct token *,
-	struct token **,
+	const struct pat_elem *,
 	int,
 	struct capture *,
-	int *
+	int *,
+	struct token *
+);
+
+/*
+ * Reset the match step counter and set the budget shared by all
+ * following pattern_match calls (0 for unlimited).
+ */
+void match_budget_reset(
+	unsigned long
+);
+
+/*
+ * Return the source text of the pattern that ran out of match
+ * steps, or NULL if the budget has not been exceeded.
+ */
+const char *match_budget_exceeded(
+	void
+);
+
+/*
+ * Forget, or report, whether a pattern_match call since the last
+ * reset looked at the EOI token.  A match that didn't has the same
+ * outcome on any input that starts with the same tokens.
+ */
+void match_end_reset(
+	void
+);
+
+int match_end_reached(
+	void
 );
 
 /*
@@ -79,7 +211,7 @@ void substitute_captures(
  */
 void fixup_gap_captures(
 	struct token *,
-	struct token **,
+	const struct pat_elem *,
 	int,
 	struct capture *,
 	int
@@ -89,36 +221,134 @@ void fixup_gap_captures(
  * Check if the N tokens ending at t (walking backwards) match
  * all tokens in pat.  Returns 1 if pat is NULL (no constraint).
  * Supports ** and *** wildcards from build_pattern.
+ * Returns -1 if the step budget ran out.
  */
 int tokens_match_before(
 	struct token *,
-	struct source *
+	const struct pattern *
 );
 
 /*
  * Check if the N tokens starting at t (walking forward) match
  * all tokens in pat.  Returns 1 if pat is NULL (no constraint).
  * Supports ** and *** wildcards via pattern_match.
+ * Returns -1 if the step budget ran out.
  */
 int tokens_match_after(
 	struct token *,
-	struct source *
+	const struct pattern *
 );
 
 /*
- * Try to match a pattern at token t, checking the dot-boundary
- * guard and look-behind/look-ahead constraints.
- * Returns tokens consumed (>0) on match, 0 otherwise.
+ * Try to match a pattern at token t, checking the plans of the
+ * pattern and its look-behind, the leading typed wildcard, the
+ * dot-boundary guard and look-behind/look-ahead constraints.  The
+ * match must end before the end token (NULL for no bound).
+ * Returns tokens consumed (>0) on match, 0 otherwise, -1 if the
+ * step budget ran out.
  */
 int try_pattern_match(
 	struct token *,
 	struct token *,
-	struct token **,
-	int,
-	struct source *,
-	struct source *,
+	const struct pattern *,
+	const struct pattern *,
+	const struct pattern *,
 	struct capture *,
-	int *
+	int *,
+	struct token *
+);
+
+/*
+ * Plan where a pattern can match in an indexed source: pick the
+ * literal entry with the fewest occurrences and mark every position
+ * from which that occurrence is within reach.  PLAN_FORWARD plans a
+ * pattern matched from its start (from, --look-ahead, --within);
+ * PLAN_BACKWARD plans a --look-behind pattern, whose candidates are
+ * the positions right after its match.  Patterns with no literal,
+ * and look-behinds ending in ***, are left unplanned.
+ */
+void plan_pattern(
+	struct pattern *,
+	const struct src_index *,
+	int
+);
+
+/*
+ * Adjust a forward plan made on a prefix of the input: positions an
+ * anchor past the end of the prefix could reach become candidates
+ * (all of them if the reach is unbounded).  Backward plans only look
+ * at earlier anchors and need no adjustment.
+ */
+void plan_open_end(
+	struct pattern *
+);
+
+/*
+ * Return nonzero if a backward plan made on a prefix of the input is
+ * anchored on SOI, the prefix extends past its reach and the rest of
+ * the input (the text and length given) has no other "SOI", so no
+ * later position can be a candidate.
+ */
+int plan_exhausted(
+	const struct pattern *,
+	const char *,
+	size_t
+);
+
+/*
+ * Return nonzero if the plan allows a match at t (always for a
+ * NULL or unplanned pattern).
+ */
+int plan_candidate(
+	const struct pattern *,
+	const struct token *
+);
+
+/*
+ * Print a one-line summary of a pattern's plan to stderr.
+ */
+void print_plan(
+	const char *,
+	const struct pattern *
+);
+
+/*
+ * Print a compiled pattern to stdout for --explain: the source and
+ * preprocessed text, each entry (with capture numbers if captures
+ * is set), the guards try_pattern_match applies and the plan.
+ */
+void explain_pattern(
+	const char *,
+	const struct pattern *,
+	int
+);
+
+/*
+ * Find the brace-delimited bodies of blocks matching a --within
+ * pattern.  The opening { must be part of the match or the token
+ * right after it; the body runs to the balancing }.  Blocks nested
+ * inside an earlier scope are not reported separately.
+ * Returns the number of scopes; *scopes is malloc'd (caller frees).
+ * Returns -1 if the step budget ran out.
+ */
+int find_scopes(
+	struct source *,
+	const struct pattern *,
+	struct scope **
+);
+
+/*
+ * Return the scope whose body contains t, or NULL.  *idx is a
+ * cursor into the scope array and only moves forward, so callers
+ * must visit tokens in source order.  If incl_close is set, the
+ * closing } itself counts as inside (an insertion point).
+ */
+const struct scope *scope_at(
+	const struct scope *,
+	int,
+	int *,
+	const struct token *,
+	int
 );
 
 /*
@@ -0,0 +1,129 @@
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "buf.h"
+#include "tokfile.h"
+#include "splice.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+void splice_init(struct splice_list *sl) {
+	memset(sl, 0, sizeof(*sl));
+	buf_init(&sl->text);
+}
+
+void splice_add(struct splice_list *sl, size_t b, size_t e, const char *text, size_t len) {
+	struct splice *s;
+
+	if (sl->n == sl->cap) {
+		sl->cap = sl->cap > 0 ? sl->cap * 2 : 16;
+		sl->s = realloc(sl->s, sl->cap * sizeof(*sl->s));
+	}
+	s = &sl->s[sl->n++];
+	s->b = b;
+	s->e = e;
+	s->off = sl->text.len;
+	s->len = len;
+	buf_append(&sl->text, text, len);
+}
+
+/*
+ * Write iov[0, n) to fd, resuming after short writes.
+ */
+static void write_all(int fd, struct iovec *iov, int n) {
+	ssize_t w;
+
+	while (n > 0) {
+		w = writev(fd, iov, n > IOV_MAX ? IOV_MAX : n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return;
+		}
+		while (n > 0 && (size_t)w >= iov->iov_len) {
+			w -= (ssize_t)iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= (size_t)w;
+		}
+	}
+}
+
+int splice_check(const struct splice_list *sl, size_t len) {
+	size_t pos;
+	int i;
+
+	for (i = 0, pos = 0; i < sl->n; i++) {
+		if (sl->s[i].b < pos || sl->s[i].e < sl->s[i].b || sl->s[i].e > len) {
+			fprintf(stderr, "edit %d overlaps the one before or is past the end of the input\n",
+			    i + 1);
+			return (-1);
+		}
+		pos = sl->s[i].e;
+	}
+	return (0);
+}
+
+int splice_write(const struct splice_list *sl, const char *orig, size_t len, struct tok_sink *sink) {
+	struct iovec *iov;
+	size_t pos;
+	int i, n;
+
+	if (splice_check(sl, len) != 0)
+		return (-1);
+	if (sink != NULL) {
+		pos = 0;
+		for (i = 0; i < sl->n; i++) {
+			buf_append(&sink->text, orig + pos, sl->s[i].b - pos);
+			buf_append(&sink->text, sl->text.data + sl->s[i].off, sl->s[i].len);
+			pos = sl->s[i].e;
+		}
+		buf_append(&sink->text, orig + pos, len - pos);
+		/* The slices carry no token records: relex on write */
+		sink->inexact = 1;
+		return (0);
+	}
+
+	/* Untouched bytes come straight from the input, not a copy */
+	iov = malloc((2 * (size_t)sl->n + 1) * sizeof(*iov));
+	n = 0;
+	pos = 0;
+	for (i = 0; i < sl->n; i++) {
+		if (sl->s[i].b > pos) {
+			iov[n].iov_base = (char *)orig + pos;
+			iov[n++].iov_len = sl->s[i].b - pos;
+		}
+		if (sl->s[i].len > 0) {
+			iov[n].iov_base = sl->text.data + sl->s[i].off;
+			iov[n++].iov_len = sl->s[i].len;
+		}
+		pos = sl->s[i].e;
+	}
+	if (len > pos) {
+		iov[n].iov_base = (char *)orig + pos;
+		iov[n++].iov_len = len - pos;
+	}
+	fflush(stdout);
+	write_all(STDOUT_FILENO, iov, n);
+	free(iov);
+	return (0);
+}
+
+void splice_free(struct splice_list *sl) {
+	free(sl->s);
+	free(sl->text.data);
+	memset(sl, 0, sizeof(*sl));
+}
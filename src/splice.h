@@ -0,0 +1,79 @@
+#ifndef SPLICE_H
+#define SPLICE_H
+
+#include <stddef.h>
+
+#include "buf.h"
+
+struct tok_sink;
+
+/*
+ * One edit: bytes [b, e) of the original text are replaced by len
+ * bytes at off in the list's text.  An insert has b == e.
+ */
+struct splice {
+	size_t b;
+	size_t e;
+	size_t off;
+	size_t len;
+};
+
+/*
+ * Edits to a text, in order and not overlapping
+ * (--preserve-formatting).
+ */
+struct splice_list {
+	struct splice *s;
+	int n;
+	int cap;
+	struct buf text;
+};
+
+/*
+ * Initialize an empty edit list.
+ */
+void splice_init(
+	struct splice_list *
+);
+
+/*
+ * Add an edit replacing bytes [b, e) of the original with len bytes
+ * of text.  Edits must be added in order.
+ */
+void splice_add(
+	struct splice_list *,
+	size_t,
+	size_t,
+	const char *,
+	size_t
+);
+
+/*
+ * Check that the edits are in order, don't overlap and lie within a
+ * text of len bytes.  Returns 0, or -1 after printing which doesn't.
+ */
+int splice_check(
+	const struct splice_list *,
+	size_t
+);
+
+/*
+ * Write the original text with the edits applied: to the token sink
+ * if one is given, otherwise gathered onto stdout with writev().
+ * Returns 0, or -1 (writing nothing) if splice_check() fails.
+ */
+int splice_write(
+	const struct splice_list *,
+	const char *,
+	size_t,
+	struct tok_sink *
+);
+
+/*
+ * Free the memory held by an edit list.
+ */
+void splice_free(
+	struct splice_list *
+);
+
+#endif
@@ -0,0 +1,68 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "stream.h"
+
+void stream_init(struct stream *s, int fd) {
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+}
+
+int stream_next(struct stream *s, char **text, size_t *len, int *last) {
+	size_t pos, cut;
+	ssize_t n;
+
+	for (;;) {
+		/* Hand out every complete declaration buffered so far */
+		cut = 0;
+		pos = 0;
+		while (chunk_next_cut(s->buf, s->len, &pos))
+			cut = pos;
+		if (s->eof) {
+			if (s->done)
+				return (0);
+			s->done = 1;
+			cut = s->len;
+		}
+		if (cut > 0 || s->done) {
+			*text = malloc(cut + 1);
+			if (*text == NULL)
+				return (-1);
+			memcpy(*text, s->buf, cut);
+			(*text)[cut] = '\0';
+			*len = cut;
+			*last = s->done;
+			s->len -= cut;
+			memmove(s->buf, s->buf + cut, s->len);
+			return (1);
+		}
+
+		if (s->cap - s->len < STREAM_READ_BYTES) {
+			s->cap = 2 * (s->len + STREAM_READ_BYTES);
+			s->buf = realloc(s->buf, s->cap);
+			if (s->buf == NULL)
+				return (-1);
+		}
+		n = read(s->fd, s->buf + s->len, STREAM_READ_BYTES);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			return (-1);
+		}
+		if (n == 0)
+			s->eof = 1;
+		s->len += (size_t)n;
+	}
+}
+
+void stream_free(struct stream *s) {
+	free(s->buf);
+	memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,52 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+
+/* Bytes asked for per read() */
+#define STREAM_READ_BYTES (64 * 1024)
+
+/*
+ * Input read in pieces that end at top-level declaration boundaries
+ * (--stream).  Only the declaration still being read is buffered.
+ */
+struct stream {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t cap;
+	int eof;
+	int done;
+};
+
+/*
+ * Start reading from fd.
+ */
+void stream_init(
+	struct stream *,
+	int
+);
+
+/*
+ * Read until at least one complete top-level declaration is
+ * buffered, then hand out all complete ones as a malloc'd,
+ * NUL-terminated piece of text.  Its length goes to the second
+ * argument.  At end of input the rest (possibly nothing) is handed
+ * out once with the last flag set.
+ * Returns 1 for a piece, 0 after the last one, -1 on a read error.
+ */
+int stream_next(
+	struct stream *,
+	char **,
+	size_t *,
+	int *
+);
+
+/*
+ * Free the buffered input.
+ */
+void stream_free(
+	struct stream *
+);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include "vqueue.h"
+#include "vcc_token_defs.h"
+
+/*
+ * A token of a lexed source.  Kinds are libvcc's (vcc_token_defs.h)
+ * plus SOI, EOI and COMMENT; b and e bound its text.  This keeps only
+ * what vinyl-edit uses of libvcc's struct token: 40 bytes rather than
+ * 88, allocated in blocks by source_token().
+ */
+struct token {
+	VTAILQ_ENTRY(token) src_list;
+	const char *b;
+	const char *e;
+	unsigned tok;
+	unsigned cnt;		/* position, set by source_index_build() */
+};
+
+VTAILQ_HEAD(tokenhead, token);
+
+/*
+ * Text being edited and its tokens, made by source_new().  The text
+ * is the caller's unless freeit is set.
+ */
+struct source {
+	char *name;
+	const char *kind;
+	const char *b;
+	const char *e;
+	char *freeit;
+	struct tokenhead src_tokens;
+};
+
+#define PF(t) (int)((t)->e - (t)->b), (t)->b
+
+/* Token kind names, from libvcc */
+extern const char * const vcl_tnames[256];
+
+#endif
@@ -0,0 +1,127 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "token.h"
+#include "lex.h"
+#include "tokfile.h"
+
+void tok_sink_init(struct tok_sink *sink) {
+	memset(sink, 0, sizeof(*sink));
+	buf_init(&sink->text);
+}
+
+void tok_sink_record(struct tok_sink *sink, size_t off, size_t len, unsigned kind) {
+	struct tokfile_rec *r;
+
+	if (sink->nrec == sink->cap) {
+		sink->cap = sink->cap > 0 ? sink->cap * 2 : 256;
+		sink->rec = realloc(sink->rec, sink->cap * sizeof(*sink->rec));
+	}
+	r = &sink->rec[sink->nrec++];
+	r->off = (uint32_t)off;
+	r->len = (uint32_t)len;
+	r->kind = kind;
+	r->flags = 0;
+}
+
+void tok_sink_free(struct tok_sink *sink) {
+	free(sink->text.data);
+	free(sink->rec);
+	memset(sink, 0, sizeof(*sink));
+}
+
+/*
+ * Replace the sink's records with the tokens of its text as lexed
+ * by lex_source().
+ */
+static void tok_sink_relex(struct tok_sink *sink) {
+	struct source *sp;
+	struct token *t;
+
+	buf_appendc(&sink->text, '\0');
+	sink->text.len--;
+	sp = source_new(sink->text.data, "tokens", "tokens");
+	lex_source(sp);
+	sink->nrec = 0;
+	VTAILQ_FOREACH(t, &sp->src_tokens, src_list) {
+		if (t->tok == EOI)
+			break;
+		tok_sink_record(sink, (size_t)(t->b - sp->b), (size_t)(t->e - t->b), t->tok);
+	}
+	source_free(sp);
+	sink->inexact = 0;
+}
+
+int tokfile_write(FILE *f, struct tok_sink *sink) {
+	struct tokfile_hdr hdr;
+
+	if (sink->inexact)
+		tok_sink_relex(sink);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TOKFILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TOKFILE_VERSION;
+	hdr.ntok = sink->nrec;
+	hdr.text_len = (uint32_t)sink->text.len;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    (sink->nrec > 0 &&
+	    fwrite(sink->rec, sizeof(*sink->rec), sink->nrec, f) != sink->nrec) ||
+	    (sink->text.len > 0 &&
+	    fwrite(sink->text.data, 1, sink->text.len, f) != sink->text.len)) {
+		perror("write");
+		return (-1);
+	}
+	return (0);
+}
+
+struct source *tokfile_read(const char *buf, long len, const char *name) {
+	const struct tokfile_hdr *hdr;
+	const struct tokfile_rec *rec;
+	struct source *sp;
+	struct token *t;
+	const char *text;
+	uint32_t i, last;
+
+	hdr = (const struct tokfile_hdr *)buf;
+	if ((size_t)len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, TOKFILE_MAGIC, sizeof(hdr->magic)) != 0) {
+		fprintf(stderr, "%s: not a token stream\n", name);
+		return (NULL);
+	}
+	if (hdr->version != TOKFILE_VERSION) {
+		fprintf(stderr, "%s: unsupported token stream version %u\n", name, hdr->version);
+		return (NULL);
+	}
+	if ((size_t)len != sizeof(*hdr) + (size_t)hdr->ntok * sizeof(*rec) + hdr->text_len) {
+		fprintf(stderr, "%s: truncated token stream\n", name);
+		return (NULL);
+	}
+	rec = (const struct tokfile_rec *)(buf + sizeof(*hdr));
+	text = (const char *)(rec + hdr->ntok);
+	if (strlen(text) != hdr->text_len) {
+		fprintf(stderr, "%s: token stream text contains NUL\n", name);
+		return (NULL);
+	}
+
+	sp = source_new(text, "file", name);
+	last = 0;
+	for (i = 0; i < hdr->ntok; i++) {
+		if (rec[i].off < last || rec[i].off > hdr->text_len ||
+		    rec[i].len > hdr->text_len - rec[i].off ||
+		    rec[i].kind == EOI || rec[i].kind > 255) {
+			fprintf(stderr, "%s: bad token record %u\n", name, i);
+			source_free(sp);
+			return (NULL);
+		}
+		last = rec[i].off + rec[i].len;
+		t = source_token(sp, rec[i].kind, sp->b + rec[i].off,
+		    sp->b + rec[i].off + rec[i].len);
+		VTAILQ_INSERT_TAIL(&sp->src_tokens, t, src_list);
+	}
+	t = source_token(sp, EOI, sp->e, sp->e);
+	VTAILQ_INSERT_TAIL(&sp->src_tokens, t, src_list);
+	return (sp);
+}
@@ -0,0 +1,97 @@
+#ifndef TOKFILE_H
+#define TOKFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "buf.h"
+
+struct source;
+
+/*
+ * Binary token stream (--output-format tokens): a 16-byte header,
+ * ntok fixed-size records, then text_len bytes of source text.
+ * Records are in source order and hold byte offsets into the text;
+ * gaps between records are whitespace and comments.  All fields are
+ * native-endian so a reader can use the records in place.
+ */
+#define TOKFILE_MAGIC "VETK"
+#define TOKFILE_VERSION 1
+
+struct tokfile_hdr {
+	char magic[4];
+	uint32_t version;
+	uint32_t ntok;
+	uint32_t text_len;
+};
+
+struct tokfile_rec {
+	uint32_t off;
+	uint32_t len;
+	uint32_t kind;
+	uint32_t flags;
+};
+
+/*
+ * Output sink for the formatter: the rendered text plus the token
+ * records noted while rendering it.  inexact is set when text was
+ * written that does not map one-to-one onto recorded tokens (raw
+ * replacements, capture substitutions); the text is then lexed
+ * again when the stream is written.
+ */
+struct tok_sink {
+	struct buf text;
+	struct tokfile_rec *rec;
+	uint32_t nrec;
+	uint32_t cap;
+	int inexact;
+};
+
+/*
+ * Initialize an empty sink.
+ */
+void tok_sink_init(
+	struct tok_sink *
+);
+
+/*
+ * Record a token of the given kind at offset/length in the sink text.
+ */
+void tok_sink_record(
+	struct tok_sink *,
+	size_t,
+	size_t,
+	unsigned
+);
+
+/*
+ * Free the memory held by a sink.
+ */
+void tok_sink_free(
+	struct tok_sink *
+);
+
+/*
+ * Write the sink as a binary token stream, lexing the text first
+ * if the records are inexact.
+ * Returns 0 on success, -1 on write error.
+ */
+int tokfile_write(
+	FILE *,
+	struct tok_sink *
+);
+
+/*
+ * Build a source from a binary token stream without lexing.  The
+ * buffer must stay alive and be NUL-terminated at buf[len].  The
+ * token list ends with an EOI token, as after lex_source().
+ * Returns the source, or NULL (with a message on stderr) if the
+ * stream is malformed.
+ */
+struct source *tokfile_read(
+	const char *,
+	long,
+	const char *
+);
+
+#endif
@@ -0,0 +1,407 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "token.h"
+#include "pattern.h"
+#include "lex.h"
+#include "tree.h"
+
+/* Next token after t, skipping comment tokens */
+static struct token *next_tok(struct token *t) {
+	do
+		t = VTAILQ_NEXT(t, src_list);
+	while (t != NULL && t->tok == COMMENT);
+	return (t);
+}
+
+static int tok_is(const struct token *t, const char *s) {
+	return (t != NULL && t->tok == ID && (size_t)(t->e - t->b) == strlen(s) &&
+	    memcmp(t->b, s, (size_t)(t->e - t->b)) == 0);
+}
+
+static int tok_eq(const struct token *a, const struct token *b) {
+	return (a->e - a->b == b->e - b->b &&
+	    memcmp(a->b, b->b, (size_t)(a->e - a->b)) == 0);
+}
+
+/*
+ * Set the key of an if or elseif to its condition: the tokens
+ * between the ( after kw and the ) before the opening brace.
+ */
+static void cond_key(struct block *bl, struct token *kw, struct token *last) {
+	struct token *p;
+
+	p = next_tok(kw);
+	if (p == NULL || p->tok != '(' || last->tok != ')' || last == p)
+		return;
+	bl->key = next_tok(p);
+	bl->key_end = last;
+}
+
+/*
+ * Work out what the statement starting at stmt and opening a block
+ * at open is.  last is the token before open, top is set at the top
+ * level.  Returns 1 and fills in bl if the block is a node.
+ */
+static int classify(struct block *bl, struct token *stmt, struct token *open, struct token *last, int top) {
+	struct token *t;
+
+	memset(bl, 0, sizeof(*bl));
+	bl->open = open;
+	bl->kw = stmt;
+	if (top) {
+		bl->type = BLOCK_DECL;
+		t = next_tok(stmt);
+		if (t != open) {
+			bl->key = t;
+			bl->key_end = open;
+		}
+		return (1);
+	}
+	if (tok_is(stmt, "if")) {
+		bl->type = BLOCK_IF;
+		cond_key(bl, stmt, last);
+		return (1);
+	}
+	if (tok_is(stmt, "elseif") || tok_is(stmt, "elsif") || tok_is(stmt, "elif")) {
+		bl->type = BLOCK_ELSEIF;
+		cond_key(bl, stmt, last);
+		return (1);
+	}
+	if (tok_is(stmt, "else")) {
+		t = next_tok(stmt);
+		if (t == open) {
+			bl->type = BLOCK_ELSE;
+			return (1);
+		}
+		if (tok_is(t, "if")) {
+			bl->type = BLOCK_ELSEIF;
+			cond_key(bl, t, last);
+			return (1);
+		}
+		return (0);
+	}
+	t = next_tok(stmt);
+	if (stmt->tok == '.' && t != NULL && t->tok == ID && last->tok == '=') {
+		bl->type = BLOCK_PROP;
+		bl->kw = t;
+		return (1);
+	}
+	return (0);
+}
+
+void block_tree_build(struct block_tree *bt, struct source *src) {
+	struct block bl;
+	struct token *t, *stmt, *last;
+	int *stack, depth, cap, owner, i;
+
+	memset(bt, 0, sizeof(*bt));
+	bt->root = -1;
+	/* Per open brace: its node, or -1 for a block that isn't one */
+	cap = 16;
+	stack = malloc(cap * sizeof(*stack));
+	depth = 0;
+	owner = -1;
+	stmt = NULL;
+	last = NULL;
+	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
+		if (t->tok == SOI || t->tok == COMMENT)
+			continue;
+		if (t->tok == EOI)
+			break;
+		if (stmt == NULL)
+			stmt = t;
+		if (t->tok == '{') {
+			if (depth == cap) {
+				cap *= 2;
+				stack = realloc(stack, cap * sizeof(*stack));
+			}
+			stack[depth] = -1;
+			if (stmt != t && classify(&bl, stmt, t, last, depth == 0)) {
+				if (bt->n == bt->cap) {
+					bt->cap = bt->cap > 0 ? bt->cap * 2 : 16;
+					bt->b = realloc(bt->b, bt->cap * sizeof(*bt->b));
+				}
+				bl.parent = owner;
+				bl.child = -1;
+				bl.next = -1;
+				owner = stack[depth] = bt->n;
+				bt->b[bt->n++] = bl;
+			}
+			depth++;
+			stmt = NULL;
+		}
+		else if (t->tok == '}') {
+			if (depth > 0 && stack[--depth] >= 0) {
+				bt->b[owner].close = t;
+				bt->b[owner].end = bt->n;
+				owner = bt->b[owner].parent;
+			}
+			stmt = NULL;
+		}
+		else if (t->tok == ';')
+			stmt = NULL;
+		last = t;
+	}
+	/* Blocks left open at the end of input */
+	while (depth > 0) {
+		if (stack[--depth] >= 0) {
+			bt->b[owner].end = bt->n;
+			owner = bt->b[owner].parent;
+		}
+	}
+	free(stack);
+
+	/* Link children in source order */
+	for (i = bt->n - 1; i >= 0; i--) {
+		if (bt->b[i].parent < 0) {
+			bt->b[i].next = bt->root;
+			bt->root = i;
+		}
+		else {
+			bt->b[i].next = bt->b[bt->b[i].parent].child;
+			bt->b[bt->b[i].parent].child = i;
+		}
+	}
+}
+
+void block_tree_free(struct block_tree *bt) {
+	free(bt->b);
+	memset(bt, 0, sizeof(*bt));
+	bt->root = -1;
+}
+
+/*
+ * Parse one step at *p into st.  Returns 0, or -1 on an error.
+ */
+static int parse_step(const char *text, const char **p, struct sel_step *st) {
+	const char *s, *b;
+	int depth, quote;
+
+	s = *p;
+	for (b = s; *s != '\0' && *s != '[' && *s != '>' &&
+	    *s != ' ' && *s != '\t'; s++)
+		continue;
+	if (s == b) {
+		fprintf(stderr, "selector error: missing block kind: %s\n", text);
+		return (-1);
+	}
+	st->kind = strndup(b, (size_t)(s - b));
+	if (strcmp(st->kind, "*") == 0)
+		st->type = -1;
+	else if (strcmp(st->kind, "if") == 0)
+		st->type = BLOCK_IF;
+	else if (strcmp(st->kind, "elseif") == 0 || strcmp(st->kind, "elsif") == 0 ||
+	    strcmp(st->kind, "elif") == 0)
+		st->type = BLOCK_ELSEIF;
+	else if (strcmp(st->kind, "else") == 0)
+		st->type = BLOCK_ELSE;
+	else if (st->kind[0] == '.' && st->kind[1] != '\0')
+		st->type = BLOCK_PROP;
+	else
+		st->type = BLOCK_DECL;
+
+	if (*s == '[') {
+		/* The argument runs to the balancing ], skipping strings */
+		b = ++s;
+		depth = 1;
+		quote = 0;
+		for (; *s != '\0'; s++) {
+			if (*s == '"')
+				quote = !quote;
+			else if (quote)
+				continue;
+			else if (*s == '[')
+				depth++;
+			else if (*s == ']' && --depth == 0)
+				break;
+		}
+		if (*s != ']') {
+			fprintf(stderr, "selector error: unterminated [: %s\n", text);
+			return (-1);
+		}
+		st->arg = strndup(b, (size_t)(s - b));
+		st->arg_src = source_new(st->arg, "select", "select");
+		lex_source(st->arg_src);
+		if (VTAILQ_FIRST(&st->arg_src->src_tokens)->tok == EOI) {
+			fprintf(stderr, "selector error: empty []: %s\n", text);
+			return (-1);
+		}
+		s++;
+	}
+	*p = s;
+	return (0);
+}
+
+int selector_compile(const char *text, struct selector **dst) {
+	struct selector *sel;
+	const char *p;
+	int cap, child;
+
+	*dst = NULL;
+	if (text == NULL)
+		return (0);
+	sel = calloc(1, sizeof(*sel));
+	sel->source = text;
+	cap = 0;
+	p = text;
+	for (;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		child = 0;
+		if (*p == '>') {
+			child = 1;
+			p++;
+			while (*p == ' ' || *p == '\t')
+				p++;
+		}
+		if (*p == '\0' && !child && sel->n > 0)
+			break;
+		if (sel->n == cap) {
+			cap = cap > 0 ? cap * 2 : 4;
+			sel->step = realloc(sel->step, cap * sizeof(*sel->step));
+		}
+		memset(&sel->step[sel->n], 0, sizeof(*sel->step));
+		sel->step[sel->n].child = child;
+		if (parse_step(text, &p, &sel->step[sel->n++]) != 0) {
+			selector_free(sel);
+			return (-1);
+		}
+	}
+	*dst = sel;
+	return (0);
+}
+
+void selector_free(struct selector *sel) {
+	int i;
+
+	if (sel == NULL)
+		return;
+	for (i = 0; i < sel->n; i++) {
+		free(sel->step[i].kind);
+		free(sel->step[i].arg);
+		if (sel->step[i].arg_src != NULL)
+			source_free(sel->step[i].arg_src);
+	}
+	free(sel->step);
+	free(sel);
+}
+
+void selector_explain(const struct selector *sel) {
+	const struct sel_step *st;
+	int i;
+
+	if (sel == NULL)
+		return;
+	printf("select: '%s'\n", sel->source);
+	printf("  steps:\n");
+	for (i = 0; i < sel->n; i++) {
+		st = &sel->step[i];
+		printf("    %2d  %s", i + 1, st->kind);
+		if (st->arg != NULL)
+			printf("[%s]", st->arg);
+		if (i == 0)
+			printf("  %s\n", st->child ? "top level" : "anywhere");
+		else
+			printf("  %s %d\n", st->child ? "child of" : "inside", i);
+	}
+}
+
+/*
+ * Check the tokens of a node's key against a step's argument.
+ */
+static int key_matches(const struct block *bl, struct source *arg) {
+	struct token *k, *a;
+
+	k = bl->key;
+	if (k != NULL && k->tok == COMMENT)
+		k = next_tok(k);
+	a = VTAILQ_FIRST(&arg->src_tokens);
+	for (; k != bl->key_end && a->tok != EOI; k = next_tok(k), a = VTAILQ_NEXT(a, src_list)) {
+		if (!tok_eq(k, a))
+			return (0);
+	}
+	return (k == bl->key_end && a->tok == EOI);
+}
+
+static int step_matches(const struct sel_step *st, const struct block *bl) {
+	const struct token *kw;
+	const char *name;
+
+	if (st->type >= 0 && st->type != bl->type)
+		return (0);
+	if (st->type == BLOCK_DECL || st->type == BLOCK_PROP) {
+		kw = bl->kw;
+		name = st->type == BLOCK_PROP ? st->kind + 1 : st->kind;
+		if ((size_t)(kw->e - kw->b) != strlen(name) ||
+		    memcmp(kw->b, name, (size_t)(kw->e - kw->b)) != 0)
+			return (0);
+	}
+	return (st->arg_src == NULL || key_matches(bl, st->arg_src));
+}
+
+static void select_step(const struct block_tree *, const struct selector *, int, int, char *);
+
+/*
+ * Try step si on node i, and the steps after it under i.
+ */
+static void select_node(const struct block_tree *bt, const struct selector *sel, int si, int i, char *mark) {
+	if (!step_matches(&sel->step[si], &bt->b[i]))
+		return;
+	if (si == sel->n - 1)
+		mark[i] = 1;
+	else
+		select_step(bt, sel, si + 1, i, mark);
+}
+
+/*
+ * Mark the nodes that step si and the steps after it pick under node
+ * p (-1 for the top level).  Declarations are only ever top-level
+ * nodes, so a step naming one needs no search below.
+ */
+static void select_step(const struct block_tree *bt, const struct selector *sel, int si, int p, char *mark) {
+	int i, e;
+
+	if (sel->step[si].child || sel->step[si].type == BLOCK_DECL) {
+		for (i = p < 0 ? bt->root : bt->b[p].child; i >= 0; i = bt->b[i].next)
+			select_node(bt, sel, si, i, mark);
+	}
+	else {
+		e = p < 0 ? bt->n : bt->b[p].end;
+		for (i = p + 1; i < e; i++)
+			select_node(bt, sel, si, i, mark);
+	}
+}
+
+int select_scopes(const struct block_tree *bt, const struct selector *sel, struct scope **scopes) {
+	const struct token *close;
+	char *mark;
+	int i, n, cap;
+
+	*scopes = NULL;
+	if (bt->n == 0)
+		return (0);
+	mark = calloc((size_t)bt->n, 1);
+	select_step(bt, sel, 0, -1, mark);
+	n = 0;
+	cap = 0;
+	close = NULL;
+	for (i = 0; i < bt->n; i++) {
+		if (!mark[i] || bt->b[i].close == NULL ||
+		    (close != NULL && bt->b[i].open->b < close->b))
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 16;
+			*scopes = realloc(*scopes, cap * sizeof(**scopes));
+		}
+		(*scopes)[n].open = bt->b[i].open;
+		(*scopes)[n].close = bt->b[i].close;
+		close = bt->b[i].close;
+		n++;
+	}
+	free(mark);
+	return (n);
+}
@@ -0,0 +1,125 @@
+#ifndef TREE_H
+#define TREE_H
+
+struct source;
+struct token;
+struct scope;
+
+/* Kinds of block tree nodes */
+#define BLOCK_DECL 0	/* top-level declaration: sub, backend, acl, ... */
+#define BLOCK_IF 1
+#define BLOCK_ELSEIF 2	/* elseif, elsif, elif or else if */
+#define BLOCK_ELSE 3
+#define BLOCK_PROP 4	/* object property: .probe = { } */
+
+/*
+ * A brace-delimited block.  kw is the token that names its kind
+ * (the declaration keyword, if, else or the property name) and
+ * [key, key_end) the tokens a selector argument is compared with:
+ * the declaration name or the condition, without its parentheses.
+ * Nodes are stored in source order, so the descendants of a node are
+ * the ones after it, up to end.
+ */
+struct block {
+	int type;
+	struct token *kw;
+	struct token *key;
+	struct token *key_end;
+	struct token *open;
+	struct token *close;
+	int parent;
+	int child;
+	int next;
+	int end;
+};
+
+/*
+ * The blocks of a source, built in one pass over its tokens.  root
+ * is the first top-level node; child and next link the rest.
+ * Braces that are none of the node kinds (a bare { } inside a sub)
+ * are not nodes; their blocks belong to the enclosing node.
+ */
+struct block_tree {
+	struct block *b;
+	int n;
+	int cap;
+	int root;
+};
+
+/*
+ * One step of a selector: a node kind (a declaration keyword, if,
+ * elseif, else, .name for a property, or * for any; type is -1 for
+ * any), an optional argument lexed from the text in [ ], and whether
+ * the node must be a child of the previous step's node (>) rather
+ * than any descendant.
+ */
+struct sel_step {
+	int type;
+	char *kind;
+	char *arg;
+	struct source *arg_src;
+	int child;
+};
+
+/*
+ * A compiled --select selector, such as
+ * sub[vcl_recv] > if[req.method == "PURGE"].
+ */
+struct selector {
+	const char *source;
+	struct sel_step *step;
+	int n;
+};
+
+/*
+ * Build the block tree of a lexed source.
+ */
+void block_tree_build(
+	struct block_tree *,
+	struct source *
+);
+
+/*
+ * Free the memory held by a block tree.
+ */
+void block_tree_free(
+	struct block_tree *
+);
+
+/*
+ * Compile a selector.  Sets *dst to NULL if text is NULL.
+ * Returns 0 on success, -1 on a selector error.
+ */
+int selector_compile(
+	const char *,
+	struct selector **
+);
+
+/*
+ * Free a selector from selector_compile() (NULL is allowed).
+ */
+void selector_free(
+	struct selector *
+);
+
+/*
+ * Print a selector's steps for --explain.
+ */
+void selector_explain(
+	const struct selector *
+);
+
+/*
+ * Find the bodies of the blocks a selector picks, in the form
+ * find_scopes() returns.  Each step only looks at the children (or
+ * descendants) of the nodes the step before picked.  A picked block
+ * inside an earlier one is not reported separately.
+ * Returns the number of scopes; *scopes is malloc'd (caller frees).
+ */
+int select_scopes(
+	const struct block_tree *,
+	const struct selector *,
+	struct scope **
+);
+
+#endif
@@ -0,0 +1,232 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "token.h"
+#include "buf.h"
+#include "edit.h"
+#include "lex.h"
+#include "tokfile.h"
+#include "vinyledit.h"
+
+#ifndef VINYL_EDIT_VERSION
+#define VINYL_EDIT_VERSION "unknown"
+#endif
+
+struct ve_doc {
+	char *text;
+	struct source *src;
+	struct source *extract_src;
+};
+
+struct ve_pattern {
+	struct pattern *pat;
+};
+
+const char *ve_version(void) {
+	return (VINYL_EDIT_VERSION);
+}
+
+struct ve_doc *ve_parse(const char *text, size_t len, const char *name) {
+	struct ve_doc *doc;
+
+	doc = calloc(1, sizeof(*doc));
+	doc->text = malloc(len + 1);
+	memcpy(doc->text, text, len);
+	doc->text[len] = '\0';
+	doc->src = source_new(doc->text, "file", name);
+	lex_source(doc->src);
+	add_boundary_tokens(doc->src);
+	if (check_unknown_gaps(doc->src) != 0) {
+		ve_free(doc);
+		return (NULL);
+	}
+	return (doc);
+}
+
+void ve_free(struct ve_doc *doc) {
+	if (doc == NULL)
+		return;
+	source_free(doc->src);
+	if (doc->extract_src != NULL)
+		source_free(doc->extract_src);
+	free(doc->text);
+	free(doc);
+}
+
+struct ve_pattern *ve_pattern_new(const char *text) {
+	struct ve_pattern *vp;
+
+	vp = calloc(1, sizeof(*vp));
+	if (compile_pattern(text, 1, &vp->pat) != 0 || vp->pat == NULL) {
+		free(vp);
+		return (NULL);
+	}
+	return (vp);
+}
+
+void ve_pattern_free(struct ve_pattern *vp) {
+	if (vp == NULL)
+		return;
+	free_pattern(vp->pat);
+	free(vp);
+}
+
+/*
+ * Fill a match constraint from the public options and reset the
+ * step budget.
+ */
+static void setup_match(struct match_constraint *mc, const struct ve_match *m) {
+	memset(mc, 0, sizeof(*mc));
+	mc->max_steps = MATCH_MAX_STEPS;
+	if (m != NULL) {
+		if (m->look_behind != NULL) {
+			mc->look_behind_pat = m->look_behind->pat;
+			mc->look_behind = mc->look_behind_pat->source;
+		}
+		if (m->look_ahead != NULL) {
+			mc->look_ahead_pat = m->look_ahead->pat;
+			mc->look_ahead = mc->look_ahead_pat->source;
+		}
+		if (m->within != NULL) {
+			mc->within_pat = m->within->pat;
+			mc->within = mc->within_pat->source;
+		}
+		mc->limit = m->limit;
+		mc->offset = m->offset;
+		if (m->max_steps > 0)
+			mc->max_steps = m->max_steps;
+	}
+	match_budget_reset(mc->max_steps);
+}
+
+/*
+ * Hand the sink text to the caller as a NUL-terminated string.
+ */
+static int take_output(struct buf *b, char **out, size_t *outlen) {
+	buf_appendc(b, '\0');
+	*out = b->data;
+	*outlen = b->len - 1;
+	b->data = NULL;
+	return (VE_OK);
+}
+
+int ve_format(struct ve_doc *doc, char **out, size_t *outlen) {
+	struct tok_sink sink;
+
+	tok_sink_init(&sink);
+	emit_formatted(doc->src, NULL, NULL, &sink);
+	take_output(&sink.text, out, outlen);
+	tok_sink_free(&sink);
+	return (VE_OK);
+}
+
+int ve_insert(
+    struct ve_doc *doc, const char *text, const struct ve_match *m,
+    char **out, size_t *outlen) {
+	struct insert_opts ins;
+	struct tok_sink sink;
+	int r;
+
+	*out = NULL;
+	*outlen = 0;
+	if (m != NULL && m->offset > 0 && m->limit == 0)
+		return (VE_ERROR);
+	memset(&ins, 0, sizeof(ins));
+	setup_match(&ins.match, m);
+	ins.text = text;
+	ins.src = source_new(text, "insert", "insert");
+	lex_source(ins.src);
+	plan_match(doc->src, &ins.match, NULL);
+
+	tok_sink_init(&sink);
+	r = emit_formatted(doc->src, &ins, NULL, &sink);
+	if (r == 0)
+		take_output(&sink.text, out, outlen);
+	tok_sink_free(&sink);
+	source_free(ins.src);
+	return (r == 0 ? VE_OK : VE_BUDGET);
+}
+
+int ve_replace(
+    struct ve_doc *doc, struct ve_pattern *from, const char *to,
+    const struct ve_match *m, char **out, size_t *outlen) {
+	struct replace_opts rep;
+	struct tok_sink sink;
+	char *to_pp = NULL;
+	int r;
+
+	*out = NULL;
+	*outlen = 0;
+	if (from == NULL || to == NULL ||
+	    (m != NULL && m->offset > 0 && m->limit == 0))
+		return (VE_ERROR);
+	memset(&rep, 0, sizeof(rep));
+	setup_match(&rep.match, m);
+	rep.from_pat = from->pat;
+	rep.from_value = from->pat->source;
+	rep.to_text = to;
+	if (text_needs_raw(to))
+		rep.to_raw = 1;
+	else
+		lex_pattern(to, &rep.to_src, &to_pp);
+	plan_match(doc->src, &rep.match, rep.from_pat);
+
+	tok_sink_init(&sink);
+	r = apply_replace(doc->src, &rep, &sink);
+	if (r == 0)
+		take_output(&sink.text, out, outlen);
+	tok_sink_free(&sink);
+	if (rep.to_src != NULL)
+		source_free(rep.to_src);
+	free(to_pp);
+	return (r == 0 ? VE_OK : VE_BUDGET);
+}
+
+int ve_extract(
+    struct ve_doc *doc, struct ve_pattern *pat, const char *tmpl,
+    const struct ve_match *m, unsigned flags, char **out, size_t *outlen) {
+	struct extract_opts ext;
+	struct buf b;
+	char *to_pp = NULL;
+	int r;
+
+	*out = NULL;
+	*outlen = 0;
+	if (pat == NULL || (m != NULL && m->offset > 0 && m->limit == 0))
+		return (VE_ERROR);
+
+	/* Extract sees comments as tokens: lex a second copy once */
+	if (doc->extract_src == NULL) {
+		doc->extract_src = source_new(doc->text, "file", doc->src->name);
+		lex_source(doc->extract_src);
+		add_boundary_tokens(doc->extract_src);
+		add_comment_tokens(doc->extract_src);
+	}
+
+	memset(&ext, 0, sizeof(ext));
+	setup_match(&ext.match, m);
+	ext.from_pat = pat->pat;
+	ext.from_value = pat->pat->source;
+	ext.to_text = tmpl;
+	ext.strip_ws = (flags & VE_STRIP_WHITESPACE) != 0;
+	if (tmpl != NULL) {
+		if (text_needs_raw(tmpl))
+			ext.to_raw = 1;
+		else
+			lex_pattern(tmpl, &ext.to_src, &to_pp);
+	}
+	plan_match(doc->extract_src, &ext.match, ext.from_pat);
+
+	buf_init(&b);
+	r = cmd_extract(doc->extract_src, &ext, &b);
+	if (r >= 0)
+		take_output(&b, out, outlen);
+	free(b.data);
+	if (ext.to_src != NULL)
+		source_free(ext.to_src);
+	free(to_pp);
+	return (r >= 0 ? VE_OK : VE_BUDGET);
+}
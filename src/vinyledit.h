@@ -0,0 +1,138 @@
+#ifndef VINYLEDIT_H
+#define VINYLEDIT_H
+
+/*
+ * libvinyledit: the vinyl-edit engine as a C library.
+ *
+ * Parse a document once with ve_parse(), compile patterns with
+ * ve_pattern_new(), then run any number of format, insert, replace
+ * and extract calls against it.  The document is never modified;
+ * each call renders its result into a malloc'd, NUL-terminated
+ * buffer that the caller owns and releases with free().
+ *
+ * Diagnostics (syntax and pattern errors) are written to stderr.
+ * Calls share a match step counter, so only one call may run at a
+ * time per process.
+ */
+
+#include <stddef.h>
+
+#define VE_OK 0
+#define VE_ERROR (-1)
+#define VE_BUDGET (-2)
+
+#define VE_STEPS_UNLIMITED ((unsigned long)-1)
+
+#define VE_STRIP_WHITESPACE 0x1
+
+struct ve_doc;
+struct ve_pattern;
+
+/*
+ * Match constraints, as the --look-behind, --look-ahead, --within,
+ * --limit, --offset and --max-steps flags.  Unused patterns are
+ * NULL; limit 0 means unlimited; max_steps 0 selects the default
+ * budget.
+ */
+struct ve_match {
+	struct ve_pattern *look_behind;
+	struct ve_pattern *look_ahead;
+	struct ve_pattern *within;
+	int limit;
+	int offset;
+	unsigned long max_steps;
+};
+
+/*
+ * Return the library version string.
+ */
+const char *ve_version(
+	void
+);
+
+/*
+ * Lex len bytes of VCL text into a document.  name is used in
+ * diagnostics.  Returns NULL if the text has unparseable content.
+ */
+struct ve_doc *ve_parse(
+	const char *,
+	size_t,
+	const char *
+);
+
+/*
+ * Free a document (NULL is allowed).
+ */
+void ve_free(
+	struct ve_doc *
+);
+
+/*
+ * Compile a pattern.  Returns NULL on a pattern error.  A pattern
+ * may be used with any number of documents.
+ */
+struct ve_pattern *ve_pattern_new(
+	const char *
+);
+
+/*
+ * Free a compiled pattern (NULL is allowed).
+ */
+void ve_pattern_free(
+	struct ve_pattern *
+);
+
+/*
+ * Render the document formatted.
+ * Returns VE_OK and sets *out and *outlen.
+ */
+int ve_format(
+	struct ve_doc *,
+	char **,
+	size_t *
+);
+
+/*
+ * Insert VCL text where the constraints match (at the end of the
+ * document if there are none) and render the result.
+ * Returns VE_OK, VE_ERROR or VE_BUDGET.
+ */
+int ve_insert(
+	struct ve_doc *,
+	const char *,
+	const struct ve_match *,
+	char **,
+	size_t *
+);
+
+/*
+ * Replace matches of a pattern with text (which may reference
+ * captures as **1..**9) and render the result.
+ * Returns VE_OK, VE_ERROR or VE_BUDGET.
+ */
+int ve_replace(
+	struct ve_doc *,
+	struct ve_pattern *,
+	const char *,
+	const struct ve_match *,
+	char **,
+	size_t *
+);
+
+/*
+ * Render each match of a pattern, one per line: the matched source
+ * text, or the template (may be NULL) with captures substituted.
+ * flags may include VE_STRIP_WHITESPACE.
+ * Returns VE_OK, VE_ERROR or VE_BUDGET.
+ */
+int ve_extract(
+	struct ve_doc *,
+	struct ve_pattern *,
+	const char *,
+	const struct ve_match *,
+	unsigned,
+	char **,
+	size_t *
+);
+
+#endif
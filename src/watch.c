@@ -0,0 +1,136 @@
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+
+/*
+ * Record the file's identity and timestamps.  Returns 1 if they
+ * differ from the previous record.  A missing file counts as
+ * unchanged until it reappears.
+ */
+static int watch_stamp(struct file_watch *w) {
+	struct stat st;
+	int changed;
+
+	if (stat(w->path, &st) != 0)
+		return (0);
+	changed = st.st_ino != w->ino || st.st_size != w->size ||
+	    st.st_mtime != w->mtime || st.st_ctime != w->ctime;
+	w->ino = st.st_ino;
+	w->size = st.st_size;
+	w->mtime = st.st_mtime;
+	w->ctime = st.st_ctime;
+	return (changed);
+}
+
+int watch_open(struct file_watch *w, const char *path) {
+	char *slash;
+
+	memset(w, 0, sizeof(*w));
+	w->path = path;
+	w->fd = -1;
+	snprintf(w->dir, sizeof(w->dir), "%s", path);
+	slash = strrchr(w->dir, '/');
+	if (slash == NULL) {
+		snprintf(w->dir, sizeof(w->dir), ".");
+		w->base = path;
+	}
+	else {
+		w->base = path + (slash - w->dir) + 1;
+		if (slash == w->dir)
+			slash[1] = '\0';
+		else
+			*slash = '\0';
+	}
+	watch_stamp(w);
+
+#ifdef __linux__
+	/* Fall back to polling if inotify is unavailable or out of watches */
+	w->fd = inotify_init1(IN_CLOEXEC);
+	if (w->fd >= 0 && inotify_add_watch(w->fd, w->dir,
+	    IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE) < 0) {
+		close(w->fd);
+		w->fd = -1;
+	}
+#endif
+	if (access(w->dir, R_OK) != 0) {
+		perror(w->dir);
+		return (-1);
+	}
+	return (0);
+}
+
+#ifdef __linux__
+/*
+ * Read one batch of inotify events.  Returns 1 if any names the
+ * watched file, 0 if none does, -1 on error.
+ */
+static int watch_read(struct file_watch *w) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+	int hit;
+
+	n = read(w->fd, buf, sizeof(buf));
+	if (n < 0) {
+		if (errno == EINTR)
+			return (0);
+		perror("inotify");
+		return (-1);
+	}
+	hit = 0;
+	for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)p;
+		if (ev->len > 0 && strcmp(ev->name, w->base) == 0)
+			hit = 1;
+	}
+	return (hit);
+}
+#endif
+
+int watch_wait(struct file_watch *w) {
+#ifdef __linux__
+	struct pollfd pfd;
+	int r;
+
+	if (w->fd >= 0) {
+		do {
+			r = watch_read(w);
+		} while (r == 0);
+		if (r < 0)
+			return (-1);
+
+		/* Debounce: drain until the directory goes quiet */
+		pfd.fd = w->fd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, WATCH_DEBOUNCE_MS) > 0) {
+			if (watch_read(w) < 0)
+				return (-1);
+		}
+		watch_stamp(w);
+		return (0);
+	}
+#endif
+	while (!watch_stamp(w))
+		usleep(WATCH_POLL_MS * 1000);
+	do {
+		usleep(WATCH_DEBOUNCE_MS * 1000);
+	} while (watch_stamp(w));
+	return (0);
+}
+
+void watch_close(struct file_watch *w) {
+	if (w->fd >= 0)
+		close(w->fd);
+	w->fd = -1;
+}
@@ -0,0 +1,53 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <sys/types.h>
+
+/* Quiet period that ends a burst of changes */
+#define WATCH_DEBOUNCE_MS 50
+
+/* Interval of the stat() fallback when inotify is unavailable */
+#define WATCH_POLL_MS 250
+
+/*
+ * Change notification for one file (--watch).  On Linux the file's
+ * directory is watched with inotify, so editors that save by
+ * renaming a new file into place are seen too.  Elsewhere, or if
+ * inotify can't be set up, the file is polled with stat().
+ */
+struct file_watch {
+	const char *path;
+	char dir[1024];
+	const char *base;
+	int fd;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	time_t ctime;
+};
+
+/*
+ * Start watching path.  Returns 0 on success, -1 on error.
+ */
+int watch_open(
+	struct file_watch *,
+	const char *
+);
+
+/*
+ * Block until the file changes, then until no further change has
+ * been seen for WATCH_DEBOUNCE_MS.  Returns 0 on a change, -1 on
+ * error.
+ */
+int watch_wait(
+	struct file_watch *
+);
+
+/*
+ * Stop watching.
+ */
+void watch_close(
+	struct file_watch *
+);
+
+#endif
@@ -0,0 +1,184 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "token.h"
+#include "buf.h"
+#include "pattern.h"
+#include "index.h"
+#include "splice.h"
+#include "xref.h"
+
+static const char * const sym_keywords[] = {
+	[SYM_BACKEND] = "backend",
+	[SYM_SUB] = "sub",
+	[SYM_ACL] = "acl",
+	[SYM_PROBE] = "probe",
+};
+
+#define NSYM (int)(sizeof(sym_keywords) / sizeof(sym_keywords[0]))
+
+static int tok_text_is(const struct token *t, const char *s, size_t len) {
+	return ((size_t)(t->e - t->b) == len && memcmp(t->b, s, len) == 0);
+}
+
+/* The definition kind a keyword token starts, or SYM_NONE */
+static int def_kind(const struct token *t) {
+	int i;
+
+	if (t->tok != ID)
+		return (SYM_NONE);
+	for (i = 0; i < NSYM; i++) {
+		if (tok_text_is(t, sym_keywords[i], strlen(sym_keywords[i])))
+			return (i);
+	}
+	return (SYM_NONE);
+}
+
+void xref_build(struct xref *x, struct source *src) {
+	struct token *t, *prev;
+	int depth, kind;
+
+	memset(x, 0, sizeof(*x));
+	depth = 0;
+	prev = NULL;
+	VTAILQ_FOREACH(t, &src->src_tokens, src_list) {
+		if (t->tok == SOI || t->tok == COMMENT)
+			continue;
+		if (t->tok == EOI)
+			break;
+		if (t->tok == '{')
+			depth++;
+		else if (t->tok == '}' && depth > 0)
+			depth--;
+		else if (t->tok == ID && memchr(t->b, '.', (size_t)(t->e - t->b)) == NULL &&
+		    (prev == NULL || prev->tok != '.')) {
+			/* A name right after a top-level keyword is defined */
+			kind = SYM_NONE;
+			if (depth == 0 && prev != NULL)
+				kind = def_kind(prev);
+			if (x->n == x->cap) {
+				x->cap = x->cap > 0 ? x->cap * 2 : 256;
+				x->occ = realloc(x->occ, x->cap * sizeof(*x->occ));
+			}
+			x->occ[x->n].t = t;
+			x->occ[x->n].def = kind;
+			x->n++;
+		}
+		prev = t;
+	}
+}
+
+void xref_free(struct xref *x) {
+	free(x->occ);
+	memset(x, 0, sizeof(*x));
+}
+
+void xref_count(const struct xref *x, const char *name, int *ndef, int *nocc, int *kind) {
+	size_t len;
+	int i;
+
+	len = strlen(name);
+	for (i = 0; i < x->n; i++) {
+		if (!tok_text_is(x->occ[i].t, name, len))
+			continue;
+		(*nocc)++;
+		if (x->occ[i].def != SYM_NONE) {
+			(*ndef)++;
+			*kind = x->occ[i].def;
+		}
+	}
+}
+
+int xref_print(
+    const struct xref *x, const struct source *src, const char *path,
+    const char *name, int kind, struct buf *out) {
+	struct line_index li;
+	struct text_pos pos;
+	char line[64];
+	size_t len;
+	int i, n;
+
+	len = strlen(name);
+	n = 0;
+	memset(&li, 0, sizeof(li));
+	for (i = 0; i < x->n; i++) {
+		if (!tok_text_is(x->occ[i].t, name, len))
+			continue;
+		if (li.start == NULL)
+			line_index_build(&li, src->b, src->e, NULL);
+		line_index_pos(&li, x->occ[i].t->b, &pos);
+		snprintf(line, sizeof(line), ":%ld:%ld: ", pos.line, pos.col);
+		buf_appends(out, path);
+		buf_appends(out, line);
+		buf_appends(out, xref_kind_name(kind));
+		buf_appends(out, x->occ[i].def != SYM_NONE ? " definition\n" : " reference\n");
+		n++;
+	}
+	line_index_free(&li);
+	return (n);
+}
+
+/* A VCL identifier: a letter, then letters, digits, _ and - */
+static int valid_name(const char *s) {
+	if (!((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z')))
+		return (0);
+	for (s++; *s != '\0'; s++) {
+		if (!((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') ||
+		    (*s >= '0' && *s <= '9') || *s == '_' || *s == '-'))
+			return (0);
+	}
+	return (1);
+}
+
+int xref_check_rename(const char *old, int ndef, const char *new, int nused) {
+	if (!valid_name(new)) {
+		fprintf(stderr, "rename: not a valid name: %s\n", new);
+		return (-1);
+	}
+	if (strncmp(old, "vcl_", 4) == 0 || strncmp(new, "vcl_", 4) == 0) {
+		fprintf(stderr, "rename: vcl_ names are reserved: %s\n",
+		    strncmp(old, "vcl_", 4) == 0 ? old : new);
+		return (-1);
+	}
+	if (ndef == 0) {
+		fprintf(stderr, "rename: no backend, sub, acl or probe named %s\n", old);
+		return (-1);
+	}
+	if (ndef > 1) {
+		fprintf(stderr, "rename: %s is defined %d times\n", old, ndef);
+		return (-1);
+	}
+	if (nused > 0) {
+		fprintf(stderr, "rename: %s is already in use\n", new);
+		return (-1);
+	}
+	return (0);
+}
+
+void xref_rename(
+    const struct xref *x, const struct source *src, const char *old,
+    const char *new, struct tok_sink *sink) {
+	struct splice_list sl;
+	size_t len, nlen;
+	int i;
+
+	len = strlen(old);
+	nlen = strlen(new);
+	splice_init(&sl);
+	for (i = 0; i < x->n; i++) {
+		if (tok_text_is(x->occ[i].t, old, len))
+			splice_add(&sl, (size_t)(x->occ[i].t->b - src->b),
+			    (size_t)(x->occ[i].t->e - src->b), new, nlen);
+	}
+	splice_write(&sl, src->b, (size_t)(src->e - src->b), sink);
+	splice_free(&sl);
+}
+
+const char *xref_kind_name(int kind) {
+	if (kind < 0 || kind >= NSYM)
+		return ("undefined");
+	return (sym_keywords[kind]);
+}
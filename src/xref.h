@@ -0,0 +1,115 @@
+#ifndef XREF_H
+#define XREF_H
+
+#include <stddef.h>
+
+struct source;
+struct token;
+struct buf;
+struct tok_sink;
+
+/* Kinds of named definitions */
+#define SYM_NONE (-1)
+#define SYM_BACKEND 0
+#define SYM_SUB 1
+#define SYM_ACL 2
+#define SYM_PROBE 3
+
+/*
+ * A plain identifier of a source: one without dots that doesn't
+ * follow a '.' (so not a property name or req.http.X).  def is the
+ * kind it defines, or SYM_NONE for a use.
+ */
+struct xref_occ {
+	struct token *t;
+	int def;
+};
+
+/*
+ * The definitions of and references to backends, subs, ACLs and
+ * probes in one source, built in one pass over its tokens.  Every
+ * plain identifier is recorded, so names defined in another file of
+ * an include graph are found as well.
+ */
+struct xref {
+	struct xref_occ *occ;
+	int n;
+	int cap;
+};
+
+/*
+ * Index the plain identifiers of a lexed source.
+ */
+void xref_build(
+	struct xref *,
+	struct source *
+);
+
+/*
+ * Free the memory held by an index.
+ */
+void xref_free(
+	struct xref *
+);
+
+/*
+ * Count the definitions and all occurrences of a name, and set *kind
+ * to what it is defined as (SYM_NONE if not defined).  Counts are
+ * added to, so several indexes can be summed.
+ */
+void xref_count(
+	const struct xref *,
+	const char *,
+	int *,
+	int *,
+	int *
+);
+
+/*
+ * Append a "file:line:column: kind definition|reference" line to out
+ * for each occurrence of a name, kind being what it is defined as.
+ * Returns the number of occurrences.
+ */
+int xref_print(
+	const struct xref *,
+	const struct source *,
+	const char *,
+	const char *,
+	int,
+	struct buf *
+);
+
+/*
+ * Check that old can be renamed to new, given the total counts from
+ * xref_count() for both: old is defined exactly once, new is a valid
+ * name that isn't used yet, and neither is a reserved vcl_ name.
+ * Returns 0, or -1 after printing why not.
+ */
+int xref_check_rename(
+	const char *,
+	int,
+	const char *,
+	int
+);
+
+/*
+ * Write the source with every occurrence of old renamed to new, the
+ * rest of its bytes untouched: to the token sink if one is given,
+ * otherwise to stdout.
+ */
+void xref_rename(
+	const struct xref *,
+	const struct source *,
+	const char *,
+	const char *,
+	struct tok_sink *
+);
+
+/*
+ * Return the keyword of a definition kind, or "undefined".
+ */
+const char *xref_kind_name(
+	int
+);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * The lex_source() side of lexer-parity, kept apart because
+ * vinyl-edit's struct token and libvcc's share a name.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "token.h"
+#include "lex.h"
+#include "lexer-parity.h"
+
+int lex_spans(const char *text, struct span **out) {
+	struct source *sp;
+	struct token *t;
+	int n, cap;
+
+	sp = source_new(text, "file", "lex_source");
+	lex_source(sp);
+	n = 0;
+	cap = 256;
+	*out = malloc(cap * sizeof(**out));
+	VTAILQ_FOREACH(t, &sp->src_tokens, src_list) {
+		if (n == cap) {
+			cap *= 2;
+			*out = realloc(*out, cap * sizeof(**out));
+		}
+		(*out)[n].tok = t->tok;
+		(*out)[n].b = (long)(t->b - sp->b);
+		(*out)[n].e = (long)(t->e - sp->b);
+		n++;
+	}
+	source_free(sp);
+	return (n);
+}
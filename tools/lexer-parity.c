@@ -0,0 +1,144 @@
+/*
+ * Check that lex_source() produces the same tokens as libvcc's
+ * vcc_Lexer().  Each argument is a VCL file, or a test fixture whose
+ * input section is used.  Prints the first difference per file and
+ * exits 1 if there was any.
+ *
+ *   make test-lexer      (every fixture under test/)
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vcc_compile.h"
+#include "libvcc.h"
+#include "lexer-parity.h"
+
+static int has_suffix(const char *s, const char *suffix) {
+	size_t n = strlen(s), m = strlen(suffix);
+
+	return (n >= m && strcmp(s + n - m, suffix) == 0);
+}
+
+/*
+ * Read a file, keeping only the input section of a fixture: the
+ * lines between the second and third "===" lines.
+ */
+static char *read_input(const char *path) {
+	FILE *f;
+	char *buf, *line;
+	size_t len, cap, n;
+	ssize_t r;
+	int fixture, section;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return (NULL);
+	}
+	fixture = has_suffix(path, ".success") || has_suffix(path, ".fail");
+	section = 0;
+	len = 0;
+	cap = 4096;
+	buf = malloc(cap);
+	line = NULL;
+	n = 0;
+	while ((r = getline(&line, &n, f)) > 0) {
+		if (fixture && strcmp(line, "===\n") == 0) {
+			section++;
+			continue;
+		}
+		if (fixture && section != 2)
+			continue;
+		while (len + (size_t)r + 1 > cap) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+		}
+		memcpy(buf + len, line, (size_t)r);
+		len += (size_t)r;
+	}
+	buf[len] = '\0';
+	free(line);
+	fclose(f);
+	return (buf);
+}
+
+static const char *kind(unsigned tok) {
+	static char s[16];
+
+	if (vcl_tnames[tok] != NULL)
+		return (vcl_tnames[tok]);
+	snprintf(s, sizeof(s), "?%u", tok);
+	return (s);
+}
+
+static void print_span(const char *who, const char *text, const struct span *s) {
+	if (s == NULL) {
+		printf("  %-11s (end)\n", who);
+		return;
+	}
+	printf("  %-11s %-10s [%ld, %ld) %.*s\n", who, kind(s->tok),
+	    s->b, s->e, (int)(s->e - s->b), text + s->b);
+}
+
+/*
+ * Compare the token lists of one input.  Returns the number of
+ * tokens, or -1 on a difference.
+ */
+static int compare(const char *path, const char *text) {
+	struct source *a;
+	struct token *ta;
+	struct span sa, *sb;
+	int i, nb;
+
+	a = vcc_new_source(text, "file", path);
+	vcc_Lexer(VCC_New(), a);
+	nb = lex_spans(text, &sb);
+
+	ta = VTAILQ_FIRST(&a->src_tokens);
+	for (i = 0; ta != NULL || i < nb; i++) {
+		if (ta != NULL) {
+			sa.tok = ta->tok;
+			sa.b = (long)(ta->b - a->b);
+			sa.e = (long)(ta->e - a->b);
+		}
+		if (ta == NULL || i >= nb || sa.tok != sb[i].tok ||
+		    sa.b != sb[i].b || sa.e != sb[i].e) {
+			printf("%s: token %d differs\n", path, i);
+			print_span("vcc_Lexer:", text, ta != NULL ? &sa : NULL);
+			print_span("lex_source:", text, i < nb ? &sb[i] : NULL);
+			free(sb);
+			return (-1);
+		}
+		ta = VTAILQ_NEXT(ta, src_list);
+	}
+	free(sb);
+	return (i);
+}
+
+int main(int argc, char **argv) {
+	char *text;
+	int i, n, files, tokens, failed;
+
+	files = 0;
+	tokens = 0;
+	failed = 0;
+	for (i = 1; i < argc; i++) {
+		text = read_input(argv[i]);
+		if (text == NULL) {
+			failed++;
+			continue;
+		}
+		n = compare(argv[i], text);
+		if (n < 0)
+			failed++;
+		else
+			tokens += n;
+		files++;
+		/* The sources keep pointers into text */
+	}
+	printf("%d files, %d tokens, %d with differences\n", files, tokens, failed);
+	return (failed > 0 ? 1 : 0);
+}
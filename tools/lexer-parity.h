@@ -0,0 +1,23 @@
+#ifndef LEXER_PARITY_H
+#define LEXER_PARITY_H
+
+/*
+ * A token as an offset range into the text, so tokens from libvcc's
+ * struct token and vinyl-edit's can be compared in one place.
+ */
+struct span {
+	unsigned tok;
+	long b;
+	long e;
+};
+
+/*
+ * Lex text with lex_source() (lexer-parity-lex.c).  Returns the
+ * number of tokens stored in a malloc'ed array at *out.
+ */
+int lex_spans(
+	const char *,
+	struct span **
+);
+
+#endif
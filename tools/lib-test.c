@@ -0,0 +1,100 @@
+/*
+ * Smoke test for libvinyledit: parse a small document and run each
+ * call of the public API against it, comparing the rendered output
+ * with what the command line tool prints.  Exits 1 on the first
+ * difference.
+ *
+ *   make test-lib
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vinyledit.h"
+
+static const char doc_text[] =
+    "sub vcl_recv {\n"
+    "set req.http.a = \"1\";\n"
+    "}\n";
+
+static int failed;
+
+/*
+ * Compare a call's result and output with the expected ones, then
+ * release the output.
+ */
+static void check(const char *what, int r, int want_r, char *out, size_t len, const char *want) {
+	if (r != want_r) {
+		fprintf(stderr, "%s: returned %d, expected %d\n", what, r, want_r);
+		failed = 1;
+	}
+	else if (want != NULL && (out == NULL || len != strlen(want) || strcmp(out, want) != 0)) {
+		fprintf(stderr, "%s: got\n%s\nexpected\n%s\n", what, out != NULL ? out : "(null)", want);
+		failed = 1;
+	}
+	free(out);
+}
+
+int main(void) {
+	struct ve_doc *doc;
+	struct ve_pattern *set, *assign, *sub;
+	struct ve_match m;
+	char *out;
+	size_t len;
+	int r;
+
+	if (ve_version() == NULL || *ve_version() == '\0') {
+		fprintf(stderr, "ve_version: empty\n");
+		failed = 1;
+	}
+	doc = ve_parse(doc_text, strlen(doc_text), "test.vcl");
+	set = ve_pattern_new("set *** ;");
+	assign = ve_pattern_new("set ** = ** ;");
+	sub = ve_pattern_new("sub vcl_recv");
+	if (doc == NULL || set == NULL || assign == NULL || sub == NULL) {
+		fprintf(stderr, "ve_parse or ve_pattern_new failed\n");
+		return (1);
+	}
+
+	r = ve_format(doc, &out, &len);
+	check("ve_format", r, VE_OK, out, len,
+	    "sub vcl_recv {\n    set req.http.a = \"1\";\n}\n");
+
+	r = ve_insert(doc, "sub vcl_deliver { }", NULL, &out, &len);
+	check("ve_insert", r, VE_OK, out, len,
+	    "sub vcl_recv {\n    set req.http.a = \"1\";\n}\n\n"
+	    "sub vcl_deliver {\n}\n");
+
+	memset(&m, 0, sizeof(m));
+	m.within = sub;
+	r = ve_insert(doc, "return (pass);", &m, &out, &len);
+	check("ve_insert --within", r, VE_OK, out, len,
+	    "sub vcl_recv {\n    set req.http.a = \"1\";\n"
+	    "    return (pass);\n}\n");
+
+	r = ve_replace(doc, assign, "set **1 = \"2\";", NULL, &out, &len);
+	check("ve_replace", r, VE_OK, out, len,
+	    "sub vcl_recv {\n    set req.http.a = \"2\";\n}\n");
+
+	r = ve_extract(doc, set, NULL, NULL, 0, &out, &len);
+	check("ve_extract", r, VE_OK, out, len, "set req.http.a = \"1\";\n");
+
+	r = ve_extract(doc, assign, "**1", NULL, 0, &out, &len);
+	check("ve_extract template", r, VE_OK, out, len, "req.http.a\n");
+
+	/* --offset without --limit is rejected, as on the command line */
+	memset(&m, 0, sizeof(m));
+	m.offset = 1;
+	r = ve_extract(doc, set, NULL, &m, 0, &out, &len);
+	check("ve_extract offset", r, VE_ERROR, out, len, NULL);
+
+	ve_pattern_free(set);
+	ve_pattern_free(assign);
+	ve_pattern_free(sub);
+	ve_free(doc);
+	if (ve_parse("sub \"\n", 6, "bad.vcl") != NULL) {
+		fprintf(stderr, "ve_parse: accepted an unterminated string\n");
+		failed = 1;
+	}
+	return (failed);
+}
@@ -52,12 +52,21 @@ for test_file in "$TEST_DIR"/*; do
 	tmp=$(mktemp)
 	printf '%s' "$input" > "$tmp"
 
+	# Check for rc=N: prefix — expect exit status N instead
+	run_cmd="$cmd"
+	case "$run_cmd" in
+		rc=[0-9]*:*)
+			expect_rc="${run_cmd%%:*}"
+			expect_rc="${expect_rc#rc=}"
+			run_cmd="${run_cmd#*:}"
+			;;
+	esac
+
 	# Check for pipe: prefix — pipe stdin instead of file arg
 	use_pipe=0
-	run_cmd="$cmd"
-	if [ "${cmd#pipe:}" != "$cmd" ]; then
+	if [ "${run_cmd#pipe:}" != "$run_cmd" ]; then
 		use_pipe=1
-		run_cmd="${cmd#pipe:}"
+		run_cmd="${run_cmd#pipe:}"
 	fi
 
 	# Split into command word and remaining args